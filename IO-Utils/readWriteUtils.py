@@ -2,6 +2,7 @@
 
 import numpy as np
 import array
+import struct
 import glob
 import png
 
@@ -30,6 +31,34 @@ def write2D(x, fName):
     valuesArray.tofile(fileID)
 
 
+# Single-file volumes (.3Dsinodata, .3Dweightdata, .3Dimgdata): a 128 byte header, see
+# struct Volume3DHeader in src/MBIRModularDefs.h, followed by the slices
+volumeHeaderFormat = '<8s6iqq80x'
+
+def readVolume3D(fName):
+    # returns the slices as an array [NSlices, NRows, NColumns] and the number of the first slice
+
+    with open(fName, 'rb') as f:
+        header = f.read(struct.calcsize(volumeHeaderFormat))
+        magic, version, headerSize, NSlices, firstSlice, NRows, NColumns, dataPos, fileSize = struct.unpack(volumeHeaderFormat, header)
+        if magic != b'MBIRVOL3' or version != 1:
+            raise ValueError(fName + ' is not a version 1 volume file')
+        f.seek(dataPos)
+        x = np.fromfile(f, dtype='<f4', count=NSlices*NRows*NColumns).reshape([NSlices, NRows, NColumns])
+
+    return x, firstSlice
+
+def writeVolume3D(x, fName, firstSlice=0):
+    # x is an array [NSlices, NRows, NColumns]
+
+    NSlices, NRows, NColumns = x.shape
+    headerSize = struct.calcsize(volumeHeaderFormat)
+    fileSize = headerSize + 4*NSlices*NRows*NColumns
+    with open(fName, 'wb') as f:
+        f.write(struct.pack(volumeHeaderFormat, b'MBIRVOL3', 1, headerSize, NSlices, firstSlice, NRows, NColumns, headerSize, fileSize))
+        x.astype('<f4').tofile(f)
+
+
 def readImgParams(fName):
     with open(fName) as f:
         content = f.readlines()
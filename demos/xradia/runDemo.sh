@@ -15,5 +15,7 @@ $BIN/Gen_SysMatrix_3D -i $Fname -j $Fname -m $Fname
 #./<Executable File Name> -i <InputFileName>[.imgparams] -j <InputFileName>[.sinoparams]  -k <InputFileName>[.reconparams] \
 # -m <InputFileName>[.2Dsysmatrix] -s <InputFileName>[.2Dsinodata] -w <InputFileName>[.2Dweightdata] -r <OutputFileName>[.2Dimgdata] \
 # Additional option (for initial image): -t <InitialImageFileName>[.2Dimgdata]
+# Instead of -m, -c <CacheDirectory> looks up the System Matrix for the geometry in a cache directory,
+# and generates it there if needed, which makes the Gen_SysMatrix_3D step above unnecessary
 
 $BIN/mbir_3D -i $Fname -j $Fname -k $Fname -m $Fname -s sino/$Fname -w weight/$Fname -r recon/$Fname
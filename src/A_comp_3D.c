@@ -1,10 +1,17 @@
+#define _POSIX_C_SOURCE 200809L  /* for mkdir, getpid */
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <math.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
 
 #include "MBIRModularDefs.h"
 #include "allocate.h"
+#include "MBIRModularUtils.h"
 #include "A_comp_3D.h"
 
 /******************************************************************/
@@ -20,6 +27,46 @@
  */
 
 
+/* Compute the 3 parameters of the pixel-detector profile for one view angle */
+/* Refer to slides "Parallel_beam_CT_FwdModel_v2.pptx" in documentation folder */
+/* The profile is a trapezoid of height maxval, which is nonzero for displacements (in pixel widths) */
+/* from the pixel center smaller than d1 and flat for displacements smaller than d2 */
+
+static void PixelProfileParams3DParallel(
+	float ang,
+	float DeltaPix,
+	float *maxval,
+	float *d1,
+	float *d2)
+{
+	float pi, rc;
+
+	pi = PI; /* defined in MBIRModularDefs.h */
+	rc = sin(pi/4.0); /* Constant sin(pi/4) */
+
+	while (ang >= pi/2.0)
+	{
+		ang -= pi/2.0;
+	}
+	while(ang < 0.0)
+	{
+		ang += pi/2.0;
+	}
+
+	if (ang <= pi/4.0)
+	{
+		*maxval = DeltaPix/cos(ang);
+	}
+	else
+	{
+		*maxval = DeltaPix/cos(pi/2.0-ang);
+	}
+
+	*d1 = rc*cos(pi/4.0-ang);
+	*d2 = rc*fabs(sin(pi/4.0-ang));
+}
+
+
 /* Compute Pixel-detector profile */
 /* Refer to slides "Parallel_beam_CT_FwdModel_v2.pptx" in documentation folder */
 /* The System matrix does not vary with slice for 3-D Parallel Geometry */
@@ -30,16 +77,13 @@ float **ComputePixelProfile3DParallel(
         struct ImageParams3D *imgparams)
 {
 	int i, j;
-	float pi, ang, d1, d2, t, t_1, t_2, t_3, t_4, maxval, rc, DeltaPix;
+	float d1, d2, t, t_1, t_2, t_3, t_4, maxval, DeltaPix;
     float **pix_prof ; /* Detector-pixel profile, indexed by view angle and detector-pixel displacement */
 
 	DeltaPix = imgparams->Deltaxy;
 
 	pix_prof = (float **)get_img(LEN_PIX, sinoparams->NViews, sizeof(float));
 
-	pi = PI; /* defined in MBIRModularDefs.h */
-	rc = sin(pi/4.0); /* Constant sin(pi/4) */
-    
     /* For pixel-detector profile parameters .. */
     /* Refer to slides "Parallel_beam_CT_FwdModel_v2.pptx" in documentation folder */
     /* Compute 3 parameters of the profile function */
@@ -48,28 +92,7 @@ float **ComputePixelProfile3DParallel(
     
 	for (i = 0; i < sinoparams->NViews; i++)
 	{
-		ang = sinoparams->ViewAngles[i];
-
-		while (ang >= pi/2.0)
-		{
-			ang -= pi/2.0;
-		}
-		while(ang < 0.0)
-		{
-			ang += pi/2.0;
-		}
-
-		if (ang <= pi/4.0)
-		{
-			maxval = DeltaPix/cos(ang);
-		}
-		else
-		{
-			maxval = DeltaPix/cos(pi/2.0-ang);
-		}
-
-		d1 = rc*cos(pi/4.0-ang);
-		d2 = rc*fabs(sin(pi/4.0-ang));
+		PixelProfileParams3DParallel(sinoparams->ViewAngles[i], DeltaPix, &maxval, &d1, &d2);
 
 		t_1 = 1.0 - d1;
 		t_2 = 1.0 - d2;
@@ -102,6 +125,96 @@ float **ComputePixelProfile3DParallel(
     return pix_prof;
 }
 
+/* Set up the geometry context used for computing System Matrix columns */
+/* Everything the column computation needs is precomputed here, so that ComputeSysMatrixColumn3DParallel */
+/* keeps no state between calls and can be run by several threads at once */
+
+void InitSysMatrixGeom3DParallel(
+	struct SysMatrixGeom3DParallel *geom,
+	struct SinoParams3DParallel *sinoparams,
+	struct ImageParams3D *imgparams,
+	float **pix_prof)
+{
+	int k, pr;
+
+	geom->NViews = sinoparams->NViews;
+	geom->NChannels = sinoparams->NChannels;
+	geom->DeltaChannel = sinoparams->DeltaChannel; /* detector channel spacing */
+	/* t_0 (mm) - Position of "Detector Channel 0" */
+	/* ith channel position (mm) = t_0 + i*DeltaChannel */
+	geom->t_0 = -(sinoparams->NChannels-1)*sinoparams->DeltaChannel/2.0 - sinoparams->CenterOffset * sinoparams->DeltaChannel;
+
+	geom->Nx = imgparams->Nx;
+	geom->Ny = imgparams->Ny;
+	geom->DeltaPix = imgparams->Deltaxy; /* spacing between pixels (equal in x and y dimensions) */
+	geom->x_0 = -(imgparams->Nx-1)*imgparams->Deltaxy/2.0;
+	geom->y_0 = -(imgparams->Ny-1)*imgparams->Deltaxy/2.0;
+
+	geom->cosine = (double *)get_spc(sinoparams->NViews, sizeof(double));
+	geom->sine = (double *)get_spc(sinoparams->NViews, sizeof(double));
+	geom->prof = (struct PixelProfile3DParallel *)get_spc(sinoparams->NViews, sizeof(struct PixelProfile3DParallel));
+	for (pr = 0; pr < sinoparams->NViews; pr++)
+	{
+		geom->cosine[pr] = cos(sinoparams->ViewAngles[pr]);
+		geom->sine[pr] = sin(sinoparams->ViewAngles[pr]);
+		PixelProfileParams3DParallel(sinoparams->ViewAngles[pr], geom->DeltaPix, &geom->prof[pr].maxval, &geom->prof[pr].d1, &geom->prof[pr].d2);
+	}
+
+	geom->pix_prof = pix_prof;
+	geom->Projector = DEFAULT_PROJECTOR;
+
+	/* Uniform Detector Sensitivity. Weights must sum to one */
+	for (k = 0; k < LEN_DET; k++)
+	{
+		geom->dprof[k] = 1.0/(LEN_DET);
+	}
+}
+
+void FreeSysMatrixGeom3DParallel(struct SysMatrixGeom3DParallel *geom)
+{
+	free((void *)geom->cosine);
+	free((void *)geom->sine);
+	free((void *)geom->prof);
+}
+
+
+/* Analytic projector: the trapezoidal pixel profile is integrated over the detector aperture in closed form */
+/* Displacements s are in pixel widths from the pixel center */
+
+/* Integral of the pixel profile from -infinity to s, in pixel widths */
+static double PixelProfileIntegral(double s, struct PixelProfile3DParallel *prof)
+{
+	double G, h = prof->maxval, d1 = prof->d1, d2 = prof->d2;
+	int upper;
+
+	/* The profile is symmetric, so the integral up to s > 0 is the total minus the integral up to -s */
+	upper = (s > 0.0);
+	s = upper ? -s : s;
+
+	if (s <= -d1)
+		G = 0.0;
+	else if (s <= -d2)
+		G = h*(s+d1)*(s+d1)/(2.0*(d1-d2));  /* rising edge; only reached if d1 > d2 */
+	else
+		G = h*(d1-d2)/2.0 + h*(s+d2);
+
+	return upper ? h*(d1+d2) - G : G;
+}
+
+#ifndef WIDE_BEAM
+/* Value of the pixel profile at s */
+static double PixelProfileValue(double s, struct PixelProfile3DParallel *prof)
+{
+	s = fabs(s);
+	if (s >= prof->d1)
+		return 0.0;
+	if (s <= prof->d2)
+		return prof->maxval;
+	return prof->maxval*(prof->d1-s)/(prof->d1-prof->d2);
+}
+#endif
+
+
 /* Compute the System Matrix column for a given pixel */
 /* Refer to slides "Parallel_beam_CT_FwdModel_v2.pptx" in documentation folder */
 /* The System matrix does not vary with slice for 3-D Parallel Geometry */
@@ -109,68 +222,56 @@ float **ComputePixelProfile3DParallel(
 
 void ComputeSysMatrixColumn3DParallel(
 	int ColumnIndex,
-	struct SinoParams3DParallel *sinoparams,
-	struct ImageParams3D *imgparams,
-	float **pix_prof,
+	struct SysMatrixGeom3DParallel *geom,
 	struct SparseColumn *A_Column)
 {
-    int im_row, im_col ;
-	int ind, ind_min, ind_max, pr;
-	int pix_prof_ind, pind, i, k, proj_count;
-	float Aval, t_min, t_max, ang, x, y;
-	float t, const1, const2, const3, const4;
-	static int Ntheta, NChannels, Nx, Ny;
-	static float DeltaPix, DeltaChannel, t_0, x_0, y_0;
+	int im_row, im_col;
+	int ind_min, ind_max, pr;
+	int i, i_prev, proj_count, run_count;
+	int Ntheta, NChannels, Nx;
+	float Aval, t_min, t_max, x, y;
+	double proj, s, half_aperture;
+	float const3, DeltaPix, DeltaChannel, t_0;
+	float **pix_prof;
 
 #ifdef WIDE_BEAM
-    int prof_ind;
+	int k, pix_prof_ind;
+	float t, const1, const2, const4;
+#else
+	int prof_ind;
 #endif
-    
-	static float dprof[LEN_DET];
-	static int first = 1;
-    
-	t = 0;
-	prof_ind = 0;
-	pix_prof_ind = 0;
 
-	if (first == 1)
-	{
-		first = 0;
-
-		Ntheta = sinoparams->NViews;
-		NChannels = sinoparams->NChannels;
-		DeltaChannel = sinoparams->DeltaChannel; /* detector channel spacing */
-        /* t_0 (mm) - Position of "Detector Channel 0" */
-        /* ith channel position (mm) = t_0 + i*DeltaChannel */
-		t_0 = -(sinoparams->NChannels-1)*sinoparams->DeltaChannel/2.0 - sinoparams->CenterOffset * sinoparams->DeltaChannel;
-
-		Nx = imgparams->Nx;
-		Ny = imgparams->Ny;
-		DeltaPix = imgparams->Deltaxy; /* spacing between pixels (equal in x and y dimensions) */
-		x_0 = -(Nx-1)*imgparams->Deltaxy/2.0;
-		y_0 = -(Ny-1)*imgparams->Deltaxy/2.0;
-
-		/* Uniform Detector Sensitivity. Weights must sum to one */
-		for (k = 0; k < LEN_DET; k++)
-		{
-			dprof[k] = 1.0/(LEN_DET);
-		}
-	} 
+	Ntheta = geom->NViews;
+	NChannels = geom->NChannels;
+	Nx = geom->Nx;
+	DeltaPix = geom->DeltaPix;
+	DeltaChannel = geom->DeltaChannel;
+	t_0 = geom->t_0;
+	pix_prof = geom->pix_prof;
+	half_aperture = DeltaChannel/(2.0*DeltaPix); /* half the channel width, in pixel widths */
+
+#ifdef WIDE_BEAM
+	const1 = t_0 - DeltaChannel/2.0; /* extreme border of 1st detector */
+	const2 = DeltaChannel/(float)(LEN_DET-1); /* detector-element width */
+	const4 = (float)(LEN_PIX-1)/(2.0*DeltaPix); /* spatial resolution of detector-pixel profile function */
+	const1 = const1+const2; /* position of 1st detector element, 1st detector */
+#endif
 
 	/* WATCH THIS : ONLY FOR SQUARE PIXELS NOW   */
-    im_row = ColumnIndex/Nx;
-    im_col = ColumnIndex%Nx;
-	y = y_0 + im_row*DeltaPix;
-	x = x_0 + im_col*DeltaPix;
+	im_row = ColumnIndex/Nx;
+	im_col = ColumnIndex%Nx;
+	y = geom->y_0 + im_row*DeltaPix;
+	x = geom->x_0 + im_col*DeltaPix;
 
 	proj_count = 0;
+	run_count = 0;
 	for (pr = 0; pr < Ntheta; pr++)
 	{
-		pind = pr*NChannels;
-		ang = sinoparams->ViewAngles[pr];
+		i_prev = -2;
+		proj = y*geom->cosine[pr] - x*geom->sine[pr]; /* pixel coordinate projected onto detector axis */
 
 		/* Range of interest for pixel profile.  Here, this is 2 pixel widths from the (projected) center of the pixel */
-		t_min = y*cos(ang) - x*sin(ang) - DeltaPix;
+		t_min = proj - DeltaPix;
 		t_max = t_min + 2.0*DeltaPix;
 		/* This also prevents over-reach (with rounding of negative numbers)  */
 		if (t_max < t_0) 
@@ -186,118 +287,871 @@ void ComputeSysMatrixColumn3DParallel(
 		ind_min = (ind_min<0) ? 0 : ind_min;
 		ind_max = (ind_max>=NChannels) ? NChannels-1 : ind_max;
 
-		const1 = t_0 - DeltaChannel/2.0; /* extreme border of 1st detector */
-		const2 = DeltaChannel/(float)(LEN_DET-1); /* detector-element width */
-		const3 = DeltaPix - (y*cos(ang) - x*sin(ang)); /* (y*cos(ang) - x*sin(ang)) = pixel coordinate projected onto detector axis */
-		const4 = (float)(LEN_PIX-1)/(2.0*DeltaPix); /* spatial resolution of detector-pixel profile function */
-        const1 = const1+const2; /* position of 1st detector element, 1st detector */
+		const3 = DeltaPix - proj;
 
 		for (i = ind_min; i <= ind_max; i++)
 		{
-			ind = pind + i;
-
+			if (geom->Projector == SYSMATRIX2D_PROJECTOR_ANALYTIC)
+			{
+				s = (t_0 + i*DeltaChannel - proj)/DeltaPix; /* channel center relative to the pixel */
 #ifdef WIDE_BEAM
-            /* Split the aperture of a given detector into smaller elements, because sensitivity may vary across detector aperture */
-            /* Final forward projection is a weighted sum of the projections measured by smaller elements */
-			Aval = 0;
-			for (k = 0; k < LEN_DET; k++)
+				/* Average of the profile over the channel aperture */
+				Aval = (PixelProfileIntegral(s + half_aperture, &geom->prof[pr]) - PixelProfileIntegral(s - half_aperture, &geom->prof[pr]))/(2.0*half_aperture);
+#else
+				Aval = PixelProfileValue(s, &geom->prof[pr]);
+#endif
+			}
+			else
 			{
-				t = const1 + (float)i*DeltaChannel + (float)k*const2; /* Detector element position */
-				pix_prof_ind = (t+const3)*const4 +0.5;   /* +0.5 for rounding */
-				if (pix_prof_ind >= 0 && pix_prof_ind < LEN_PIX)
+#ifdef WIDE_BEAM
+				/* Split the aperture of a given detector into smaller elements, because sensitivity may vary across detector aperture */
+				/* Final forward projection is a weighted sum of the projections measured by smaller elements */
+				Aval = 0;
+				for (k = 0; k < LEN_DET; k++)
 				{
-					Aval+= dprof[k]*pix_prof[pr][pix_prof_ind];
+					t = const1 + (float)i*DeltaChannel + (float)k*const2; /* Detector element position */
+					pix_prof_ind = (t+const3)*const4 +0.5;   /* +0.5 for rounding */
+					if (pix_prof_ind >= 0 && pix_prof_ind < LEN_PIX)
+					{
+						Aval+= geom->dprof[k]*pix_prof[pr][pix_prof_ind];
+					}
 				}
-			}
 #else
-			/*** Only use center of detector aperture while computing detector-pixel profile ****/
-			prof_ind = LEN_PIX*(t_0+i*DeltaChannel+const3)/(2.0*DeltaPix);
+				/*** Only use center of detector aperture while computing detector-pixel profile ****/
+				prof_ind = LEN_PIX*(t_0+i*DeltaChannel+const3)/(2.0*DeltaPix);
 
-			if (prof_ind >= LEN_PIX || prof_ind < 0)
-			{
-				if (prof_ind == LEN_PIX)
-				{
-					prof_ind = LEN_PIX-1;
-				}
-				else if (prof_ind == -1)
-				{
-					prof_ind = 0;
-				}
-				else
+				if (prof_ind >= LEN_PIX || prof_ind < 0)
 				{
-					fprintf(stderr,"\nExiting Program: input parameters inconsistant\n");
-					exit(-1);
+					if (prof_ind == LEN_PIX)
+					{
+						prof_ind = LEN_PIX-1;
+					}
+					else if (prof_ind == -1)
+					{
+						prof_ind = 0;
+					}
+					else
+					{
+						fprintf(stderr,"\nExiting Program: input parameters inconsistant\n");
+						exit(-1);
+					}
 				}
-			}
-			Aval = pix_prof[pr][prof_ind];
+				Aval = pix_prof[pr][prof_ind];
 #endif
+			}
 
 			if (Aval > 0.0)
 			{
 				A_Column->Value[proj_count] = Aval;
-				A_Column->RowIndex[proj_count] = ind;   /* Index for ray */
+				/* Extend the current run if the previous channel of this view was nonzero too */
+				if (i == i_prev+1)
+				{
+					A_Column->Run[run_count-1].Length++;
+				}
+				else
+				{
+					A_Column->Run[run_count].View = pr;
+					A_Column->Run[run_count].FirstChannel = i;
+					A_Column->Run[run_count].Length = 1;
+					run_count++;
+				}
+				i_prev = i;
 				proj_count++;
 			}
 		}
 	} 
 
 	A_Column->Nnonzero = proj_count;
+	A_Column->Nrun = run_count;
+}
+
+
+/* Record the projector settings a System Matrix is computed with */
+static void SetProjectorParams3DParallel(struct SysMatrixParams2D *params, int Projector)
+{
+    params->Projector = Projector;
+    if (Projector == SYSMATRIX2D_PROJECTOR_ANALYTIC)
+    {
+        params->LenPix = 0;
+#ifdef WIDE_BEAM
+        params->LenDet = 0;
+#else
+        params->LenDet = 1;
+#endif
+    }
+    else
+    {
+        params->LenPix = LEN_PIX;
+#ifdef WIDE_BEAM
+        params->LenDet = LEN_DET;
+#else
+        params->LenDet = 1;
+#endif
+    }
+}
+
+
+/* Upper bound on the number of nonzero entries of a column */
+/* The pixel profile spans 2 pixel widths, so a column has at most 2*DeltaPix/DeltaChannel+2 */
+/* nonzero entries per view */
+static int MaxColumnNnonzero3DParallel(struct SysMatrixGeom3DParallel *geom)
+{
+    int MaxChannelsPerView;
+
+    MaxChannelsPerView = 2.0*geom->DeltaPix/geom->DeltaChannel + 3;
+    MaxChannelsPerView = (MaxChannelsPerView > geom->NChannels) ? geom->NChannels : MaxChannelsPerView;
+    return geom->NViews*MaxChannelsPerView;
+}
+
+
+/* Memory of the matrix-free mode: the cached columns, each with room for MaxColumnNnonzero entries. */
+/* Without a cache, bound the size of a matrix file instead: a column has at most a run per view */
+long SysMatrixBytes3DParallel(
+       struct SinoParams3DParallel *sinoparams,
+       struct ImageParams3D *imgparams,
+       int NCacheColumns)
+{
+    struct SysMatrixGeom3DParallel geom;
+    long Ncolumns, MaxNnonzero;
+
+    geom.NViews = sinoparams->NViews;
+    geom.NChannels = sinoparams->NChannels;
+    geom.DeltaChannel = sinoparams->DeltaChannel;
+    geom.DeltaPix = imgparams->Deltaxy;
+    MaxNnonzero = MaxColumnNnonzero3DParallel(&geom);
+    Ncolumns = (long)imgparams->Nx*imgparams->Ny;
+
+    if (NCacheColumns >= 0)
+    {
+        Ncolumns = (NCacheColumns < Ncolumns) ? NCacheColumns : Ncolumns;
+        return Ncolumns*(MaxNnonzero*(long)(sizeof(float) + sizeof(struct SparseRun)) + (long)(sizeof(int) + sizeof(struct SparseColumn)));
+    }
+    return SYSMATRIX2D_HEADER_SIZE + Ncolumns*(MaxNnonzero*(long)sizeof(float) + geom.NViews*(long)sizeof(struct SparseRun))
+         + 2*(Ncolumns+1)*(long)sizeof(long);
+}
+
+
+/* Matrix-free mode: compute the columns of the System Matrix when they are needed */
+
+static void ComputeColumnOnTheFly3DParallel(int ColumnIndex, void *ColumnContext, struct SparseColumn *A_Column)
+{
+    ComputeSysMatrixColumn3DParallel(ColumnIndex, (struct SysMatrixGeom3DParallel *)ColumnContext, A_Column);
+}
+
+void InitSysMatrixOnTheFly3DParallel(
+    struct SysMatrix2D *A,
+    struct SysMatrixGeom3DParallel *geom,
+    int NCacheColumns)
+{
+    if (geom->NViews-1 > SPARSERUN_MAX_INDEX || geom->NChannels > SPARSERUN_MAX_INDEX)
+    {
+        fprintf(stderr, "InitSysMatrixOnTheFly3DParallel: at most %d views and channels are supported\n", SPARSERUN_MAX_INDEX);
+        exit(-1);
+    }
+
+    A->Ncolumns = geom->Nx*geom->Ny;
+    A->Nstored = A->Ncolumns;
+    A->column = NULL;
+    A->Nnonzero = 0;
+    A->Nrun = 0;
+    A->ColumnOffset = NULL;
+    A->RunOffset = NULL;
+    A->Run = NULL;
+    A->ValueType = SYSMATRIX2D_VALUE_FLOAT;
+    A->Value = NULL;
+    A->Value16 = NULL;
+    A->Value8 = NULL;
+    A->Scale = NULL;
+    A->SymColumn = NULL;
+    A->SymOp = NULL;
+    A->SymView = NULL;
+    A->MapAddr = NULL;
+    A->MapLength = 0;
+    SetProjectorParams3DParallel(&A->params, geom->Projector);
+
+    A->MaxColumnNnonzero = MaxColumnNnonzero3DParallel(geom);
+    A->ComputeColumn = ComputeColumnOnTheFly3DParallel;
+    A->ColumnContext = geom;
+    AllocateSysMatrix2DCache(A, NCacheColumns);
+}
+
+
+/* Pixel-grid symmetries of the System Matrix */
+/* A symmetry g of the pixel grid about the center of the image maps the projection of pixel p onto the */
+/* projection of pixel g(p): proj_g(p)(theta) = sign*proj_p(phi(theta)). If phi(theta_k) equals view angle */
+/* theta_k' up to a multiple m of pi, column g(p) at view k is column p at view k', with the channels */
+/* reversed if sign*(-1)^m is negative. The trapezoidal profile depends only on the angle mod pi/2 and */
+/* its mirror image, so this holds exactly for the analytic projector */
+
+#define SYM_ANGLE_TOL 1e-5  /* Tolerance (radians) for matching view angles */
+
+/* Fill in ViewMap (see SysMatrix2D.SymView) for symmetry op. Returns 1 if op is a symmetry of the */
+/* view angles and the detector, 0 otherwise */
+static int SymmetryViewMap3DParallel(
+    struct SinoParams3DParallel *sinoparams,
+    int op,
+    int *ViewMap)
+{
+    double phi, d, m;
+    int k, kk, sign, found;
+
+    for (k = 0; k < sinoparams->NViews; k++)
+        ViewMap[k] = sinoparams->NViews; /* unassigned */
+
+    for (k = 0; k < sinoparams->NViews; k++)
+    {
+        phi = sinoparams->ViewAngles[k];
+        sign = 1;
+        switch (op)
+        {
+            case SYSMATRIX2D_SYM_POINT: sign = -1; break;
+            case SYSMATRIX2D_SYM_MIRROR_X: phi = -phi; break;
+            case SYSMATRIX2D_SYM_MIRROR_Y: phi = -phi; sign = -1; break;
+            case SYSMATRIX2D_SYM_TRANSPOSE: phi = PI/2.0 - phi; sign = -1; break;
+            case SYSMATRIX2D_SYM_ANTITRANSPOSE: phi = PI/2.0 - phi; break;
+            case SYSMATRIX2D_SYM_ROTATE90: phi = phi - PI/2.0; break;
+            case SYSMATRIX2D_SYM_ROTATE270: phi = phi - PI/2.0; sign = -1; break;
+        }
+        for (kk = 0, found = 0; kk < sinoparams->NViews && !found; kk++)
+        {
+            d = phi - sinoparams->ViewAngles[kk];
+            m = floor(d/PI + 0.5);
+            found = (fabs(d - m*PI) < SYM_ANGLE_TOL);
+        }
+        if (!found)
+            return(0);
+        kk--;
+        if (ViewMap[kk] != sinoparams->NViews)
+            return(0); /* not a bijection */
+        if (fmod(fabs(m), 2.0) == 1.0)
+            sign = -sign;
+        /* Reversing the channels reflects the detector about channel (NChannels-1)/2 */
+        if (sign < 0 && sinoparams->CenterOffset != 0.0)
+            return(0);
+        ViewMap[kk] = (sign > 0) ? k : -1-k;
+    }
+    return(1);
+}
+
+/* Pixel (row, col) mapped by symmetry op; the grid must be square for the transposes and rotations */
+static int SymmetricPixel3DParallel(int op, int row, int col, int Nx, int Ny)
+{
+    switch (op)
+    {
+        case SYSMATRIX2D_SYM_POINT: return (Ny-1-row)*Nx + (Nx-1-col);
+        case SYSMATRIX2D_SYM_MIRROR_X: return row*Nx + (Nx-1-col);
+        case SYSMATRIX2D_SYM_MIRROR_Y: return (Ny-1-row)*Nx + col;
+        case SYSMATRIX2D_SYM_TRANSPOSE: return col*Nx + row;
+        case SYSMATRIX2D_SYM_ANTITRANSPOSE: return (Nx-1-col)*Nx + (Nx-1-row);
+        case SYSMATRIX2D_SYM_ROTATE90: return col*Nx + (Nx-1-row);
+        case SYSMATRIX2D_SYM_ROTATE270: return (Nx-1-col)*Nx + row;
+    }
+    return row*Nx + col;
+}
+
+/* Find the symmetries of the geometry and fill in A->SymColumn, A->SymOp, A->SymView and A->Nstored */
+/* Returns the pixel index of each stored column (to be freed by the caller), or NULL if there is no symmetry */
+static int *SetSysMatrixSymmetries3DParallel(
+    struct SysMatrix2D *A,
+    struct SinoParams3DParallel *sinoparams,
+    struct ImageParams3D *imgparams)
+{
+    static const char *SymName[SYSMATRIX2D_NSYM] = {"identity", "point", "mirror-x", "mirror-y",
+        "transpose", "anti-transpose", "rotate-90", "rotate-270"};
+    int valid[SYSMATRIX2D_NSYM];
+    int *StoredPixel;
+    int op, i, q, s, Nx, Ny, NViews, Nvalid;
+
+    Nx = imgparams->Nx;
+    Ny = imgparams->Ny;
+    NViews = sinoparams->NViews;
+    A->SymColumn = (int *)get_spc(A->Ncolumns, sizeof(int));
+    A->SymOp = (unsigned char *)get_spc(A->Ncolumns, sizeof(unsigned char));
+    A->SymView = (int *)get_spc(SYSMATRIX2D_NSYM*NViews, sizeof(int));
+
+    fprintf(stdout, "Pixel-grid symmetries:");
+    for (op = 0, Nvalid = 0; op < SYSMATRIX2D_NSYM; op++)
+    {
+        valid[op] = (op < SYSMATRIX2D_SYM_TRANSPOSE || Nx == Ny) && SymmetryViewMap3DParallel(sinoparams, op, A->SymView + op*NViews);
+        if (!valid[op])
+            for (i = 0; i < NViews; i++)
+                A->SymView[op*NViews + i] = i;
+        else if (op != SYSMATRIX2D_SYM_IDENTITY)
+        {
+            fprintf(stdout, " %s", SymName[op]);
+            Nvalid++;
+        }
+    }
+    if (Nvalid == 0)
+    {
+        fprintf(stdout, " none\n");
+        free((void *)A->SymColumn);
+        free((void *)A->SymOp);
+        free((void *)A->SymView);
+        A->SymColumn = NULL;
+        A->SymOp = NULL;
+        A->SymView = NULL;
+        return NULL;
+    }
+
+    /* Store the first pixel of each orbit, in index order */
+    for (i = 0; i < A->Ncolumns; i++)
+        A->SymColumn[i] = -1;
+    StoredPixel = (int *)get_spc(A->Ncolumns, sizeof(int));
+    for (i = 0, s = 0; i < A->Ncolumns; i++)
+    {
+        if (A->SymColumn[i] >= 0)
+            continue;
+        StoredPixel[s] = i;
+        for (op = 0; op < SYSMATRIX2D_NSYM; op++)
+        {
+            q = SymmetricPixel3DParallel(op, i/Nx, i%Nx, Nx, Ny);
+            if (valid[op] && A->SymColumn[q] < 0)
+            {
+                A->SymColumn[q] = s;
+                A->SymOp[q] = op;
+            }
+        }
+        s++;
+    }
+    A->Nstored = s;
+    fprintf(stdout, "\n\tstoring %d of %d columns\n", A->Nstored, A->Ncolumns);
+
+    return StoredPixel;
 }
 
 
 /* Compute Entire System Matrix */
 /* The System matrix does not vary with slice for 3-D Parallel Geometry */
 /* So, the method of compuatation is same as that of 2-D Parallel Geometry */
+/* Columns are independent, so they are distributed over OpenMP threads, each with its own scratch column. */
+/* Consecutive columns are gathered per block of COLUMNS_PER_BLOCK into a growing block buffer; once all */
+/* column sizes are known, the blocks are packed into the contiguous arena of the matrix */
+/* With UseSymmetry (analytic projector only), only one column per orbit of the pixel-grid symmetries is computed */
+/* The sampled projector looks its profile up at the left edge of each of the LEN_PIX bins, which is not */
+/* symmetric about the pixel center, so its columns are not exact remaps of each other and are all stored */
+
+#define COLUMNS_PER_BLOCK 256
+
+struct ColumnBlock
+{
+    long Nnonzero;      /* Number of entries stored in the block so far */
+    long Capacity;      /* Allocated number of entries */
+    long Nrun;          /* Number of runs stored in the block so far */
+    long RunCapacity;   /* Allocated number of runs */
+    struct SparseRun *Run;
+    float *Value;
+};
+
+/* Append the runs and non-zero entries of a column to the block buffer */
+static void AppendColumnBlock(struct ColumnBlock *blk, struct SparseColumn *column)
+{
+    if (blk->Nnonzero + column->Nnonzero > blk->Capacity)
+    {
+        blk->Capacity = 2*(blk->Nnonzero + column->Nnonzero);
+        blk->Value = (float *)realloc(blk->Value, blk->Capacity*sizeof(float));
+    }
+    if (blk->Nrun + column->Nrun > blk->RunCapacity)
+    {
+        blk->RunCapacity = 2*(blk->Nrun + column->Nrun);
+        blk->Run = (struct SparseRun *)realloc(blk->Run, blk->RunCapacity*sizeof(struct SparseRun));
+    }
+    if ((blk->Capacity > 0 && blk->Value == NULL) || (blk->RunCapacity > 0 && blk->Run == NULL))
+    {
+        fprintf(stderr, "ComputeSysMatrix3DParallel: out of memory\n");
+        exit(-1);
+    }
+    memcpy(blk->Run + blk->Nrun, column->Run, column->Nrun*sizeof(struct SparseRun));
+    memcpy(blk->Value + blk->Nnonzero, column->Value, column->Nnonzero*sizeof(float));
+    blk->Nrun += column->Nrun;
+    blk->Nnonzero += column->Nnonzero;
+}
 
 struct SysMatrix2D *ComputeSysMatrix3DParallel(
        struct SinoParams3DParallel *sinoparams,
        struct ImageParams3D *imgparams,
-       float **pix_prof)
+       float **pix_prof,
+       int Projector,
+       int UseSymmetry)
 {
     struct SysMatrix2D *A ; /* Forward Matrix in sparse format */
-    struct SparseColumn TempColumn;
-	int i,r;
-	int MaxNnonzero;
+    struct SysMatrixGeom3DParallel geom;
+    struct ColumnBlock *block;
+    int i, b, Nblocks, Ndone;
+    int MaxNnonzero;
+    long *Nnonzero, *Nrun;
+    int *SymColumn, *SymView, *StoredPixel;
+    unsigned char *SymOp;
     
     A = (struct SysMatrix2D *)malloc(sizeof(struct SysMatrix2D));
     A->Ncolumns = imgparams->Nx * imgparams->Ny ;
-    A->column = (struct SparseColumn *)get_spc(A->Ncolumns, sizeof(struct SparseColumn));
+    A->Nstored = A->Ncolumns;
+    A->SymColumn = NULL;
+    A->SymOp = NULL;
+    A->SymView = NULL;
+    SetSysMatrixParams2D(&A->params, sinoparams, imgparams);
 
-		fprintf(stdout, "\nComputing System Matrix ...\n");
-		fflush(stdout);
+    /* Views and channels are stored as 16 bit indices in the runs of each column */
+    if (sinoparams->NViews-1 > SPARSERUN_MAX_INDEX || sinoparams->NChannels > SPARSERUN_MAX_INDEX)
+    {
+        fprintf(stderr, "ComputeSysMatrix3DParallel: at most %d views and channels are supported\n", SPARSERUN_MAX_INDEX);
+        exit(-1);
+    }
 
-		MaxNnonzero = sinoparams->NChannels*sinoparams->NViews; /* Maximum no. of non-zero entries in the A matrix column */
+    fprintf(stdout, "\nComputing System Matrix ...\n");
+    StoredPixel = NULL;
+    if (UseSymmetry && Projector == SYSMATRIX2D_PROJECTOR_ANALYTIC)
+        StoredPixel = SetSysMatrixSymmetries3DParallel(A, sinoparams, imgparams);
+    SymColumn = A->SymColumn;
+    SymOp = A->SymOp;
+    SymView = A->SymView;
+    fflush(stdout);
 
-		TempColumn.RowIndex = (int *)get_spc(MaxNnonzero, sizeof(int));
+    InitSysMatrixGeom3DParallel(&geom, sinoparams, imgparams, pix_prof);
+    geom.Projector = Projector;
+    SetProjectorParams3DParallel(&A->params, Projector);
+    MaxNnonzero = MaxColumnNnonzero3DParallel(&geom); /* Maximum no. of non-zero entries in the A matrix column */
+
+    Nblocks = (A->Nstored + COLUMNS_PER_BLOCK - 1)/COLUMNS_PER_BLOCK;
+    block = (struct ColumnBlock *)get_spc(Nblocks, sizeof(struct ColumnBlock));
+    Nnonzero = (long *)get_spc(A->Nstored, sizeof(long));
+    Nrun = (long *)get_spc(A->Nstored, sizeof(long));
+    Ndone = 0;
+
+    printf("\n");
+    #pragma omp parallel private(i, b)
+    {
+        struct SparseColumn TempColumn;
+        struct ColumnBlock *blk;
+        int count;
+
+        TempColumn.Run = (struct SparseRun *)get_spc(MaxNnonzero, sizeof(struct SparseRun));
         TempColumn.Value = (float *)get_spc(MaxNnonzero, sizeof(float));
-    
-        printf("\n");
-		for (i = 0; i < A->Ncolumns; i++)
-		{
-            if(i%100==0)
+
+        #pragma omp for schedule(dynamic)
+        for (b = 0; b < Nblocks; b++)
+        {
+            blk = &block[b];
+            for (i = b*COLUMNS_PER_BLOCK; i < A->Nstored && i < (b+1)*COLUMNS_PER_BLOCK; i++)
             {
-                printf("\r\tProgress = %2.1f %%", (float)i/A->Ncolumns*100.0); fflush(stdout);
+                ComputeSysMatrixColumn3DParallel((StoredPixel != NULL) ? StoredPixel[i] : i, &geom, &TempColumn);
+                Nnonzero[i] = TempColumn.Nnonzero;
+                Nrun[i] = TempColumn.Nrun;
+                AppendColumnBlock(blk, &TempColumn);
+
+                #pragma omp atomic capture
+                count = ++Ndone;
+                if(count%100==0)
+                {
+                    printf("\r\tProgress = %2.1f %%", (float)count/A->Nstored*100.0); fflush(stdout);
+                }
             }
-            ComputeSysMatrixColumn3DParallel(i, sinoparams, imgparams, pix_prof, &TempColumn);
+        }
+        free((void *)TempColumn.Value);
+        free((void *)TempColumn.Run);
+    }
+    printf("\n");
 
-                A->column[i].Nnonzero = TempColumn.Nnonzero;
-				A->column[i].Value = (float *)get_spc(TempColumn.Nnonzero,sizeof(float));
-				A->column[i].RowIndex = (int *)get_spc(TempColumn.Nnonzero,sizeof(int));
-                /* Copy non-zero entries from TempColumn to A->column[i] */
-				for (r = 0; r < TempColumn.Nnonzero; r++)
-				{
-					A->column[i].Value[r] = (float)TempColumn.Value[r];
-					A->column[i].RowIndex[r] = TempColumn.RowIndex[r];
-				}
-		}
-        printf("\n");
-		free((void *)TempColumn.Value);
-		free((void *)TempColumn.RowIndex);
+    /* Pack the blocks into the arena */
+    A->Nnonzero = 0;
+    A->Nrun = 0;
+    A->ValueType = SYSMATRIX2D_VALUE_FLOAT;
+    for (b = 0; b < Nblocks; b++)
+    {
+        A->Nnonzero += block[b].Nnonzero;
+        A->Nrun += block[b].Nrun;
+    }
+    AllocateSysMatrix2D(A);
+    A->SymColumn = SymColumn;
+    A->SymOp = SymOp;
+    A->SymView = SymView;
+
+    A->ColumnOffset[0] = 0;
+    A->RunOffset[0] = 0;
+    for (i = 0; i < A->Nstored; i++)
+    {
+        A->ColumnOffset[i+1] = A->ColumnOffset[i] + Nnonzero[i];
+        A->RunOffset[i+1] = A->RunOffset[i] + Nrun[i];
+    }
+    SetSysMatrix2DColumns(A);
 
-		fprintf(stdout, "System Matrix Computation done \n");
-		fflush(stdout);
+    #pragma omp parallel for schedule(dynamic)
+    for (b = 0; b < Nblocks; b++)
+    {
+        memcpy(A->Run + A->RunOffset[b*COLUMNS_PER_BLOCK], block[b].Run, block[b].Nrun*sizeof(struct SparseRun));
+        memcpy(A->Value + A->ColumnOffset[b*COLUMNS_PER_BLOCK], block[b].Value, block[b].Nnonzero*sizeof(float));
+        free((void *)block[b].Run);
+        free((void *)block[b].Value);
+    }
+
+    free((void *)block);
+    free((void *)Nnonzero);
+    free((void *)Nrun);
+    free((void *)StoredPixel);
+    FreeSysMatrixGeom3DParallel(&geom);
+
+    fprintf(stdout, "System Matrix Computation done \n");
+    fprintf(stdout, "\t%ld nonzero entries in %ld runs (%.1f entries per run)\n", A->Nnonzero, A->Nrun, A->Nrun > 0 ? (float)A->Nnonzero/A->Nrun : 0.0);
+    fflush(stdout);
     
     return A;
 }
 
 
+/* Compute the System Matrix and write it to <fname>.2Dsysmatrix without holding it in memory */
+/* Columns are computed by all threads into one of two batches of BLOCKS_PER_BATCH blocks, while one */
+/* thread writes the other batch through the streaming writer and then joins the computation. So */
+/* the memory used is bounded by two batches, and computation overlaps with writing */
+
+#define BLOCKS_PER_BATCH 16
+
+int WriteSysMatrix3DParallel(
+       char *fname,
+       struct SinoParams3DParallel *sinoparams,
+       struct ImageParams3D *imgparams,
+       float **pix_prof,
+       int Projector,
+       int UseSymmetry,
+       int ValueType)
+{
+    struct SysMatrix2D A;   /* Layout of the matrix; the columns are never stored in A */
+    struct SysMatrixGeom3DParallel geom;
+    struct SysMatrix2DWriter *writer;
+    struct ColumnBlock *block;
+    int *StoredPixel;
+    int j, Nblocks, Nbatches, Nwritten, ok;
+    long *Nnonzero, *Nrun;
+
+    if (sinoparams->NViews-1 > SPARSERUN_MAX_INDEX || sinoparams->NChannels > SPARSERUN_MAX_INDEX)
+    {
+        fprintf(stderr, "WriteSysMatrix3DParallel: at most %d views and channels are supported\n", SPARSERUN_MAX_INDEX);
+        exit(-1);
+    }
+
+    A.Ncolumns = imgparams->Nx * imgparams->Ny;
+    A.Nstored = A.Ncolumns;
+    A.ValueType = ValueType;
+    A.SymColumn = NULL;
+    A.SymOp = NULL;
+    A.SymView = NULL;
+    SetSysMatrixParams2D(&A.params, sinoparams, imgparams);
+    SetProjectorParams3DParallel(&A.params, Projector);
+
+    fprintf(stdout, "\nComputing System Matrix ...\n");
+    StoredPixel = NULL;
+    if (UseSymmetry && Projector == SYSMATRIX2D_PROJECTOR_ANALYTIC)
+        StoredPixel = SetSysMatrixSymmetries3DParallel(&A, sinoparams, imgparams);
+    else if (UseSymmetry)
+        fprintf(stdout, "Storing all columns: pixel-grid symmetries are only used with the analytic projector\n");
+    fflush(stdout);
+
+    InitSysMatrixGeom3DParallel(&geom, sinoparams, imgparams, pix_prof);
+    geom.Projector = Projector;
+    A.MaxColumnNnonzero = MaxColumnNnonzero3DParallel(&geom);
+    writer = OpenSysMatrix2DWriter(fname, &A);
+
+    Nblocks = (A.Nstored + COLUMNS_PER_BLOCK - 1)/COLUMNS_PER_BLOCK;
+    Nbatches = (Nblocks + BLOCKS_PER_BATCH - 1)/BLOCKS_PER_BATCH;
+    block = (struct ColumnBlock *)get_spc(2*BLOCKS_PER_BATCH, sizeof(struct ColumnBlock));
+    Nnonzero = (long *)get_spc(2*BLOCKS_PER_BATCH*COLUMNS_PER_BLOCK, sizeof(long));
+    Nrun = (long *)get_spc(2*BLOCKS_PER_BATCH*COLUMNS_PER_BLOCK, sizeof(long));
+    Nwritten = 0;
+    ok = 1;
+
+    printf("\n");
+    #pragma omp parallel
+    {
+        struct SparseColumn TempColumn;
+        int batch, b, i, k;
+
+        TempColumn.Run = (struct SparseRun *)get_spc(A.MaxColumnNnonzero, sizeof(struct SparseRun));
+        TempColumn.Value = (float *)get_spc(A.MaxColumnNnonzero, sizeof(float));
+
+        for (batch = 0; batch <= Nbatches; batch++)
+        {
+            /* Write the previous batch */
+            #pragma omp single nowait
+            if (batch > 0)
+            {
+                struct ColumnBlock *blk;
+                struct SparseColumn column;
+                long n, r;
+
+                for (b = (batch-1)*BLOCKS_PER_BATCH; b < Nblocks && b < batch*BLOCKS_PER_BATCH; b++)
+                {
+                    blk = &block[b % (2*BLOCKS_PER_BATCH)];
+                    for (i = b*COLUMNS_PER_BLOCK, n = 0, r = 0; i < A.Nstored && i < (b+1)*COLUMNS_PER_BLOCK; i++)
+                    {
+                        k = i % (2*BLOCKS_PER_BATCH*COLUMNS_PER_BLOCK);
+                        column.Nnonzero = Nnonzero[k];
+                        column.Nrun = Nrun[k];
+                        column.Run = blk->Run + r;
+                        column.Value = blk->Value + n;
+                        ok = ok && !WriteSysMatrix2DColumn(writer, &column);
+                        n += Nnonzero[k];
+                        r += Nrun[k];
+                    }
+                    Nwritten = i;
+                    blk->Nnonzero = 0;
+                    blk->Nrun = 0;
+                }
+                printf("\r\tProgress = %2.1f %%", (float)Nwritten/A.Nstored*100.0); fflush(stdout);
+            }
+
+            /* Compute this batch */
+            #pragma omp for schedule(dynamic)
+            for (b = batch*BLOCKS_PER_BATCH; b < (batch+1)*BLOCKS_PER_BATCH; b++)
+            {
+                if (b >= Nblocks)
+                    continue;
+                for (i = b*COLUMNS_PER_BLOCK; i < A.Nstored && i < (b+1)*COLUMNS_PER_BLOCK; i++)
+                {
+                    ComputeSysMatrixColumn3DParallel((StoredPixel != NULL) ? StoredPixel[i] : i, &geom, &TempColumn);
+                    k = i % (2*BLOCKS_PER_BATCH*COLUMNS_PER_BLOCK);
+                    Nnonzero[k] = TempColumn.Nnonzero;
+                    Nrun[k] = TempColumn.Nrun;
+                    AppendColumnBlock(&block[b % (2*BLOCKS_PER_BATCH)], &TempColumn);
+                }
+            }
+        }
+        free((void *)TempColumn.Value);
+        free((void *)TempColumn.Run);
+    }
+    printf("\n");
+
+    ok = !CloseSysMatrix2DWriter(writer) && ok;
+    fprintf(stdout, "System Matrix Computation done \n");
+    fprintf(stdout, "\t%ld nonzero entries in %ld runs (%.1f entries per run)\n", A.Nnonzero, A.Nrun, A.Nrun > 0 ? (float)A.Nnonzero/A.Nrun : 0.0);
+    fflush(stdout);
+
+    for (j = 0; j < 2*BLOCKS_PER_BATCH; j++)
+    {
+        free((void *)block[j].Run);
+        free((void *)block[j].Value);
+    }
+    free((void *)block);
+    free((void *)Nnonzero);
+    free((void *)Nrun);
+    free((void *)StoredPixel);
+    free((void *)A.SymColumn);
+    free((void *)A.SymOp);
+    free((void *)A.SymView);
+    FreeSysMatrixGeom3DParallel(&geom);
+
+    return ok ? 0 : 1;
+}
+
+
+/* Compare the analytic projector against the sampled one over all columns, and print the differences */
+/* The sum of a column over the channels of a view times DeltaChannel is the area of the pixel if the */
+/* pixel projects entirely onto the detector, which gives an exact reference for both projectors */
+
+void CompareProjectors3DParallel(
+       struct SinoParams3DParallel *sinoparams,
+       struct ImageParams3D *imgparams,
+       float **pix_prof)
+{
+    struct SysMatrixGeom3DParallel geom_s, geom_a;
+    double SumSq, SumSqDiff, MaxDiff, MaxValue, MassErr_s, MassErr_a;
+    double t_lo, t_hi, PixelArea;
+    long Nmass;
+    int i, M, NViews, NChannels, Ncolumns;
+
+    fprintf(stdout, "\nComparing analytic and sampled projectors ...\n");
+    fflush(stdout);
+
+    InitSysMatrixGeom3DParallel(&geom_s, sinoparams, imgparams, pix_prof);
+    InitSysMatrixGeom3DParallel(&geom_a, sinoparams, imgparams, pix_prof);
+    geom_s.Projector = SYSMATRIX2D_PROJECTOR_SAMPLED;
+    geom_a.Projector = SYSMATRIX2D_PROJECTOR_ANALYTIC;
+
+    NViews = sinoparams->NViews;
+    NChannels = sinoparams->NChannels;
+    M = NViews*NChannels;
+    Ncolumns = imgparams->Nx*imgparams->Ny;
+    t_lo = geom_s.t_0 - geom_s.DeltaChannel/2.0;  /* extent of the detector */
+    t_hi = t_lo + NChannels*geom_s.DeltaChannel;
+    PixelArea = geom_s.DeltaPix*geom_s.DeltaPix;
+
+    SumSq = SumSqDiff = MaxDiff = MaxValue = MassErr_s = MassErr_a = 0.0;
+    Nmass = 0;
+
+    #pragma omp parallel reduction(+:SumSq, SumSqDiff, MassErr_s, MassErr_a, Nmass) reduction(max:MaxDiff, MaxValue)
+    {
+        struct SparseColumn Cs, Ca;
+        float *Dense;
+        double *Mass_s, *Mass_a, proj, x, y;
+        int n, r, m, row, pr;
+
+        Cs.Run = (struct SparseRun *)get_spc(M, sizeof(struct SparseRun));
+        Cs.Value = (float *)get_spc(M, sizeof(float));
+        Ca.Run = (struct SparseRun *)get_spc(M, sizeof(struct SparseRun));
+        Ca.Value = (float *)get_spc(M, sizeof(float));
+        Dense = (float *)get_spc(M, sizeof(float));
+        Mass_s = (double *)get_spc(NViews, sizeof(double));
+        Mass_a = (double *)get_spc(NViews, sizeof(double));
+
+        #pragma omp for schedule(dynamic, 64)
+        for (i = 0; i < Ncolumns; i++)
+        {
+            ComputeSysMatrixColumn3DParallel(i, &geom_s, &Cs);
+            ComputeSysMatrixColumn3DParallel(i, &geom_a, &Ca);
+
+            /* Dense holds sampled minus analytic entries; rows only in the analytic column are visited last */
+            for (r = 0, n = 0; r < Cs.Nrun; r++)
+            for (m = 0; m < Cs.Run[r].Length; m++, n++)
+            {
+                row = Cs.Run[r].View*NChannels + Cs.Run[r].FirstChannel + m;
+                Dense[row] = Cs.Value[n];
+                Mass_s[Cs.Run[r].View] += Cs.Value[n];
+                SumSq += (double)Cs.Value[n]*Cs.Value[n];
+                MaxValue = (Cs.Value[n] > MaxValue) ? Cs.Value[n] : MaxValue;
+            }
+            for (r = 0, n = 0; r < Ca.Nrun; r++)
+            for (m = 0; m < Ca.Run[r].Length; m++, n++)
+            {
+                row = Ca.Run[r].View*NChannels + Ca.Run[r].FirstChannel + m;
+                Dense[row] -= Ca.Value[n];
+                Mass_a[Ca.Run[r].View] += Ca.Value[n];
+            }
+            for (r = 0; r < Cs.Nrun; r++)
+            for (m = 0; m < Cs.Run[r].Length; m++)
+            {
+                row = Cs.Run[r].View*NChannels + Cs.Run[r].FirstChannel + m;
+                SumSqDiff += (double)Dense[row]*Dense[row];
+                MaxDiff = (fabs(Dense[row]) > MaxDiff) ? fabs(Dense[row]) : MaxDiff;
+                Dense[row] = 0.0;
+            }
+            for (r = 0; r < Ca.Nrun; r++)
+            for (m = 0; m < Ca.Run[r].Length; m++)
+            {
+                row = Ca.Run[r].View*NChannels + Ca.Run[r].FirstChannel + m;
+                SumSqDiff += (double)Dense[row]*Dense[row];
+                MaxDiff = (fabs(Dense[row]) > MaxDiff) ? fabs(Dense[row]) : MaxDiff;
+                Dense[row] = 0.0;
+            }
+
+            /* Pixel area check for the views in which the whole pixel projects onto the detector */
+            y = geom_s.y_0 + (i/geom_s.Nx)*geom_s.DeltaPix;
+            x = geom_s.x_0 + (i%geom_s.Nx)*geom_s.DeltaPix;
+            for (pr = 0; pr < NViews; pr++)
+            {
+                proj = y*geom_s.cosine[pr] - x*geom_s.sine[pr];
+                if (proj - geom_s.DeltaPix >= t_lo && proj + geom_s.DeltaPix <= t_hi)
+                {
+                    MassErr_s += fabs(Mass_s[pr]*geom_s.DeltaChannel/PixelArea - 1.0);
+                    MassErr_a += fabs(Mass_a[pr]*geom_s.DeltaChannel/PixelArea - 1.0);
+                    Nmass++;
+                }
+                Mass_s[pr] = Mass_a[pr] = 0.0;
+            }
+        }
+
+        free((void *)Cs.Run);
+        free((void *)Cs.Value);
+        free((void *)Ca.Run);
+        free((void *)Ca.Value);
+        free((void *)Dense);
+        free((void *)Mass_s);
+        free((void *)Mass_a);
+    }
+
+    FreeSysMatrixGeom3DParallel(&geom_s);
+    FreeSysMatrixGeom3DParallel(&geom_a);
+
+    fprintf(stdout, "\tRelative RMS difference = %e, max difference relative to largest entry = %e\n",
+        (SumSq > 0.0) ? sqrt(SumSqDiff/SumSq) : 0.0, (MaxValue > 0.0) ? MaxDiff/MaxValue : 0.0);
+    fprintf(stdout, "\tMean relative error of projected pixel area: sampled = %e, analytic = %e\n",
+        (Nmass > 0) ? MassErr_s/Nmass : 0.0, (Nmass > 0) ? MassErr_a/Nmass : 0.0);
+    fflush(stdout);
+}
+
+
+/* System Matrix cache: matrices are stored in CacheDir as <hash>.2Dsysmatrix, where <hash> is */
+/* HashSysMatrixParams2D of the geometry and the projector. A missing matrix is computed (with the */
+/* given projector and symmetries) and written under a temporary name, then renamed into place, */
+/* so concurrent runs never read a partial file */
+
+unsigned long CachedSysMatrixName3DParallel(
+       char *fname,
+       char *CacheDir,
+       struct SinoParams3DParallel *sinoparams,
+       struct ImageParams3D *imgparams,
+       int Projector)
+{
+    struct SysMatrixParams2D params;
+    unsigned long key;
+
+    if (strlen(CacheDir) > 960)
+    {
+        fprintf(stderr, "ERROR in CachedSysMatrixName3DParallel: cache directory name too long\n");
+        exit(-1);
+    }
+    SetSysMatrixParams2D(&params, sinoparams, imgparams);
+    SetProjectorParams3DParallel(&params, Projector);
+    key = HashSysMatrixParams2D(&params);
+    sprintf(fname, "%s/%016lx", CacheDir, key);
+    return key;
+}
+
+void ReadCachedSysMatrix3DParallel(
+       char *CacheDir,
+       struct SinoParams3DParallel *sinoparams,
+       struct ImageParams3D *imgparams,
+       int Projector,
+       struct SysMatrix2D *A)
+{
+    struct SysMatrixParams2D params;
+    float **pix_prof;
+    unsigned long key;
+    char fname[1000], dstname[1024], tmpname[1024], tmpfname[1040]; /* ReadSysMatrix2D and the writer append the extension */
+    FILE *fp;
+
+    key = CachedSysMatrixName3DParallel(fname, CacheDir, sinoparams, imgparams, Projector);
+    SetSysMatrixParams2D(&params, sinoparams, imgparams);
+    SetProjectorParams3DParallel(&params, Projector);
+    sprintf(dstname, "%s.2Dsysmatrix", fname);
+
+    if ((fp = fopen(dstname, "r")) != NULL)
+    {
+        fclose(fp);
+        fprintf(stdout, "Using cached System Matrix %s\n", dstname);
+    }
+    else
+    {
+        fprintf(stdout, "System Matrix not found in cache, computing %s\n", dstname);
+        if (mkdir(CacheDir, 0777) != 0 && errno != EEXIST)
+        {
+            fprintf(stderr, "ERROR in ReadCachedSysMatrix3DParallel: can't create cache directory %s\n", CacheDir);
+            exit(-1);
+        }
+        pix_prof = ComputePixelProfile3DParallel(sinoparams, imgparams);
+        sprintf(tmpname, "%s.tmp%ld", fname, (long)getpid());
+        sprintf(tmpfname, "%s.2Dsysmatrix", tmpname);
+        if (WriteSysMatrix3DParallel(tmpname, sinoparams, imgparams, pix_prof, Projector, 1, SYSMATRIX2D_VALUE_FLOAT))
+        {
+            fprintf(stderr, "ERROR in ReadCachedSysMatrix3DParallel: can't write %s\n", tmpfname);
+            exit(-1);
+        }
+        if (rename(tmpfname, dstname) != 0)
+        {
+            fprintf(stderr, "ERROR in ReadCachedSysMatrix3DParallel: can't rename %s to %s\n", tmpfname, dstname);
+            remove(tmpfname);
+            exit(-1);
+        }
+        free_img((void **)pix_prof);
+    }
+
+    A->Ncolumns = params.Nx*params.Ny;
+    A->params = params;
+    if (ReadSysMatrix2D(fname, A))
+    {
+        fprintf(stderr, "ERROR in ReadCachedSysMatrix3DParallel: can't read %s\n", dstname);
+        exit(-1);
+    }
+    if (HashSysMatrixParams2D(&A->params) != key)
+    {
+        fprintf(stderr, "ERROR in ReadCachedSysMatrix3DParallel: %s doesn't hold the matrix for this geometry; remove it and run again\n", dstname);
+        exit(-1);
+    }
+}
@@ -10,13 +10,72 @@
 #define LEN_DET 101 /* No. of Detector Elements */
                     /* Each detector channel is "split" into LEN_DET smaller elements ... */
                     /* to account for detector sensitivity variation across its aperture */
+#ifndef DEFAULT_PROJECTOR
+#define DEFAULT_PROJECTOR SYSMATRIX2D_PROJECTOR_SAMPLED /* Projector used unless selected otherwise at run time */
+#endif                                                  /* (SYSMATRIX2D_PROJECTOR_ANALYTIC for the closed-form aperture integral) */
 
 /* The System matrix does not vary with slice for 3-D Parallel Geometry */
 /* So, the method of compuatation is same as that of 2-D Parallel Geometry */
 
+/* Parameters of the trapezoidal pixel-detector profile for one view */
+/* Displacements are in pixel widths from the (projected) pixel center */
+struct PixelProfile3DParallel
+{
+    float maxval;           /* Height of the profile, i.e. the longest chord through the pixel (mm) */
+    float d1;               /* Profile is zero beyond displacement d1 */
+    float d2;               /* Profile is flat up to displacement d2, and linear between d2 and d1 */
+};
+
+/* Geometry context for computing System Matrix columns */
+/* Filled once by InitSysMatrixGeom3DParallel and only read afterwards, so a single context */
+/* can be shared by all threads computing columns concurrently */
+struct SysMatrixGeom3DParallel
+{
+    int NViews;             /* Number of view angles */
+    int NChannels;          /* Number of detector channels */
+    int Nx;                 /* Number of columns in image */
+    int Ny;                 /* Number of rows in image */
+    float DeltaPix;         /* Spacing between pixels (equal in x and y dimensions) (mm) */
+    float DeltaChannel;     /* Detector channel spacing (mm) */
+    float t_0;              /* Position of "Detector Channel 0" (mm); ith channel position = t_0 + i*DeltaChannel */
+    float x_0;              /* x-coordinate of the center of the first image column (mm) */
+    float y_0;              /* y-coordinate of the center of the first image row (mm) */
+    double *cosine;         /* cos(ViewAngles[i]) */
+    double *sine;           /* sin(ViewAngles[i]) */
+    float **pix_prof;       /* Pixel-detector profile, from ComputePixelProfile3DParallel */
+    float dprof[LEN_DET];   /* Detector sensitivity across the aperture of a channel. Weights sum to one */
+    struct PixelProfile3DParallel *prof; /* Profile parameters for each view, used by the analytic projector */
+    int Projector;          /* SYSMATRIX2D_PROJECTOR_SAMPLED or SYSMATRIX2D_PROJECTOR_ANALYTIC, DEFAULT_PROJECTOR after init */
+};
+
 /* Compute Pixel-Detector Profile for 3D Parallel Beam Geometry */
 float **ComputePixelProfile3DParallel(struct SinoParams3DParallel *sinoparams, struct ImageParams3D *imgparams);
-/* Compute System Matrix for 3D Parallel Beam Geometry*/
-struct SysMatrix2D *ComputeSysMatrix3DParallel(struct SinoParams3DParallel *sinoparams, struct ImageParams3D *imgparams, float **pix_prof);
+/* Set up/free the geometry context used for computing System Matrix columns */
+void InitSysMatrixGeom3DParallel(struct SysMatrixGeom3DParallel *geom, struct SinoParams3DParallel *sinoparams, struct ImageParams3D *imgparams, float **pix_prof);
+void FreeSysMatrixGeom3DParallel(struct SysMatrixGeom3DParallel *geom);
+/* Compute a single System Matrix column. Reentrant: A_Column must have room for NViews*NChannels entries, */
+/* or A->MaxColumnNnonzero entries of a matrix set up by InitSysMatrixOnTheFly3DParallel */
+void ComputeSysMatrixColumn3DParallel(int ColumnIndex, struct SysMatrixGeom3DParallel *geom, struct SparseColumn *A_Column);
+/* Compute System Matrix for 3D Parallel Beam Geometry with the given projector. Columns are computed in parallel */
+/* With UseSymmetry, columns related by a symmetry of the pixel grid and the view angles are stored once */
+/* (analytic projector only) */
+struct SysMatrix2D *ComputeSysMatrix3DParallel(struct SinoParams3DParallel *sinoparams, struct ImageParams3D *imgparams, float **pix_prof, int Projector, int UseSymmetry);
+/* Compute System Matrix as above and write it to <fname>.2Dsysmatrix with values of ValueType (quantized */
+/* on the fly), without holding the whole matrix in memory. Returns 0 if no error occurs */
+int WriteSysMatrix3DParallel(char *fname, struct SinoParams3DParallel *sinoparams, struct ImageParams3D *imgparams, float **pix_prof, int Projector, int UseSymmetry, int ValueType);
+/* Compare the analytic projector against the sampled one over all columns, and print the differences */
+void CompareProjectors3DParallel(struct SinoParams3DParallel *sinoparams, struct ImageParams3D *imgparams, float **pix_prof);
+/* Set fname to the base file name of the System Matrix for the geometry and Projector in the cache directory CacheDir */
+/* (room for 1000 characters), and return the hash of its parameters that the name is made of */
+unsigned long CachedSysMatrixName3DParallel(char *fname, char *CacheDir, struct SinoParams3DParallel *sinoparams, struct ImageParams3D *imgparams, int Projector);
+/* Read the System Matrix for the geometry and Projector from the cache directory CacheDir, computing it (in parallel) */
+/* and adding it to the cache if it isn't there yet */
+void ReadCachedSysMatrix3DParallel(char *CacheDir, struct SinoParams3DParallel *sinoparams, struct ImageParams3D *imgparams, int Projector, struct SysMatrix2D *A);
+/* Memory (bytes) of the System Matrix in the matrix-free mode with NCacheColumns cached columns, */
+/* or, if NCacheColumns < 0, an upper bound of the size of the matrix file for the geometry */
+long SysMatrixBytes3DParallel(struct SinoParams3DParallel *sinoparams, struct ImageParams3D *imgparams, int NCacheColumns);
+/* Set up a System Matrix in the matrix-free mode, which computes columns from geom on demand */
+/* A->params must be set by the caller, and geom must stay valid while A is in use */
+void InitSysMatrixOnTheFly3DParallel(struct SysMatrix2D *A, struct SysMatrixGeom3DParallel *geom, int NCacheColumns);
 
 #endif
@@ -16,6 +16,10 @@ struct CmdLineSysGen
     char imgparamsFileName[200];  /* input file */
     char sinoparamsFileName[200]; /* input file */
     char SysMatrixFileName[200]; /* output file */
+    int ValueType; /* Storage type of the matrix values; quantized if not SYSMATRIX2D_VALUE_FLOAT */
+    int Projector; /* SYSMATRIX2D_PROJECTOR_ANALYTIC or SYSMATRIX2D_PROJECTOR_SAMPLED */
+    int CompareProjectors; /* Compare the two projectors before computing the matrix */
+    int UseSymmetry; /* Store columns related by a pixel-grid symmetry once */
 };
 
 void readCmdLineSysGen(int argc, char *argv[], struct CmdLineSysGen *cmdline);
@@ -28,7 +32,6 @@ int main(int argc, char *argv[])
     struct ImageParams3D imgparams;
     struct SinoParams3DParallel sinoparams;
     float **PixelDetector_profile;
-    struct SysMatrix2D *A ;
     
     /* read Command Line */
     readCmdLineSysGen(argc, argv, &cmdline);
@@ -41,19 +44,14 @@ int main(int argc, char *argv[])
 
     /* Compute Pixel-Detector Profile */
     PixelDetector_profile = ComputePixelProfile3DParallel(&sinoparams, &imgparams);  /* pixel-detector profile function */
-    /* Compute Forward Matrix */
-    A = ComputeSysMatrix3DParallel(&sinoparams, &imgparams, PixelDetector_profile);
-    
-    /* Write out System Matrix */
-    if(WriteSysMatrix2D(cmdline.SysMatrixFileName, A))
-    {  fprintf(stderr, "Error in writing out System Matrix to file %s through function WriteSysMatrix2D \n", cmdline.SysMatrixFileName);
-       exit(-1);
-    }
-    /* Free System Matrix */
-    if(FreeSysMatrix2D(A))
-    {  fprintf(stderr, "Error System Matrix memory could not be freed through function FreeSysMatrix2D \n");
+    if(cmdline.CompareProjectors)
+        CompareProjectors3DParallel(&sinoparams, &imgparams, PixelDetector_profile);
+    /* Compute Forward Matrix and write it out as it is computed (quantizing the values if requested) */
+    if(WriteSysMatrix3DParallel(cmdline.SysMatrixFileName, &sinoparams, &imgparams, PixelDetector_profile, cmdline.Projector, cmdline.UseSymmetry, cmdline.ValueType))
+    {  fprintf(stderr, "Error in writing out System Matrix to file %s through function WriteSysMatrix3DParallel \n", cmdline.SysMatrixFileName);
        exit(-1);
     }
+    free_img((void **)PixelDetector_profile);
     
 	return 0;
 }
@@ -78,8 +76,13 @@ void readCmdLineSysGen(int argc, char *argv[], struct CmdLineSysGen *cmdline)
         }
     }
 
+    cmdline->ValueType = SYSMATRIX2D_VALUE_FLOAT;
+    cmdline->Projector = DEFAULT_PROJECTOR;
+    cmdline->CompareProjectors = 0;
+    cmdline->UseSymmetry = 1;
+
     /* get options */
-    while ((ch = getopt(argc, argv, "i:j:m:")) != EOF)
+    while ((ch = getopt(argc, argv, "i:j:m:q:d:a")) != EOF)
     {
         switch (ch)
         {
@@ -98,6 +101,41 @@ void readCmdLineSysGen(int argc, char *argv[], struct CmdLineSysGen *cmdline)
                 sprintf(cmdline->SysMatrixFileName, "%s", optarg);
                 break;
             }
+            case 'q':
+            {
+                if(strcmp(optarg,"16")==0)
+                    cmdline->ValueType = SYSMATRIX2D_VALUE_UINT16;
+                else if(strcmp(optarg,"8")==0)
+                    cmdline->ValueType = SYSMATRIX2D_VALUE_UINT8;
+                else
+                {
+                    fprintf(stderr, "\nError : -q option takes 16 or 8 (bits per stored value) \n");
+                    PrintCmdLineUsage(argv[0]);
+                    exit(-1);
+                }
+                break;
+            }
+            case 'd':
+            {
+                if(strcmp(optarg,"analytic")==0)
+                    cmdline->Projector = SYSMATRIX2D_PROJECTOR_ANALYTIC;
+                else if(strcmp(optarg,"sampled")==0)
+                    cmdline->Projector = SYSMATRIX2D_PROJECTOR_SAMPLED;
+                else if(strcmp(optarg,"compare")==0)
+                    cmdline->CompareProjectors = 1;
+                else
+                {
+                    fprintf(stderr, "\nError : -d option takes analytic, sampled or compare \n");
+                    PrintCmdLineUsage(argv[0]);
+                    exit(-1);
+                }
+                break;
+            }
+            case 'a':
+            {
+                cmdline->UseSymmetry = 0;
+                break;
+            }
             default:
             {
                 fprintf(stderr, "\nError : Unrecognized Command-line Symbol for exec-program %s \n",argv[0]);
@@ -115,7 +153,19 @@ void PrintCmdLineUsage(char *ExecFileName)
     fprintf(stdout, "\nBASELINE MBIR RECONSTRUCTION SOFTWARE FOR 3D PARALLEL-BEAM CT \n");
     fprintf(stdout, "build time: %s, %s\n", __DATE__,  __TIME__);
     fprintf(stdout, "\nCommand line Format for Executable File %s : \n", ExecFileName);
-    fprintf(stdout, "%s ./<Executable File Name>  -i <InputFileName>[.imgparams] -j <InputFileName>[.sinoparams] -m <OutputFileName>[.2Dsysmatrix] \n\n",ExecFileName);
+    fprintf(stdout, "%s ./<Executable File Name>  -i <InputFileName>[.imgparams] -j <InputFileName>[.sinoparams] -m <OutputFileName>[.2Dsysmatrix] [-q <16|8>] [-d <analytic|sampled|compare>] [-a] \n\n",ExecFileName);
+    fprintf(stdout, "Option -q stores the matrix values as 16 or 8 bit integers with a scale per column, \n");
+    fprintf(stdout, "which makes the matrix smaller at the cost of a small error in its entries \n");
+    fprintf(stdout, "Option -d selects how detector channels are modeled: analytic integrates the pixel profile \n");
+    fprintf(stdout, "over the channel aperture in closed form, sampled sums the tabulated profile at %d points \n", LEN_DET);
+    fprintf(stdout, "per channel, and compare reports the differences between the two before computing the matrix \n");
+    fprintf(stdout, "(default %s) \n", (DEFAULT_PROJECTOR == SYSMATRIX2D_PROJECTOR_ANALYTIC) ? "analytic" : "sampled");
+    fprintf(stdout, "With the analytic projector, columns of pixels related by a symmetry of the pixel grid and the \n");
+    fprintf(stdout, "view angles (mirrors, rotations by 90 degrees) are stored once, which makes the matrix up to 8 \n");
+    fprintf(stdout, "times smaller; remapped columns match computed ones to about 2e-4 of their peak, the precision \n");
+    fprintf(stdout, "of the view angles. Option -a stores all columns. The sampled projector always stores all \n");
+    fprintf(stdout, "columns: its tabulated profile is not symmetric about the pixel center, so the mapping would \n");
+    fprintf(stdout, "not be exact, and it is kept unchanged as the default so existing matrices stay valid \n\n");
     fprintf(stdout, "Note : The file extensions above enclosed in \"[ ]\" symbols are necessary \n");
     fprintf(stdout, "but should be omitted from the command line arguments\n");
 }
@@ -1,6 +1,9 @@
 #ifndef MBIR_MODULAR_DEFS_H
 #define MBIR_MODULAR_DEFS_H
 
+#include <stddef.h>
+#include <omp.h>
+
 
 /* Define constants that will be used in modular MBIR framework */
 #define MBIR_MODULAR_UTIL_VERSION "2.2"
@@ -17,6 +20,8 @@
 #define MBIR_MODULAR_RECONTYPE_QGGMRF_3D 1
 #define MBIR_MODULAR_RECONTYPE_PandP 2
 
+#define MBIR_MODULAR_SVLENGTH_AUTO -1 /* SVLength: super-voxels chosen by the reconstruction */
+
 #define MBIR_MODULAR_YES 1
 #define MBIR_MODULAR_NO 0
 #define MBIR_MODULAR_MAX_NUMBER_OF_SLICE_DIGITS 4 /* allows up to 10,000 slices */
@@ -47,6 +52,16 @@ struct SinoParams3DParallel
     int NumSliceDigits;    /* Number of slice numbers digits used in file name */
 };
 
+/* Storage behind the slice pointers of a 3D array: the block allocated for all slices, and the */
+/* single-file volumes that slices are mapped from instead (see ReadSinoData3DParallel) */
+struct SliceStorage3D
+{
+  float *Block;
+  int NMaps;
+  void **MapAddr;
+  size_t *MapLength;
+};
+
 /* 3D Sinogram Data Structure */
 struct Sino3DParallel
 {
@@ -54,6 +69,8 @@ struct Sino3DParallel
   float **sino;           /* The array is indexed by sino[Slice][ View * NChannels + Channel ] */
                           /* If data array is empty, then set Sino = NULL */
   float **weight;         /* Weights for each measurement */
+  struct SliceStorage3D *SinoStorage;   /* Set by AllocateSinoData3DParallel */
+  struct SliceStorage3D *WeightStorage;
 };
 
 /* 3D Image parameters*/
@@ -76,6 +93,7 @@ struct Image3D
   struct ImageParams3D imgparams; /* Image parameters */
   float **image;                  /* The array is indexed by image[SliceIndex][ Row * Nx + Column ], Nx=NColumns */
                                   /* If data array is empty, then set Image = NULL */
+  struct SliceStorage3D *Storage; /* Set by AllocateImageData3D */
 };
 
 
@@ -88,6 +106,14 @@ struct ReconParams
   double StopThreshold;   /* Stopping threshold in percent */
   int MaxIterations;      /* Maximum number of iterations */
   int Positivity;         /* Positivity constraint: 1=yes, 0=no */
+  int SVLength;           /* Side of the square super-voxels updated together, in pixels (0: voxel-wise ICD, -1: automatic) */
+  int VoxelLines;         /* Update the Nz voxels of each (x,y) pixel together: 1=yes, 0=no */
+  int NHICD;              /* Non-homogeneous ICD, sweeps over the voxels with the largest recent updates: 1=yes, 0=no */
+  int ZeroSkip;           /* Skip voxels left at zero with all their neighbors, revalidated periodically: 1=yes, 0=no */
+  int CacheTheta2;        /* Precompute theta2 of the likelihood term of each voxel before iterating: 1=yes, 0=no */
+  int FastPrior;          /* QGGMRF kernels specialized for q=2 and tabulated powers instead of pow(): 1=yes, 0=no */
+  int CostInterval;       /* Exact cost every CostInterval iterations, tracked from the updates in between (1: always exact, as for Plug & Play) */
+  int InPlaceError;       /* Compute the error sinogram in place of the sinogram instead of in a copy: 1=yes, 0=no */
   /* sinogram weighting */
   double SigmaY;          /* Scaling constant for sinogram weights (e.g. W=exp(-y)/SigmaY^2 ) */
   int weightType;         /* How to compute weights if internal, 0: =1 (default); 1: exp(-y); 2: exp(-y/2) */
@@ -108,6 +134,9 @@ struct ReconParams
   //double SigmaX;        /* sigma_x parameter (mm-1) (same field name already included for QGGMRF above) */
   double SigmaXsq;        /* derived parameter: SigmaX^2 */
   float **proximalmap;    /* ptr to 3D proximal map image; here to carry it to the ICD update */
+  /* Set by the caller: batch of datasets with the same geometry, and slabs of a volume */
+  int NDatasets;          /* Number of datasets stacked along z, Nz/NDatasets slices each; the prior doesn't connect them */
+  int Halo;               /* Slab of a larger volume: image[-1] and image[Nz] are fixed neighbor slices instead of z wrapping around */
 };
 
 
@@ -131,20 +160,175 @@ struct Image2D
 			/* If data array is empty, then set image = NULL */
 };
 
+/* Run of nonzero entries of a Sparse Column at consecutive detector channels of one view */
+/* The run covers rows View*NChannels + FirstChannel ... View*NChannels + FirstChannel + Length-1 */
+struct SparseRun
+{
+   unsigned short View;		/* View index */
+   unsigned short FirstChannel;	/* Detector channel of the first entry in the run */
+   unsigned short Length;	/* Number of entries in the run */
+};
+#define SPARSERUN_MAX_INDEX 65535	/* Largest View, FirstChannel and Length a SparseRun can hold */
+
+/* Storage types for the values of a Sparse System Matrix */
+/* Quantized values are unsigned integers, and the jth entry of a column is Scale*Value16[j] (or Value8[j]) */
+#define SYSMATRIX2D_VALUE_FLOAT 0
+#define SYSMATRIX2D_VALUE_UINT16 1
+#define SYSMATRIX2D_VALUE_UINT8 2
+
 /* Sparse Column Vector - Data Structure */
+/* Entries are run-length encoded: Run[0] covers Value[0 ... Run[0].Length-1], Run[1] the next */
+/* Run[1].Length values, and so on */
+/* Only the value array matching the ValueType of the matrix is set, the others are NULL */
 struct SparseColumn
 {
    int Nnonzero;	/* Nnonzero is the number of nonzero entries in the column */
-   int *RowIndex;	/* RowIndex[j] is the row index of the jth nonzero entry in the column */
+   int Nrun;		/* Number of runs the entries are grouped into */
+   struct SparseRun *Run;	/* Run[r] gives the view and channels of the rth run of entries */
    float *Value;	/* Value[j] is the value of the jth nonzero entry in the column of the matrix */
+   unsigned short *Value16;	/* Quantized values, SYSMATRIX2D_VALUE_UINT16 */
+   unsigned char *Value8;	/* Quantized values, SYSMATRIX2D_VALUE_UINT8 */
+   float Scale;		/* Value of one quantization step (1 for float values) */
 };
 
+/* Ways of computing the entries of a Sparse System Matrix */
+#define SYSMATRIX2D_PROJECTOR_SAMPLED 0	/* Tabulated pixel profile sampled at LenDet points per channel */
+#define SYSMATRIX2D_PROJECTOR_ANALYTIC 1	/* Pixel profile integrated over the channel aperture in closed form */
+
+/* Parameters of the geometry a Sparse System Matrix is computed for */
+struct SysMatrixParams2D
+{
+   int Nx;			/* Number of columns in image */
+   int Ny;			/* Number of rows in image */
+   float Deltaxy;		/* Spacing between pixels in x and y direction (mm) */
+   int NChannels;		/* Number of channels in detector */
+   int NViews;			/* Number of view angles */
+   float DeltaChannel;		/* Detector spacing (mm) */
+   float CenterOffset;		/* Offset of center-of-rotation (channels) */
+   int LenPix;			/* Resolution of the pixel-detector profile (LEN_PIX), 0 if not used */
+   int LenDet;			/* Number of elements each detector channel is split into (LEN_DET), 0 if integrated exactly */
+   int Projector;		/* SYSMATRIX2D_PROJECTOR_SAMPLED or SYSMATRIX2D_PROJECTOR_ANALYTIC */
+   unsigned long ViewAnglesHash;	/* Hash of the ViewAngles array, see HashBytes() */
+};
+
+/* Symmetries of a square pixel grid centered on the axis of rotation */
+/* Under a symmetry, the column of a pixel is a permutation of the views (and possibly a reversal of */
+/* the channels within a view) of the column of the mapped pixel */
+#define SYSMATRIX2D_SYM_IDENTITY 0
+#define SYSMATRIX2D_SYM_POINT 1		/* (x,y) -> (-x,-y) */
+#define SYSMATRIX2D_SYM_MIRROR_X 2	/* (x,y) -> (-x,y) */
+#define SYSMATRIX2D_SYM_MIRROR_Y 3	/* (x,y) -> (x,-y) */
+#define SYSMATRIX2D_SYM_TRANSPOSE 4	/* (x,y) -> (y,x) */
+#define SYSMATRIX2D_SYM_ANTITRANSPOSE 5	/* (x,y) -> (-y,-x) */
+#define SYSMATRIX2D_SYM_ROTATE90 6	/* (x,y) -> (-y,x) */
+#define SYSMATRIX2D_SYM_ROTATE270 7	/* (x,y) -> (y,-x) */
+#define SYSMATRIX2D_NSYM 8
+
 /* Sparse System Matrix Data Structure */
+/* The runs and values of all stored columns are stored back to back in a single arena, so column[s].Run */
+/* and column[s].Value point to Run[RunOffset[s]] and Value[ColumnOffset[s]] */
+/* Without symmetries every column is stored (Nstored = Ncolumns). Otherwise only one column of each */
+/* orbit under the pixel-grid symmetries is stored, and the other columns are remapped from it */
 struct SysMatrix2D
 {
    int Ncolumns;		/* Number of columns in sparse matrix */
-   struct SparseColumn *column;	/* column[i] is the i-th column of the matrix in sparse format */
+   int Nstored;			/* Number of stored columns */
+   struct SparseColumn *column;	/* column[s] is the s-th stored column of the matrix in sparse format */
+   long Nnonzero;		/* Total number of nonzero entries in the matrix */
+   long Nrun;			/* Total number of runs in the matrix */
+   long *ColumnOffset;		/* Start of column[s] in the Value arena; ColumnOffset[Nstored] = Nnonzero */
+   long *RunOffset;		/* Start of column[s] in the Run arena; RunOffset[Nstored] = Nrun */
+   struct SparseRun *Run;	/* Arena of runs for all columns */
+   int ValueType;		/* SYSMATRIX2D_VALUE_FLOAT, SYSMATRIX2D_VALUE_UINT16 or SYSMATRIX2D_VALUE_UINT8 */
+   float *Value;		/* Arena of values for all columns (SYSMATRIX2D_VALUE_FLOAT), otherwise NULL */
+   unsigned short *Value16;	/* Arena of quantized values (SYSMATRIX2D_VALUE_UINT16), otherwise NULL */
+   unsigned char *Value8;	/* Arena of quantized values (SYSMATRIX2D_VALUE_UINT8), otherwise NULL */
+   float *Scale;		/* Scale[s] is the quantization step of column s; NULL for float values */
+   int *SymColumn;		/* SymColumn[i] is the stored column that column i is remapped from, NULL without symmetries */
+   unsigned char *SymOp;	/* SymOp[i] is the symmetry (SYSMATRIX2D_SYM_*) that maps that stored column to column i */
+   int *SymView;		/* SymView[op*NViews + v] is the view that view v of a stored column moves to under */
+				/* symmetry op, or -1-view if the channels of the view are reversed as well */
+   struct SysMatrixParams2D params;	/* Geometry the matrix was computed for */
+   void *MapAddr;		/* If not NULL, the arena is a read-only mapping of a .2Dsysmatrix file */
+   size_t MapLength;		/* Length of that mapping (bytes) */
+   /* Matrix-free mode: if ComputeColumn is not NULL, columns are not stored but computed on demand */
+   /* (see GetSysMatrixColumn), and column and the arena are unused */
+   void (*ComputeColumn)(int ColumnIndex, void *ColumnContext, struct SparseColumn *A_Column);
+   void *ColumnContext;		/* Passed on to ComputeColumn */
+   int MaxColumnNnonzero;	/* Upper bound on the number of nonzero entries of a computed or remapped column */
+   int NCacheColumns;		/* Number of slots in the cache of computed columns, 0 for no cache */
+   int *CacheTag;		/* CacheTag[s] is the index of the column held in slot s, or -1 */
+   omp_lock_t *CacheLock;	/* CacheLock[s] is held while slot s is read or filled */
+   struct SparseColumn *CacheColumn;	/* Cache slots; column i can only be held in slot i%NCacheColumns */
+};
+
+/* .2Dsysmatrix file format */
+/* A fixed size header is followed by the arrays of the matrix arena, each starting at a multiple */
+/* of SYSMATRIX2D_ALIGNMENT bytes, so the file can be memory mapped and used as the arena. */
+/* Version 4: column offset table (Ncolumns+1 longs), run offset table (Ncolumns+1 longs), */
+/*   Run array (Nrun SparseRuns), Value array (Nnonzero floats, ushorts or uchars, see ValueType) */
+/*   and, for quantized values, the Scale array (Ncolumns floats) */
+/* Version 5: as version 4; if NImageColumns is not 0, Ncolumns columns are stored and the SymColumn */
+/*   (NImageColumns ints), SymOp (NImageColumns uchars) and SymView (SYSMATRIX2D_NSYM*NViews ints) */
+/*   arrays follow */
+/* Version 3: as version 4 with float values only */
+/* Version 2: column offset table, RowIndex array (Nnonzero ints) and Value array; */
+/*   it is converted to runs on reading */
+/* Data is stored in native byte order. Files without the header are read in the legacy format, */
+/* i.e. for each column: Nnonzero (int), RowIndex (Nnonzero ints), Value (Nnonzero floats) */
+#define SYSMATRIX2D_MAGIC "MBIRSM2D"
+#define SYSMATRIX2D_VERSION 5
+#define SYSMATRIX2D_HEADER_SIZE 256
+#define SYSMATRIX2D_ALIGNMENT 64
+
+struct SysMatrix2DHeader
+{
+   char Magic[8];		/* SYSMATRIX2D_MAGIC, not null terminated */
+   int Version;			/* SYSMATRIX2D_VERSION */
+   int HeaderSize;		/* SYSMATRIX2D_HEADER_SIZE */
+   struct SysMatrixParams2D params;	/* Geometry the matrix was computed for */
+   int Ncolumns;		/* Number of stored columns */
+   long Nnonzero;		/* Total number of nonzero entries */
+   long ColumnOffsetPos;	/* File position (bytes) of the column offset table */
+   long RowIndexPos;		/* File position (bytes) of the RowIndex array (version 2 only) */
+   long ValuePos;		/* File position (bytes) of the Value array */
+   long FileSize;		/* Total file size (bytes) */
+   long Nrun;			/* Total number of runs (version 3 and up) */
+   long RunOffsetPos;		/* File position (bytes) of the run offset table (version 3 and up) */
+   long RunPos;			/* File position (bytes) of the Run array (version 3 and up) */
+   long ScalePos;		/* File position (bytes) of the Scale array, 0 for float values (version 4) */
+   int ValueType;		/* Storage type of the Value array (version 4) */
+   int NImageColumns;		/* Number of columns of the matrix if symmetries are used, else 0 (version 5) */
+   long SymColumnPos;		/* File position (bytes) of the SymColumn array (version 5) */
+   long SymOpPos;		/* File position (bytes) of the SymOp array (version 5) */
+   long SymViewPos;		/* File position (bytes) of the SymView array (version 5) */
+   char Reserved[80];		/* Zero; keeps the header at SYSMATRIX2D_HEADER_SIZE bytes */
+};
+_Static_assert(sizeof(struct SysMatrix2DHeader) == SYSMATRIX2D_HEADER_SIZE, "SysMatrix2DHeader size");
+
+
+/* Single-file volume (<basename>.3Dsinodata, .3Dweightdata or .3Dimgdata): a header followed at */
+/* DataPos by NSlices slices of NRows x NColumns floats each (NViews x NChannels for sinograms and */
+/* weights, Ny x Nx for images), slice after slice. The file is memory mapped by the readers, and any */
+/* range of its slices can be read */
+#define VOLUME3D_MAGIC "MBIRVOL3"
+#define VOLUME3D_VERSION 1
+#define VOLUME3D_HEADER_SIZE 128
+
+struct Volume3DHeader
+{
+   char Magic[8];		/* VOLUME3D_MAGIC, not null terminated */
+   int Version;			/* VOLUME3D_VERSION */
+   int HeaderSize;		/* VOLUME3D_HEADER_SIZE */
+   int NSlices;			/* Number of slices in the file */
+   int FirstSliceNumber;	/* Slice number of the first slice in the file */
+   int NRows;
+   int NColumns;
+   long DataPos;		/* File position (bytes) of the first slice */
+   long FileSize;		/* Total file size (bytes) */
+   char Reserved[80];		/* Zero; keeps the header at VOLUME3D_HEADER_SIZE bytes */
 };
+_Static_assert(sizeof(struct Volume3DHeader) == VOLUME3D_HEADER_SIZE, "Volume3DHeader size");
 
 
 
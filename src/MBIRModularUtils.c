@@ -1,9 +1,15 @@
 
+#define _POSIX_C_SOURCE 200809L  /* for mmap, fileno */
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <libgen.h>  /* for dirname */
 #include <math.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <unistd.h>  /* for ftruncate */
 
 #include "allocate.h"
 #include "MBIRModularDefs.h"
@@ -325,6 +331,14 @@ void printReconParamsQGGMRF3D(struct ReconParams *reconparams)
     fprintf(stdout, " - Stop threshold for convergence                        = %.7f %%\n", reconparams->StopThreshold);
     fprintf(stdout, " - Maximum number of ICD iterations                      = %d\n", reconparams->MaxIterations);
     fprintf(stdout, " - Positivity constraint flag                            = %d\n", reconparams->Positivity);
+    fprintf(stdout, " - Super-voxel side length (0: voxel-wise ICD, -1: auto) = %d\n", reconparams->SVLength);
+    fprintf(stdout, " - Voxel-line updates across slices flag                 = %d\n", reconparams->VoxelLines);
+    fprintf(stdout, " - Non-homogeneous ICD flag                              = %d\n", reconparams->NHICD);
+    fprintf(stdout, " - Zero-skipping flag                                    = %d\n", reconparams->ZeroSkip);
+    fprintf(stdout, " - Cached theta2 flag                                    = %d\n", reconparams->CacheTheta2);
+    fprintf(stdout, " - Fast prior kernel flag                                = %d\n", reconparams->FastPrior);
+    fprintf(stdout, " - Iterations between exact cost evaluations             = %d\n", reconparams->CostInterval);
+    fprintf(stdout, " - Error sinogram in place of the sinogram flag          = %d\n", reconparams->InPlaceError);
 }
 /* Print PandP reconstruction parameters */
 void printReconParamsPandP(struct ReconParams *reconparams)
@@ -336,6 +350,14 @@ void printReconParamsPandP(struct ReconParams *reconparams)
     fprintf(stdout, " - Stop threshold for convergence                        = %.7f %%\n", reconparams->StopThreshold);
     fprintf(stdout, " - Maximum number of ICD iterations                      = %d\n", reconparams->MaxIterations);
     fprintf(stdout, " - Positivity constraint flag                            = %d\n", reconparams->Positivity);
+    fprintf(stdout, " - Super-voxel side length (0: voxel-wise ICD, -1: auto) = %d\n", reconparams->SVLength);
+    fprintf(stdout, " - Voxel-line updates across slices flag                 = %d\n", reconparams->VoxelLines);
+    fprintf(stdout, " - Non-homogeneous ICD flag                              = %d\n", reconparams->NHICD);
+    fprintf(stdout, " - Zero-skipping flag                                    = %d\n", reconparams->ZeroSkip);
+    fprintf(stdout, " - Cached theta2 flag                                    = %d\n", reconparams->CacheTheta2);
+    fprintf(stdout, " - Fast prior kernel flag                                = %d\n", reconparams->FastPrior);
+    fprintf(stdout, " - Iterations between exact cost evaluations             = %d\n", reconparams->CostInterval);
+    fprintf(stdout, " - Error sinogram in place of the sinogram flag          = %d\n", reconparams->InPlaceError);
 }
 
 /* Utility for reading reconstruction parameter files */
@@ -357,6 +379,16 @@ int ReadReconParams(
 	reconparams->StopThreshold=1.0;
 	reconparams->MaxIterations=20;
 	reconparams->Positivity=1;
+	reconparams->SVLength=MBIR_MODULAR_SVLENGTH_AUTO;
+	reconparams->VoxelLines=0;
+	reconparams->NHICD=0;
+	reconparams->ZeroSkip=0;
+	reconparams->CacheTheta2=0;
+	reconparams->FastPrior=0;
+	reconparams->CostInterval=1;
+	reconparams->InPlaceError=0;
+	reconparams->NDatasets=1;
+	reconparams->Halo=0;
 
 	reconparams->b_nearest=1.0;
 	reconparams->b_diag=0.707;
@@ -517,6 +549,70 @@ int ReadReconParams(
 			else
 				reconparams->Positivity = fieldval_d;
 		}
+		else if(strcmp(fieldname,"SVLength")==0)
+		{
+			sscanf(fieldval_s,"%d",&(fieldval_d));
+			if(fieldval_d < MBIR_MODULAR_SVLENGTH_AUTO)
+				fprintf(stderr,"Warning in %s: SVLength should be non-negative, or -1 for automatic. Reverting to default.\n",fname);
+			else
+				reconparams->SVLength = fieldval_d;
+		}
+		else if(strcmp(fieldname,"VoxelLines")==0)
+		{
+			sscanf(fieldval_s,"%d",&(fieldval_d));
+			if( strcmp(fieldval_s,"0") && strcmp(fieldval_s,"1") )
+				fprintf(stderr,"Warning in %s: \"VoxelLines\" parameter options are 0/1. Reverting to default.\n",fname);
+			else
+				reconparams->VoxelLines = fieldval_d;
+		}
+		else if(strcmp(fieldname,"NHICD")==0)
+		{
+			sscanf(fieldval_s,"%d",&(fieldval_d));
+			if( strcmp(fieldval_s,"0") && strcmp(fieldval_s,"1") )
+				fprintf(stderr,"Warning in %s: \"NHICD\" parameter options are 0/1. Reverting to default.\n",fname);
+			else
+				reconparams->NHICD = fieldval_d;
+		}
+		else if(strcmp(fieldname,"ZeroSkip")==0)
+		{
+			sscanf(fieldval_s,"%d",&(fieldval_d));
+			if( strcmp(fieldval_s,"0") && strcmp(fieldval_s,"1") )
+				fprintf(stderr,"Warning in %s: \"ZeroSkip\" parameter options are 0/1. Reverting to default.\n",fname);
+			else
+				reconparams->ZeroSkip = fieldval_d;
+		}
+		else if(strcmp(fieldname,"CacheTheta2")==0)
+		{
+			sscanf(fieldval_s,"%d",&(fieldval_d));
+			if( strcmp(fieldval_s,"0") && strcmp(fieldval_s,"1") )
+				fprintf(stderr,"Warning in %s: \"CacheTheta2\" parameter options are 0/1. Reverting to default.\n",fname);
+			else
+				reconparams->CacheTheta2 = fieldval_d;
+		}
+		else if(strcmp(fieldname,"FastPrior")==0)
+		{
+			sscanf(fieldval_s,"%d",&(fieldval_d));
+			if( strcmp(fieldval_s,"0") && strcmp(fieldval_s,"1") )
+				fprintf(stderr,"Warning in %s: \"FastPrior\" parameter options are 0/1. Reverting to default.\n",fname);
+			else
+				reconparams->FastPrior = fieldval_d;
+		}
+		else if(strcmp(fieldname,"CostInterval")==0)
+		{
+			sscanf(fieldval_s,"%d",&(fieldval_d));
+			if(fieldval_d < 1)
+				fprintf(stderr,"Warning in %s: CostInterval should be at least 1. Reverting to default.\n",fname);
+			else
+				reconparams->CostInterval = fieldval_d;
+		}
+		else if(strcmp(fieldname,"InPlaceError")==0)
+		{
+			sscanf(fieldval_s,"%d",&(fieldval_d));
+			if( strcmp(fieldval_s,"0") && strcmp(fieldval_s,"1") )
+				fprintf(stderr,"Warning in %s: \"InPlaceError\" parameter options are 0/1. Reverting to default.\n",fname);
+			else
+				reconparams->InPlaceError = fieldval_d;
+		}
 		else
 			fprintf(stderr,"Warning: unrecognized field \"%s\" in %s, line %d\n",fieldname,fname,i+1);
 
@@ -535,6 +631,13 @@ int ReadReconParams(
 		exit(-1);
 	}
 
+	/* The cost change of an update is only tracked for the QGGMRF prior, whose neighbors are */
+	/* extracted for the update; the cost of a Plug & Play reconstruction is always exact */
+	if(reconparams->ReconType == MBIR_MODULAR_RECONTYPE_PandP && reconparams->CostInterval > 1) {
+		fprintf(stderr,"Warning in %s: CostInterval doesn't apply to Plug & Play, the cost is computed every iteration\n",fname);
+		reconparams->CostInterval = 1;
+	}
+
 	/* calculate derived parameters */
 	reconparams->pow_sigmaX_p = pow(reconparams->SigmaX,reconparams->p);
 	reconparams->pow_sigmaX_q = pow(reconparams->SigmaX,reconparams->q);
@@ -592,11 +695,242 @@ int WriteFloatArray(
 }
 
 
+/*****************************************/
+/*     Slice storage and volume files    */
+/*****************************************/
+
+/* Slice pointers of a 3D array of NSlices slices, pointing into one block allocated for all of them */
+/* The block is not cleared, so the pages of slices that are mapped from a volume file instead are */
+/* never touched */
+static float **AllocateSlices3D(int NSlices, long SliceSize, struct SliceStorage3D **storage)
+{
+    float **rows;
+    int i;
+
+    *storage = (struct SliceStorage3D *)get_spc(1, sizeof(struct SliceStorage3D));
+    (*storage)->Block = (float *)get_aligned_spc((size_t)NSlices*SliceSize, sizeof(float));
+    rows = (float **)get_spc(NSlices, sizeof(float *));
+    for (i = 0; i < NSlices; i++)
+        rows[i] = (*storage)->Block + (long)i*SliceSize;
+    return rows;
+}
+
+static void FreeSlices3D(float **rows, struct SliceStorage3D *storage)
+{
+    int k;
+
+    for (k = 0; k < storage->NMaps; k++)
+        munmap(storage->MapAddr[k], storage->MapLength[k]);
+    free((void *)storage->MapAddr);
+    free((void *)storage->MapLength);
+    free((void *)storage->Block);
+    free((void *)storage);
+    free((void *)rows);
+}
+
+int IsVolume3D(char *basename, char *extension)
+{
+    FILE *fp;
+    char fname[1024];
+
+    sprintf(fname, "%s.%s", basename, extension);
+    if ((fp = fopen(fname, "r")) == NULL)
+        return 0;
+    fclose(fp);
+    return 1;
+}
+
+/* Point rows at slices FirstSliceNumber to FirstSliceNumber+NSlices-1 of the volume <basename>.<extension> */
+/* The file is mapped privately, so the slices can be changed in memory without changing the file */
+/* Only the pages holding those slices are mapped */
+static void MapVolume3D(
+    char *basename,
+    char *extension,
+    int FirstSliceNumber,
+    int NSlices,
+    int NRows,
+    int NColumns,
+    float **rows,
+    struct SliceStorage3D *storage,
+    char *caller)
+{
+    FILE *fp;
+    char fname[1024];
+    struct Volume3DHeader header;
+    struct stat st;
+    char *base;
+    long SliceSize, PageSize, First, Offset, Length;
+    int i;
+
+    sprintf(fname, "%s.%s", basename, extension);
+    if ((fp = fopen(fname, "r")) == NULL)
+    {
+        fprintf(stderr, "ERROR in %s: can't open file %s\n", caller, fname);
+        exit(-1);
+    }
+    if (fread(&header, sizeof(header), 1, fp) != 1 || memcmp(header.Magic, VOLUME3D_MAGIC, 8)
+        || header.Version != VOLUME3D_VERSION || header.HeaderSize != VOLUME3D_HEADER_SIZE)
+    {
+        fprintf(stderr, "ERROR in %s: file %s is not a version %d volume file\n", caller, fname, VOLUME3D_VERSION);
+        exit(-1);
+    }
+    if (header.NRows != NRows || header.NColumns != NColumns)
+    {
+        fprintf(stderr, "ERROR in %s: file %s has slices of %d x %d, expected %d x %d\n", caller, fname,
+            header.NRows, header.NColumns, NRows, NColumns);
+        exit(-1);
+    }
+    if (FirstSliceNumber < header.FirstSliceNumber || FirstSliceNumber + NSlices > header.FirstSliceNumber + header.NSlices)
+    {
+        fprintf(stderr, "ERROR in %s: file %s has slices %d to %d, slices %d to %d are needed\n", caller, fname,
+            header.FirstSliceNumber, header.FirstSliceNumber + header.NSlices - 1, FirstSliceNumber, FirstSliceNumber + NSlices - 1);
+        exit(-1);
+    }
+    SliceSize = (long)NRows*NColumns;
+    if (fstat(fileno(fp), &st) != 0 || st.st_size != header.FileSize || header.DataPos < header.HeaderSize
+        || header.DataPos % sizeof(float) != 0 || header.DataPos + header.NSlices*SliceSize*(long)sizeof(float) > header.FileSize)
+    {
+        fprintf(stderr, "ERROR in %s: header of file %s is inconsistent with its size\n", caller, fname);
+        exit(-1);
+    }
+
+    /* Byte range of the slices, extended down to a page boundary */
+    PageSize = sysconf(_SC_PAGESIZE);
+    First = header.DataPos + (FirstSliceNumber - header.FirstSliceNumber)*SliceSize*(long)sizeof(float);
+    Offset = First/PageSize*PageSize;
+    Length = First - Offset + NSlices*SliceSize*(long)sizeof(float);
+    if (Length == 0)
+    {
+        fclose(fp);
+        return;
+    }
+
+    base = mmap(NULL, Length, PROT_READ | PROT_WRITE, MAP_PRIVATE, fileno(fp), Offset);
+    fclose(fp);
+    if (base == MAP_FAILED)
+    {
+        fprintf(stderr, "ERROR in %s: can't map file %s\n", caller, fname);
+        exit(-1);
+    }
+    for (i = 0; i < NSlices; i++)
+        rows[i] = (float *)(base + First - Offset) + i*SliceSize;
+
+    storage->MapAddr = (void **)realloc(storage->MapAddr, (storage->NMaps+1)*sizeof(void *));
+    storage->MapLength = (size_t *)realloc(storage->MapLength, (storage->NMaps+1)*sizeof(size_t));
+    if (storage->MapAddr == NULL || storage->MapLength == NULL)
+    {
+        fprintf(stderr, "==> realloc() error\n");
+        exit(-1);
+    }
+    storage->MapAddr[storage->NMaps] = base;
+    storage->MapLength[storage->NMaps] = Length;
+    storage->NMaps++;
+}
+
+/* Write NSlices slices as the volume <basename>.<extension>; returns as WriteFloatArray */
+/* If rows is NULL, the slices are zero */
+static int WriteVolume3D(
+    char *basename,
+    char *extension,
+    int FirstSliceNumber,
+    int NSlices,
+    int NRows,
+    int NColumns,
+    float **rows)
+{
+    FILE *fp;
+    char fname[1024];
+    struct Volume3DHeader header;
+    long SliceSize = (long)NRows*NColumns;
+    int i;
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.Magic, VOLUME3D_MAGIC, 8);
+    header.Version = VOLUME3D_VERSION;
+    header.HeaderSize = VOLUME3D_HEADER_SIZE;
+    header.NSlices = NSlices;
+    header.FirstSliceNumber = FirstSliceNumber;
+    header.NRows = NRows;
+    header.NColumns = NColumns;
+    header.DataPos = VOLUME3D_HEADER_SIZE;
+    header.FileSize = header.DataPos + NSlices*SliceSize*(long)sizeof(float);
+
+    sprintf(fname, "%s.%s", basename, extension);
+    if ((fp = fopen(fname, "w")) == NULL)
+        return(1);
+    if (fwrite(&header, sizeof(header), 1, fp) != 1)
+    {
+        fclose(fp);
+        return(2);
+    }
+    if (rows == NULL && (fflush(fp) || ftruncate(fileno(fp), header.FileSize)))
+    {
+        fclose(fp);
+        return(2);
+    }
+    for (i = 0; i < NSlices && rows != NULL; i++)
+    if (fwrite(rows[i], sizeof(float), SliceSize, fp) != SliceSize)
+    {
+        fclose(fp);
+        return(2);
+    }
+    if (fclose(fp))
+        return(2);
+    return(0);
+}
+
+/* Write NSlices slices into the existing volume <basename>.<extension>, at the positions of slices */
+/* FirstSliceNumber to FirstSliceNumber+NSlices-1; returns as WriteFloatArray, or 3 if the volume */
+/* doesn't hold these slices */
+static int WriteVolumeSlices3D(
+    char *basename,
+    char *extension,
+    int FirstSliceNumber,
+    int NSlices,
+    int NRows,
+    int NColumns,
+    float **rows)
+{
+    FILE *fp;
+    char fname[1024];
+    struct Volume3DHeader header;
+    long SliceSize = (long)NRows*NColumns;
+    int i;
+
+    sprintf(fname, "%s.%s", basename, extension);
+    if ((fp = fopen(fname, "r+")) == NULL)
+        return(1);
+    if (fread(&header, sizeof(header), 1, fp) != 1 || memcmp(header.Magic, VOLUME3D_MAGIC, 8)
+        || header.Version != VOLUME3D_VERSION || header.NRows != NRows || header.NColumns != NColumns
+        || FirstSliceNumber < header.FirstSliceNumber || FirstSliceNumber + NSlices > header.FirstSliceNumber + header.NSlices)
+    {
+        fclose(fp);
+        return(3);
+    }
+    if (fseek(fp, header.DataPos + (FirstSliceNumber - header.FirstSliceNumber)*SliceSize*(long)sizeof(float), SEEK_SET))
+    {
+        fclose(fp);
+        return(2);
+    }
+    for (i = 0; i < NSlices; i++)
+    if (fwrite(rows[i], sizeof(float), SliceSize, fp) != SliceSize)
+    {
+        fclose(fp);
+        return(2);
+    }
+    if (fclose(fp))
+        return(2);
+    return(0);
+}
+
+
 /**********************************************/
 /*     Sinogram I/O and memory allocation     */
 /**********************************************/
 
 /* Utility for reading 3D parallel beam sinogram data */
+/* The per-slice files of this and the other slice I/O utilities are read and written by */
+/* concurrent threads, so that the latency of a network file system is overlapped */
 /* Warning: Memory must be allocated before use */
 /* Returns 0 if no error occurs */
 int ReadSinoData3DParallel(
@@ -609,7 +943,15 @@ int ReadSinoData3DParallel(
     NSlices = sinogram->sinoparams.NSlices;
     FirstSliceNumber = sinogram->sinoparams.FirstSliceNumber;
     M = sinogram->sinoparams.NViews * sinogram->sinoparams.NChannels;
+
+    if(IsVolume3D(basename,"3Dsinodata"))
+    {
+        MapVolume3D(basename, "3Dsinodata", FirstSliceNumber, NSlices, sinogram->sinoparams.NViews, sinogram->sinoparams.NChannels,
+            sinogram->sino, sinogram->SinoStorage, "ReadSinoData3DParallel");
+        return 0;
+    }
     
+    #pragma omp parallel for schedule(dynamic) private(fname,exitcode)
     for(i=0;i<NSlices;i++)
     {
         sprintf(fname,"%s_slice%.*d.2Dsinodata",basename, sinogram->sinoparams.NumSliceDigits, i+FirstSliceNumber);
@@ -642,6 +984,14 @@ int ReadWeights3D(
     FirstSliceNumber = sinogram->sinoparams.FirstSliceNumber;
     M = sinogram->sinoparams.NViews * sinogram->sinoparams.NChannels;
 
+    if(IsVolume3D(basename,"3Dweightdata"))
+    {
+        MapVolume3D(basename, "3Dweightdata", FirstSliceNumber, NSlices, sinogram->sinoparams.NViews, sinogram->sinoparams.NChannels,
+            sinogram->weight, sinogram->WeightStorage, "ReadWeights3D");
+        return 0;
+    }
+
+    #pragma omp parallel for schedule(dynamic) private(fname,exitcode)
     for(i=0;i<NSlices;i++)
     {
         sprintf(fname,"%s_slice%.*d.2Dweightdata",basename, sinogram->sinoparams.NumSliceDigits, i+FirstSliceNumber);
@@ -673,6 +1023,7 @@ int WriteSino3DParallel(
     FirstSliceNumber = sinogram->sinoparams.FirstSliceNumber;
     M = sinogram->sinoparams.NViews * sinogram->sinoparams.NChannels;
 
+    #pragma omp parallel for schedule(dynamic) private(fname,exitcode)
     for(i=0;i<NSlices;i++)
     {
         sprintf(fname,"%s_slice%.*d.2Dsinodata",basename, sinogram->sinoparams.NumSliceDigits, i+FirstSliceNumber);
@@ -704,6 +1055,7 @@ int WriteWeights3D(
     FirstSliceNumber = sinogram->sinoparams.FirstSliceNumber;
     M = sinogram->sinoparams.NViews * sinogram->sinoparams.NChannels;
 
+    #pragma omp parallel for schedule(dynamic) private(fname,exitcode)
     for(i=0;i<NSlices;i++)
     {
         sprintf(fname,"%s_slice%.*d.2Dweightdata",basename, sinogram->sinoparams.NumSliceDigits, i+FirstSliceNumber);
@@ -725,17 +1077,83 @@ int WriteWeights3D(
 /* Returns 0 if no error occurs */
 int AllocateSinoData3DParallel(struct Sino3DParallel *sinogram)  /* Input: Sinogram data+parameters structure */
 {
-    sinogram->sino   = (float **)multialloc(sizeof(float), 2, sinogram->sinoparams.NSlices,sinogram->sinoparams.NViews * sinogram->sinoparams.NChannels);
-    sinogram->weight = (float **)multialloc(sizeof(float), 2, sinogram->sinoparams.NSlices,sinogram->sinoparams.NViews * sinogram->sinoparams.NChannels);
+    long M = (long)sinogram->sinoparams.NViews * sinogram->sinoparams.NChannels;
+
+    sinogram->sino   = AllocateSlices3D(sinogram->sinoparams.NSlices, M, &sinogram->SinoStorage);
+    sinogram->weight = AllocateSlices3D(sinogram->sinoparams.NSlices, M, &sinogram->WeightStorage);
+    return 0;
+}
+
+/* Utility for allocating memory for Sino with the same weight for every measurement */
+/* Returns 0 if no error occurs */
+int AllocateSinoScalarWeights3DParallel(struct Sino3DParallel *sinogram, float weight)
+{
+    long M = (long)sinogram->sinoparams.NViews * sinogram->sinoparams.NChannels;
+    long i;
+    int k;
+
+    sinogram->sino = AllocateSlices3D(sinogram->sinoparams.NSlices, M, &sinogram->SinoStorage);
+
+    /* A single slice of weights, which FreeSlices3D frees like any other block */
+    sinogram->WeightStorage = (struct SliceStorage3D *)get_spc(1, sizeof(struct SliceStorage3D));
+    sinogram->WeightStorage->Block = (float *)get_aligned_spc(M, sizeof(float));
+    for (i = 0; i < M; i++)
+        sinogram->WeightStorage->Block[i] = weight;
+    sinogram->weight = (float **)get_spc(sinogram->sinoparams.NSlices, sizeof(float *));
+    for (k = 0; k < sinogram->sinoparams.NSlices; k++)
+        sinogram->weight[k] = sinogram->WeightStorage->Block;
     return 0;
 }
 
+/* Utility for checking whether all weights are the same value */
+/* Returns 1 if they are */
+int UniformWeights3D(
+	char *basename,		/* Source base filename, i.e. <basename>_slice<Index>.2Dweightdata for given index range */
+	struct SinoParams3DParallel *sinoparams,
+	float *weight)
+{
+    struct SliceStorage3D *storage;
+    float **rows;
+    char fname[1024];
+    long M, i;
+    int k, uniform, exitcode;
+
+    M = (long)sinoparams->NViews * sinoparams->NChannels;
+    uniform = 1;
+    for (k = 0; k < sinoparams->NSlices && uniform; k++)
+    {
+        /* A slice at a time, so that no more than a slice is held in memory */
+        rows = AllocateSlices3D(1, M, &storage);
+        if (IsVolume3D(basename,"3Dweightdata"))
+            MapVolume3D(basename, "3Dweightdata", sinoparams->FirstSliceNumber + k, 1, sinoparams->NViews, sinoparams->NChannels,
+                rows, storage, "UniformWeights3D");
+        else
+        {
+            sprintf(fname,"%s_slice%.*d.2Dweightdata",basename, sinoparams->NumSliceDigits, sinoparams->FirstSliceNumber + k);
+            if( (exitcode=ReadFloatArray(fname,rows[0],M)) ) {
+                if(exitcode==1)
+                    fprintf(stderr, "ERROR in UniformWeights3D: can't open file %s\n",fname);
+                if(exitcode==2)
+                    fprintf(stderr, "ERROR in UniformWeights3D: read from file %s terminated early\n",fname);
+                exit(-1);
+            }
+        }
+        if (k == 0)
+            *weight = rows[0][0];
+        for (i = 0; i < M && uniform; i++)
+            if (rows[0][i] != *weight)
+                uniform = 0;
+        FreeSlices3D(rows, storage);
+    }
+    return uniform;
+}
+
 /* Utility for freeing memory allocated for sinogram, weights and ViewAngles */
 /* Returns 0 if no error occurs */
 int FreeSinoData3DParallel(struct Sino3DParallel *sinogram)  /* Input: Sinogram data+parameters structure */
 {
-    multifree(sinogram->sino,2);
-    multifree(sinogram->weight,2);
+    FreeSlices3D(sinogram->sino, sinogram->SinoStorage);
+    FreeSlices3D(sinogram->weight, sinogram->WeightStorage);
     free((void *)sinogram->sinoparams.ViewAngles);
     return 0;
 }
@@ -758,7 +1176,15 @@ int ReadImage3D(
     Nz = Image->imgparams.Nz;
     FirstSliceNumber = Image->imgparams.FirstSliceNumber;
     M = Image->imgparams.Nx * Image->imgparams.Ny;
+
+    if(IsVolume3D(basename,"3Dimgdata"))
+    {
+        MapVolume3D(basename, "3Dimgdata", FirstSliceNumber, Nz, Image->imgparams.Ny, Image->imgparams.Nx,
+            Image->image, Image->Storage, "ReadImage3D");
+        return 0;
+    }
     
+    #pragma omp parallel for schedule(dynamic) private(fname,exitcode)
     for(i=0;i<Nz;i++)
     {
         sprintf(fname,"%s_slice%.*d.2Dimgdata",basename, Image->imgparams.NumSliceDigits, i+FirstSliceNumber);
@@ -789,6 +1215,7 @@ int WriteImage3D(
     FirstSliceNumber = Image->imgparams.FirstSliceNumber;
     M = Image->imgparams.Nx * Image->imgparams.Ny;
     
+    #pragma omp parallel for schedule(dynamic) private(fname,exitcode)
     for(i=0;i<Nz;i++)
     {
         sprintf(fname,"%s_slice%.*d.2Dimgdata",basename, Image->imgparams.NumSliceDigits, i+FirstSliceNumber);
@@ -806,11 +1233,71 @@ int WriteImage3D(
     return 0;
 }
 
+/* Utility for writing 3D image data as a single-file volume */
+/* Returns 0 if no error occurs */
+int WriteImageVolume3D(
+    char *basename,	/* Destination base filename, i.e. <basename>.3Dimgdata */
+    struct Image3D *Image)  /* Image data+params data structure */
+{
+    int exitcode;
+
+    if( (exitcode=WriteVolume3D(basename, "3Dimgdata", Image->imgparams.FirstSliceNumber, Image->imgparams.Nz,
+        Image->imgparams.Ny, Image->imgparams.Nx, Image->image)) ) {
+        if(exitcode==1)
+            fprintf(stderr, "ERROR in WriteImageVolume3D: can't open file %s.3Dimgdata\n",basename);
+        if(exitcode==2)
+            fprintf(stderr, "ERROR in WriteImageVolume3D: write to file %s.3Dimgdata terminated early\n",basename);
+        exit(-1);
+    }
+    return 0;
+}
+
+/* Utility for creating a volume of zero slices, to be written slab by slab */
+/* Returns 0 if no error occurs */
+int CreateImageVolume3D(
+    char *basename,	/* Destination base filename, i.e. <basename>.3Dimgdata */
+    struct ImageParams3D *imgparams)  /* Image params of the volume */
+{
+    int exitcode;
+
+    if( (exitcode=WriteVolume3D(basename, "3Dimgdata", imgparams->FirstSliceNumber, imgparams->Nz,
+        imgparams->Ny, imgparams->Nx, NULL)) ) {
+        if(exitcode==1)
+            fprintf(stderr, "ERROR in CreateImageVolume3D: can't open file %s.3Dimgdata\n",basename);
+        if(exitcode==2)
+            fprintf(stderr, "ERROR in CreateImageVolume3D: write to file %s.3Dimgdata terminated early\n",basename);
+        exit(-1);
+    }
+    return 0;
+}
+
+/* Utility for writing 3D image data into an existing volume */
+/* Returns 0 if no error occurs */
+int WriteImageVolumeSlices3D(
+    char *basename,	/* Destination base filename, i.e. <basename>.3Dimgdata */
+    struct Image3D *Image)  /* Image data+params data structure */
+{
+    int exitcode;
+
+    if( (exitcode=WriteVolumeSlices3D(basename, "3Dimgdata", Image->imgparams.FirstSliceNumber, Image->imgparams.Nz,
+        Image->imgparams.Ny, Image->imgparams.Nx, Image->image)) ) {
+        if(exitcode==1)
+            fprintf(stderr, "ERROR in WriteImageVolumeSlices3D: can't open file %s.3Dimgdata\n",basename);
+        if(exitcode==2)
+            fprintf(stderr, "ERROR in WriteImageVolumeSlices3D: write to file %s.3Dimgdata terminated early\n",basename);
+        if(exitcode==3)
+            fprintf(stderr, "ERROR in WriteImageVolumeSlices3D: file %s.3Dimgdata doesn't hold slices %d to %d\n",basename,
+                Image->imgparams.FirstSliceNumber, Image->imgparams.FirstSliceNumber + Image->imgparams.Nz - 1);
+        exit(-1);
+    }
+    return 0;
+}
+
 /* Utility for allocating memory for Image */
 /* Returns 0 if no error occurs */
 int AllocateImageData3D(struct Image3D *Image)
 {
-    Image->image = (float **)multialloc(sizeof(float), 2, Image->imgparams.Nz, Image->imgparams.Nx * Image->imgparams.Ny);
+    Image->image = AllocateSlices3D(Image->imgparams.Nz, (long)Image->imgparams.Nx * Image->imgparams.Ny, &Image->Storage);
     return 0;
 }
 
@@ -818,7 +1305,7 @@ int AllocateImageData3D(struct Image3D *Image)
 /* Returns 0 if no error occurs */
 int FreeImageData3D(struct Image3D *Image)
 {
-    multifree(Image->image,2);
+    FreeSlices3D(Image->image, Image->Storage);
     return 0;
 }
 
@@ -828,113 +1315,1130 @@ int FreeImageData3D(struct Image3D *Image)
 /*    Sparse system matrix I/O and memory allocation     */
 /*********************************************************/
 
-/* Utility for reading/allocating the Sparse System Matrix */
-/* NOTE: Memory is allocated for the data structure inside subroutine */
+/* Utility for allocating the arena of the Sparse System Matrix */
+/* A->Ncolumns, A->Nstored, A->Nnonzero, A->Nrun and A->ValueType must be set before use */
+/* The matrix is set up without symmetries */
 /* Returns 0 if no error occurs */
-int ReadSysMatrix2D(
-    char *fname,	/* Source base filename, i.e. <fname>.2dsysmatrix */
-    struct SysMatrix2D *A)  /* Sparse system matrix structure */
+int AllocateSysMatrix2D(struct SysMatrix2D *A)
 {
-    FILE *fp;
-    int i, Ncolumns, Nnonzero;
-    
-    strcat(fname,".2Dsysmatrix"); /* append file extension */
-    
-    /* Allocate memory */
-    Ncolumns=A->Ncolumns;
-    A->column = (struct SparseColumn *)get_spc(Ncolumns, sizeof(struct SparseColumn));
-    
-    //printf("\nReading System-matrix ... \n");
-    
-    if ((fp = fopen(fname, "r")) == NULL)
-    {
-        fprintf(stderr, "ERROR in ReadSysMatrix2D: can't open file %s.\n", fname);
-        exit(-1);
-    }
-    
-    for (i = 0; i < Ncolumns; i++)
-    {
-        if(fread(&Nnonzero, sizeof(int), 1, fp) != 1)
-        {
-            fprintf(stderr, "ERROR in ReadSysMatrix2D: file terminated early %s.\n", fname);
-            exit(-1);
-        }
-        A->column[i].Nnonzero = Nnonzero;
-        
-        if(Nnonzero > 0)
-        {
-            A->column[i].RowIndex = (int *)get_spc(Nnonzero, sizeof(int));
-            A->column[i].Value    = (float *)get_spc(Nnonzero, sizeof(float));
-            
-            if(fread(A->column[i].RowIndex, sizeof(int), Nnonzero, fp)!= Nnonzero)
-            {
-                fprintf(stderr, "ERROR in ReadSysMatrix2D: file terminated early %s.\n", fname);
-                exit(-1);
-            }
-            
-            if(fread(A->column[i].Value, sizeof(float), Nnonzero, fp) != Nnonzero)
-            {
-                fprintf(stderr, "ERROR in ReadSysMatrix2D: file terminated early %s.\n", fname);
-                exit(-1);
-            }
-        }
-    }
-    fclose(fp);
+    A->column = (struct SparseColumn *)get_spc(A->Nstored, sizeof(struct SparseColumn));
+    A->ColumnOffset = (long *)get_spc(A->Nstored+1, sizeof(long));
+    A->RunOffset = (long *)get_spc(A->Nstored+1, sizeof(long));
+    A->Run = (struct SparseRun *)get_aligned_spc(A->Nrun, sizeof(struct SparseRun));
+    A->Value = NULL;
+    A->Value16 = NULL;
+    A->Value8 = NULL;
+    A->Scale = NULL;
+    if (A->ValueType == SYSMATRIX2D_VALUE_FLOAT)
+        A->Value = (float *)get_aligned_spc(A->Nnonzero, sizeof(float));
+    else if (A->ValueType == SYSMATRIX2D_VALUE_UINT16)
+        A->Value16 = (unsigned short *)get_aligned_spc(A->Nnonzero, sizeof(unsigned short));
+    else if (A->ValueType == SYSMATRIX2D_VALUE_UINT8)
+        A->Value8 = (unsigned char *)get_aligned_spc(A->Nnonzero, sizeof(unsigned char));
+    else
+        return 1;
+    if (A->ValueType != SYSMATRIX2D_VALUE_FLOAT)
+        A->Scale = (float *)get_spc(A->Nstored, sizeof(float));
+    A->SymColumn = NULL;
+    A->SymOp = NULL;
+    A->SymView = NULL;
+    A->MapAddr = NULL;
+    A->MapLength = 0;
+    A->ComputeColumn = NULL;
+    A->NCacheColumns = 0;
     return 0;
 }
 
-
-/* Utility for writing the Sparse System Matrix */
-/* Returns 0 if no error occurs */
-int WriteSysMatrix2D(
-	char *fname,	/* Destination base filename, i.e. <fname>.2dsysmatrix */
-	struct SysMatrix2D *A)  /* Sparse system matrix structure */
+/* Utility for pointing each column of the Sparse System Matrix into the arena */
+/* A->ColumnOffset and A->RunOffset must be filled in before use */
+/* Also sets A->MaxColumnNnonzero */
+void SetSysMatrix2DColumns(struct SysMatrix2D *A)
 {
-    FILE *fp;
-    int i, Nnonzero, Ncolumns;
+    int i;
 
-    strcat(fname,".2Dsysmatrix"); /* append file extension */
-   
-    if ((fp = fopen(fname, "w")) == NULL)
+    A->MaxColumnNnonzero = 0;
+    for (i = 0; i < A->Nstored; i++)
     {
-        fprintf(stderr, "ERROR in WriteSysMatrix2D: can't open file %s.\n", fname);
-        exit(-1);
+        A->column[i].Nnonzero = A->ColumnOffset[i+1] - A->ColumnOffset[i];
+        A->column[i].Nrun = A->RunOffset[i+1] - A->RunOffset[i];
+        A->column[i].Run = A->Run + A->RunOffset[i];
+        A->column[i].Value = (A->Value != NULL) ? A->Value + A->ColumnOffset[i] : NULL;
+        A->column[i].Value16 = (A->Value16 != NULL) ? A->Value16 + A->ColumnOffset[i] : NULL;
+        A->column[i].Value8 = (A->Value8 != NULL) ? A->Value8 + A->ColumnOffset[i] : NULL;
+        A->column[i].Scale = (A->Scale != NULL) ? A->Scale[i] : 1.0;
+        if (A->column[i].Nnonzero > A->MaxColumnNnonzero)
+            A->MaxColumnNnonzero = A->column[i].Nnonzero;
     }
+}
 
-    Ncolumns = A->Ncolumns;
-
-    for (i = 0; i < Ncolumns; i++)
-    {
-        Nnonzero = A->column[i].Nnonzero;
-        fwrite(&Nnonzero, sizeof(int), 1, fp);
-
-        if(Nnonzero>0)
-        {
-            fwrite(A->column[i].RowIndex, sizeof(int), Nnonzero, fp);
-            fwrite(A->column[i].Value, sizeof(float), Nnonzero, fp);
-        }
-    }
-    fclose(fp);
-    return 0;
+/* Utility for filling in the geometry parameters of a Sparse System Matrix */
+/* LenPix and LenDet depend on the projector and are left to the caller */
+void SetSysMatrixParams2D(
+    struct SysMatrixParams2D *params,
+    struct SinoParams3DParallel *sinoparams,
+    struct ImageParams3D *imgparams)
+{
+    memset(params, 0, sizeof(struct SysMatrixParams2D));
+    params->Nx = imgparams->Nx;
+    params->Ny = imgparams->Ny;
+    params->Deltaxy = imgparams->Deltaxy;
+    params->NChannels = sinoparams->NChannels;
+    params->NViews = sinoparams->NViews;
+    params->DeltaChannel = sinoparams->DeltaChannel;
+    params->CenterOffset = sinoparams->CenterOffset;
+    params->ViewAnglesHash = HashBytes(sinoparams->ViewAngles, sinoparams->NViews*sizeof(float), 0);
 }
 
-/* Utility for freeing memory from Sparse System Matrix */
-/* Returns 0 if no error occurs */
-int FreeSysMatrix2D(struct SysMatrix2D *A)
+/* Check that the geometry of a Sparse System Matrix matches the expected one, and print */
+/* the fields that differ. The projector parameters (LenPix, LenDet, Projector) are not compared */
+/* Returns the number of fields that differ */
+int CompareSysMatrixParams2D(
+    struct SysMatrixParams2D *expected,
+    struct SysMatrixParams2D *params,
+    char *fname)
 {
-    int i;
+    int Ndiff = 0;
+
+#define COMPARE_INT(field) \
+    if (expected->field != params->field) \
+    { \
+        fprintf(stderr, "ERROR: %s has " #field " = %d, expected %d\n", fname, params->field, expected->field); \
+        Ndiff++; \
+    }
+#define COMPARE_FLOAT(field) \
+    if (fabs(expected->field - params->field) > 1e-6*fabs(expected->field)) \
+    { \
+        fprintf(stderr, "ERROR: %s has " #field " = %g, expected %g\n", fname, params->field, expected->field); \
+        Ndiff++; \
+    }
 
-    for (i = 0; i < (A->Ncolumns); i++)
+    COMPARE_INT(Nx)
+    COMPARE_INT(Ny)
+    COMPARE_FLOAT(Deltaxy)
+    COMPARE_INT(NChannels)
+    COMPARE_INT(NViews)
+    COMPARE_FLOAT(DeltaChannel)
+    COMPARE_FLOAT(CenterOffset)
+    if (expected->ViewAnglesHash != params->ViewAnglesHash)
     {
-        free((void *)A->column[i].RowIndex);
-        free((void *)A->column[i].Value);
+        fprintf(stderr, "ERROR: %s was computed for different view angles\n", fname);
+        Ndiff++;
     }
-    return 0;
+
+#undef COMPARE_INT
+#undef COMPARE_FLOAT
+
+    return Ndiff;
 }
 
+/* Hash of all fields of the System Matrix parameters, which identifies the matrix */
+unsigned long HashSysMatrixParams2D(struct SysMatrixParams2D *params)
+{
+    unsigned long hash = 0;
+
+    hash = HashBytes(&params->Nx, sizeof(int), hash);
+    hash = HashBytes(&params->Ny, sizeof(int), hash);
+    hash = HashBytes(&params->Deltaxy, sizeof(float), hash);
+    hash = HashBytes(&params->NChannels, sizeof(int), hash);
+    hash = HashBytes(&params->NViews, sizeof(int), hash);
+    hash = HashBytes(&params->DeltaChannel, sizeof(float), hash);
+    hash = HashBytes(&params->CenterOffset, sizeof(float), hash);
+    hash = HashBytes(&params->LenPix, sizeof(int), hash);
+    hash = HashBytes(&params->LenDet, sizeof(int), hash);
+    hash = HashBytes(&params->Projector, sizeof(int), hash);
+    hash = HashBytes(&params->ViewAnglesHash, sizeof(unsigned long), hash);
+
+    return hash;
+}
 
+/* Utility for run-length encoding the (increasing) row indices of a sparse column */
+/* Run must have room for Nnonzero runs. Returns the number of runs, or -1 if a row index */
+/* is out of range for NViews*NChannels rows or doesn't fit a SparseRun */
+int EncodeSparseRuns(
+    int *RowIndex,
+    int Nnonzero,
+    int NViews,
+    int NChannels,
+    struct SparseRun *Run)
+{
+    int n, Nrun, View, Channel;
 
-/************************************************************/
+    Nrun = 0;
+    for (n = 0; n < Nnonzero; n++)
+    {
+        if (RowIndex[n] < 0 || RowIndex[n] >= NViews*NChannels)
+            return(-1);
+        View = RowIndex[n]/NChannels;
+        Channel = RowIndex[n]%NChannels;
+        if (View > SPARSERUN_MAX_INDEX || Channel > SPARSERUN_MAX_INDEX)
+            return(-1);
+
+        if (Nrun > 0 && Run[Nrun-1].View == View && Run[Nrun-1].FirstChannel + Run[Nrun-1].Length == Channel)
+        {
+            Run[Nrun-1].Length++;
+        }
+        else
+        {
+            Run[Nrun].View = View;
+            Run[Nrun].FirstChannel = Channel;
+            Run[Nrun].Length = 1;
+            Nrun++;
+        }
+    }
+    return(Nrun);
+}
+
+/* Round a file position up to the next multiple of SYSMATRIX2D_ALIGNMENT */
+static long AlignSysMatrix2DPos(long pos)
+{
+    return (pos + SYSMATRIX2D_ALIGNMENT - 1)/SYSMATRIX2D_ALIGNMENT*SYSMATRIX2D_ALIGNMENT;
+}
+
+/* Check that a column offset table has the given first and last entries and doesn't decrease */
+static int CheckSysMatrix2DOffsets(long *Offset, int Ncolumns, long Total)
+{
+    int i;
+
+    if (Offset[0] != 0 || Offset[Ncolumns] != Total)
+        return(1);
+    for (i = 0; i < Ncolumns; i++)
+    if (Offset[i+1] < Offset[i])
+        return(1);
+    return(0);
+}
+
+/* Build a heap arena from columns given by row indices (legacy and version 2 files) */
+/* The Run arena is sized for the worst case of one run per entry while the columns are */
+/* encoded, and shrunk to its final size afterwards */
+struct SysMatrix2DBuilder
+{
+    struct SysMatrix2D *A;
+    struct SparseRun *Run;  /* Worst case Run arena */
+    char *fname;
+};
+
+static void BeginSysMatrix2DBuild(struct SysMatrix2DBuilder *build, struct SysMatrix2D *A, long Nnonzero, char *fname)
+{
+    if (A->params.NViews <= 0 || A->params.NChannels <= 0)
+    {
+        fprintf(stderr, "ERROR in ReadSysMatrix2D: NViews and NChannels must be set to read file %s.\n", fname);
+        exit(-1);
+    }
+    A->Nstored = A->Ncolumns;
+    A->Nnonzero = Nnonzero;
+    A->Nrun = 0;
+    A->ValueType = SYSMATRIX2D_VALUE_FLOAT;
+    AllocateSysMatrix2D(A);
+    build->A = A;
+    build->Run = (struct SparseRun *)get_aligned_spc(Nnonzero, sizeof(struct SparseRun));
+    build->fname = fname;
+}
+
+static void AddSysMatrix2DColumn(struct SysMatrix2DBuilder *build, int i, int *RowIndex, float *Value, int Nnonzero)
+{
+    struct SysMatrix2D *A = build->A;
+    int Nrun;
+
+    A->ColumnOffset[i] = (i == 0) ? 0 : A->ColumnOffset[i-1] + A->column[i-1].Nnonzero;
+    A->RunOffset[i] = A->Nrun;
+    if (A->ColumnOffset[i] + Nnonzero > A->Nnonzero)
+    {
+        fprintf(stderr, "ERROR in ReadSysMatrix2D: file %s is corrupted.\n", build->fname);
+        exit(-1);
+    }
+    Nrun = EncodeSparseRuns(RowIndex, Nnonzero, A->params.NViews, A->params.NChannels, build->Run + A->Nrun);
+    if (Nrun < 0)
+    {
+        fprintf(stderr, "ERROR in ReadSysMatrix2D: row index out of range for %d views x %d channels in file %s.\n", A->params.NViews, A->params.NChannels, build->fname);
+        exit(-1);
+    }
+    memcpy(A->Value + A->ColumnOffset[i], Value, Nnonzero*sizeof(float));
+    A->column[i].Nnonzero = Nnonzero;
+    A->Nrun += Nrun;
+}
+
+static void EndSysMatrix2DBuild(struct SysMatrix2DBuilder *build)
+{
+    struct SysMatrix2D *A = build->A;
+    int N = A->Ncolumns;
+
+    A->ColumnOffset[N] = (N == 0) ? 0 : A->ColumnOffset[N-1] + A->column[N-1].Nnonzero;
+    A->RunOffset[N] = A->Nrun;
+    if (A->ColumnOffset[N] != A->Nnonzero)
+    {
+        fprintf(stderr, "ERROR in ReadSysMatrix2D: file %s is corrupted.\n", build->fname);
+        exit(-1);
+    }
+    free((void *)A->Run);
+    A->Run = (struct SparseRun *)get_aligned_spc(A->Nrun, sizeof(struct SparseRun));
+    memcpy(A->Run, build->Run, A->Nrun*sizeof(struct SparseRun));
+    free((void *)build->Run);
+    SetSysMatrix2DColumns(A);
+}
+
+/* Read a legacy (headerless) .2Dsysmatrix file into a heap arena */
+static void ReadSysMatrix2DLegacy(
+    FILE *fp,
+    char *fname,
+    struct SysMatrix2D *A)
+{
+    struct SysMatrix2DBuilder build;
+    int i, Ncolumns, Nnonzero, MaxNnonzero;
+    long FileSize;
+    int *RowIndex;
+    float *Value;
+
+    /* Each column is stored as Nnonzero (int), then Nnonzero row indices (int) and values (float), */
+    /* so the file size determines the total number of nonzero entries for the arena */
+    Ncolumns=A->Ncolumns;
+    fseek(fp, 0, SEEK_END);
+    FileSize = ftell(fp);
+    rewind(fp);
+    if (FileSize < (long)Ncolumns*sizeof(int) || (FileSize - (long)Ncolumns*sizeof(int)) % (sizeof(int)+sizeof(float)) != 0)
+    {
+        fprintf(stderr, "ERROR in ReadSysMatrix2D: size of file %s doesn't match a %d column matrix.\n", fname, Ncolumns);
+        exit(-1);
+    }
+
+    /* Allocate memory */
+    BeginSysMatrix2DBuild(&build, A, (FileSize - (long)Ncolumns*sizeof(int)) / (sizeof(int)+sizeof(float)), fname);
+    A->params.LenPix = A->params.LenDet = 0;  /* projector settings are not stored in legacy files */
+    MaxNnonzero = A->params.NViews*A->params.NChannels;
+    RowIndex = (int *)get_spc(MaxNnonzero, sizeof(int));
+    Value = (float *)get_spc(MaxNnonzero, sizeof(float));
+    
+    for (i = 0; i < Ncolumns; i++)
+    {
+        if(fread(&Nnonzero, sizeof(int), 1, fp) != 1)
+        {
+            fprintf(stderr, "ERROR in ReadSysMatrix2D: file terminated early %s.\n", fname);
+            exit(-1);
+        }
+        if(Nnonzero < 0 || Nnonzero > MaxNnonzero)
+        {
+            fprintf(stderr, "ERROR in ReadSysMatrix2D: file %s is corrupted.\n", fname);
+            exit(-1);
+        }
+        if(fread(RowIndex, sizeof(int), Nnonzero, fp)!= Nnonzero || fread(Value, sizeof(float), Nnonzero, fp) != Nnonzero)
+        {
+            fprintf(stderr, "ERROR in ReadSysMatrix2D: file terminated early %s.\n", fname);
+            exit(-1);
+        }
+        AddSysMatrix2DColumn(&build, i, RowIndex, Value, Nnonzero);
+    }
+    EndSysMatrix2DBuild(&build);
+
+    free((void *)RowIndex);
+    free((void *)Value);
+}
+
+/* Size (bytes) of one stored value of the given type, 0 if the type is unknown */
+static int SysMatrix2DValueSize(int ValueType)
+{
+    if (ValueType == SYSMATRIX2D_VALUE_FLOAT)
+        return sizeof(float);
+    if (ValueType == SYSMATRIX2D_VALUE_UINT16)
+        return sizeof(unsigned short);
+    if (ValueType == SYSMATRIX2D_VALUE_UINT8)
+        return sizeof(unsigned char);
+    return 0;
+}
+
+/* Check the symmetry tables of a matrix read from a file */
+static int CheckSysMatrix2DSymmetries(struct SysMatrix2D *A)
+{
+    int i, v, NViews = A->params.NViews;
+
+    for (i = 0; i < A->Ncolumns; i++)
+        if (A->SymColumn[i] < 0 || A->SymColumn[i] >= A->Nstored || A->SymOp[i] >= SYSMATRIX2D_NSYM)
+            return(1);
+    for (i = 0; i < SYSMATRIX2D_NSYM*NViews; i++)
+    {
+        v = (A->SymView[i] >= 0) ? A->SymView[i] : -1-A->SymView[i];
+        if (v >= NViews)
+            return(1);
+    }
+    return(0);
+}
+
+/* Map a .2Dsysmatrix file; version 3 and up are used in place as the matrix arena, version 2 is converted */
+static void MapSysMatrix2D(
+    FILE *fp,
+    char *fname,
+    struct SysMatrix2DHeader *header,
+    struct SysMatrix2D *A)
+{
+    struct SysMatrix2DBuilder build;
+    struct stat st;
+    char *base;
+    long *ColumnOffset, *RunOffset;
+    long ValueSize;
+    int i, ok;
+
+    if (header->Version < 2 || header->Version > SYSMATRIX2D_VERSION || header->HeaderSize != SYSMATRIX2D_HEADER_SIZE)
+    {
+        fprintf(stderr, "ERROR in ReadSysMatrix2D: file %s has unsupported version %d.\n", fname, header->Version);
+        exit(-1);
+    }
+    if (header->Version < 5)
+        header->NImageColumns = 0;
+    if ((header->NImageColumns > 0 ? header->NImageColumns : header->Ncolumns) != A->Ncolumns)
+    {
+        fprintf(stderr, "ERROR in ReadSysMatrix2D: file %s has %d columns, expected %d (Nx*Ny).\n", fname,
+            header->NImageColumns > 0 ? header->NImageColumns : header->Ncolumns, A->Ncolumns);
+        exit(-1);
+    }
+    if (header->params.NViews != A->params.NViews || header->params.NChannels != A->params.NChannels)
+    {
+        fprintf(stderr, "ERROR in ReadSysMatrix2D: file %s is for %d views x %d channels, expected %d x %d.\n", fname,
+            header->params.NViews, header->params.NChannels, A->params.NViews, A->params.NChannels);
+        exit(-1);
+    }
+
+    if (header->Version < 4)
+    {
+        header->ValueType = SYSMATRIX2D_VALUE_FLOAT;
+        header->ScalePos = 0;
+    }
+    ValueSize = SysMatrix2DValueSize(header->ValueType);
+
+    ok = (fstat(fileno(fp), &st) == 0 && st.st_size == header->FileSize && header->Nnonzero >= 0 && ValueSize > 0
+        && header->ColumnOffsetPos % SYSMATRIX2D_ALIGNMENT == 0 && header->ValuePos % SYSMATRIX2D_ALIGNMENT == 0
+        && header->ColumnOffsetPos >= header->HeaderSize
+        && header->ValuePos + header->Nnonzero*ValueSize <= header->FileSize);
+    if (header->ValueType != SYSMATRIX2D_VALUE_FLOAT)
+        ok = ok && header->ScalePos % SYSMATRIX2D_ALIGNMENT == 0
+            && header->ValuePos + header->Nnonzero*ValueSize <= header->ScalePos
+            && header->ScalePos + header->Ncolumns*(long)sizeof(float) <= header->FileSize;
+    if (header->NImageColumns > 0)
+        ok = ok && header->Ncolumns <= header->NImageColumns && header->SymColumnPos % SYSMATRIX2D_ALIGNMENT == 0
+            && header->SymOpPos % SYSMATRIX2D_ALIGNMENT == 0 && header->SymViewPos % SYSMATRIX2D_ALIGNMENT == 0
+            && header->SymColumnPos >= header->ValuePos + header->Nnonzero*ValueSize
+            && header->SymColumnPos + header->NImageColumns*(long)sizeof(int) <= header->SymOpPos
+            && header->SymOpPos + header->NImageColumns*(long)sizeof(unsigned char) <= header->SymViewPos
+            && header->SymViewPos + SYSMATRIX2D_NSYM*header->params.NViews*(long)sizeof(int) <= header->FileSize;
+    if (header->Version == 2)
+        ok = ok && header->RowIndexPos % SYSMATRIX2D_ALIGNMENT == 0
+            && header->ColumnOffsetPos + (header->Ncolumns+1)*(long)sizeof(long) <= header->RowIndexPos
+            && header->RowIndexPos + header->Nnonzero*(long)sizeof(int) <= header->ValuePos;
+    else
+        ok = ok && header->Nrun >= 0 && header->RunOffsetPos % SYSMATRIX2D_ALIGNMENT == 0 && header->RunPos % SYSMATRIX2D_ALIGNMENT == 0
+            && header->ColumnOffsetPos + (header->Ncolumns+1)*(long)sizeof(long) <= header->RunOffsetPos
+            && header->RunOffsetPos + (header->Ncolumns+1)*(long)sizeof(long) <= header->RunPos
+            && header->RunPos + header->Nrun*(long)sizeof(struct SparseRun) <= header->ValuePos;
+    if (!ok)
+    {
+        fprintf(stderr, "ERROR in ReadSysMatrix2D: header of file %s is inconsistent with its size.\n", fname);
+        exit(-1);
+    }
+
+    base = mmap(NULL, header->FileSize, PROT_READ, MAP_SHARED, fileno(fp), 0);
+    if (base == MAP_FAILED)
+    {
+        fprintf(stderr, "ERROR in ReadSysMatrix2D: can't map file %s.\n", fname);
+        exit(-1);
+    }
+
+    ColumnOffset = (long *)(base + header->ColumnOffsetPos);
+    if (CheckSysMatrix2DOffsets(ColumnOffset, header->Ncolumns, header->Nnonzero))
+    {
+        fprintf(stderr, "ERROR in ReadSysMatrix2D: column offset table of file %s is corrupted.\n", fname);
+        exit(-1);
+    }
+
+    if (header->Version == 2)
+    {
+        BeginSysMatrix2DBuild(&build, A, header->Nnonzero, fname);
+        A->params = header->params;
+        for (i = 0; i < A->Ncolumns; i++)
+            AddSysMatrix2DColumn(&build, i, (int *)(base + header->RowIndexPos) + ColumnOffset[i],
+                (float *)(base + header->ValuePos) + ColumnOffset[i], ColumnOffset[i+1] - ColumnOffset[i]);
+        EndSysMatrix2DBuild(&build);
+        munmap(base, header->FileSize);
+        return;
+    }
+
+    RunOffset = (long *)(base + header->RunOffsetPos);
+    if (CheckSysMatrix2DOffsets(RunOffset, header->Ncolumns, header->Nrun))
+    {
+        fprintf(stderr, "ERROR in ReadSysMatrix2D: run offset table of file %s is corrupted.\n", fname);
+        exit(-1);
+    }
+    posix_madvise(base + header->RunPos, header->FileSize - header->RunPos, POSIX_MADV_WILLNEED);
+
+    A->Nstored = header->Ncolumns;
+    A->Nnonzero = header->Nnonzero;
+    A->Nrun = header->Nrun;
+    A->params = header->params;
+    A->column = (struct SparseColumn *)get_spc(A->Nstored, sizeof(struct SparseColumn));
+    A->ColumnOffset = ColumnOffset;
+    A->RunOffset = RunOffset;
+    A->Run = (struct SparseRun *)(base + header->RunPos);
+    A->ValueType = header->ValueType;
+    A->Value = (header->ValueType == SYSMATRIX2D_VALUE_FLOAT) ? (float *)(base + header->ValuePos) : NULL;
+    A->Value16 = (header->ValueType == SYSMATRIX2D_VALUE_UINT16) ? (unsigned short *)(base + header->ValuePos) : NULL;
+    A->Value8 = (header->ValueType == SYSMATRIX2D_VALUE_UINT8) ? (unsigned char *)(base + header->ValuePos) : NULL;
+    A->Scale = (header->ValueType != SYSMATRIX2D_VALUE_FLOAT) ? (float *)(base + header->ScalePos) : NULL;
+    A->SymColumn = NULL;
+    A->SymOp = NULL;
+    A->SymView = NULL;
+    if (header->NImageColumns > 0)
+    {
+        A->SymColumn = (int *)(base + header->SymColumnPos);
+        A->SymOp = (unsigned char *)(base + header->SymOpPos);
+        A->SymView = (int *)(base + header->SymViewPos);
+        if (CheckSysMatrix2DSymmetries(A))
+        {
+            fprintf(stderr, "ERROR in ReadSysMatrix2D: symmetry tables of file %s are corrupted.\n", fname);
+            exit(-1);
+        }
+    }
+    A->MapAddr = base;
+    A->MapLength = header->FileSize;
+    A->ComputeColumn = NULL;
+    A->NCacheColumns = 0;
+    SetSysMatrix2DColumns(A);
+}
+
+/* Utility for reading/allocating the Sparse System Matrix */
+/* Version 3 and up files are memory mapped, older files are converted in memory */
+/* NOTE: Memory is allocated (or mapped) for the data structure inside subroutine */
+/* Returns 0 if no error occurs */
+int ReadSysMatrix2D(
+    char *fname,	/* Source base filename, i.e. <fname>.2dsysmatrix */
+    struct SysMatrix2D *A)  /* Sparse system matrix structure */
+{
+    FILE *fp;
+    struct SysMatrix2DHeader header;
+    
+    strcat(fname,".2Dsysmatrix"); /* append file extension */
+    
+    //printf("\nReading System-matrix ... \n");
+    
+    if ((fp = fopen(fname, "r")) == NULL)
+    {
+        fprintf(stderr, "ERROR in ReadSysMatrix2D: can't open file %s.\n", fname);
+        exit(-1);
+    }
+
+    if (fread(&header, sizeof(struct SysMatrix2DHeader), 1, fp) == 1 && memcmp(header.Magic, SYSMATRIX2D_MAGIC, 8) == 0)
+        MapSysMatrix2D(fp, fname, &header, A);
+    else
+        ReadSysMatrix2DLegacy(fp, fname, A);
+
+    fclose(fp);
+    return 0;
+}
+
+
+/* Utility for planning the memory of ReadSysMatrix2D without reading the matrix */
+/* Version 3 and up files are mapped, which takes the file and a column table. Legacy and version 2 */
+/* files are converted into heap arenas: values, offset and column tables, and runs, which are encoded */
+/* into a buffer and then copied to their final size (see SysMatrix2DBuilder). The columns of those */
+/* files have at most a run per view, and a version 2 file is mapped while it is converted. Ncolumns */
+/* and NViews are only needed for legacy files, which don't record them */
+long SysMatrix2DFootprint(char *fname, int Ncolumns, int NViews)
+{
+    FILE *fp;
+    char path[1024];
+    struct SysMatrix2DHeader header;
+    struct stat st;
+    long Nnonzero, Nrun, size;
+
+    sprintf(path, "%s.2Dsysmatrix", fname);
+    if ((fp = fopen(path, "r")) == NULL || fstat(fileno(fp), &st) != 0)
+    {
+        fprintf(stderr, "ERROR in SysMatrix2DFootprint: can't open file %s.\n", path);
+        exit(-1);
+    }
+    size = 0;
+    if (fread(&header, sizeof(struct SysMatrix2DHeader), 1, fp) == 1 && memcmp(header.Magic, SYSMATRIX2D_MAGIC, 8) == 0)
+    {
+        size = header.FileSize;
+        if (header.Version >= 3)
+        {
+            fclose(fp);
+            return size + (long)header.Ncolumns*sizeof(struct SparseColumn);
+        }
+        Ncolumns = header.Ncolumns;
+        NViews = header.params.NViews;
+        Nnonzero = header.Nnonzero;
+    }
+    else
+        Nnonzero = ((long)st.st_size - (long)Ncolumns*sizeof(int))/(sizeof(int) + sizeof(float));
+    fclose(fp);
+    Nrun = (long)Ncolumns*NViews;
+    Nrun = (Nrun < Nnonzero) ? Nrun : Nnonzero;
+    return size + Nnonzero*(long)sizeof(float) + 2*Nrun*(long)sizeof(struct SparseRun)
+        + 2*(Ncolumns+1)*(long)sizeof(long) + Ncolumns*(long)sizeof(struct SparseColumn);
+}
+
+
+/* Write zero bytes up to the given file position */
+static void PadSysMatrix2DFile(FILE *fp, long pos)
+{
+    char zeros[SYSMATRIX2D_ALIGNMENT] = {0};
+
+    if (ftell(fp) < pos)
+        fwrite(zeros, 1, pos - ftell(fp), fp);
+}
+
+/* Lay out the sections of a version 5 file for the sizes given in A, with room for RunCapacity */
+/* (at least A->Nrun) runs before the values */
+static void SetSysMatrix2DHeader(struct SysMatrix2DHeader *header, struct SysMatrix2D *A, long RunCapacity)
+{
+    memset(header, 0, sizeof(struct SysMatrix2DHeader));
+    memcpy(header->Magic, SYSMATRIX2D_MAGIC, 8);
+    header->Version = SYSMATRIX2D_VERSION;
+    header->HeaderSize = SYSMATRIX2D_HEADER_SIZE;
+    header->params = A->params;
+    header->Ncolumns = A->Nstored;
+    header->Nnonzero = A->Nnonzero;
+    header->Nrun = A->Nrun;
+    header->ColumnOffsetPos = AlignSysMatrix2DPos(SYSMATRIX2D_HEADER_SIZE);
+    header->RunOffsetPos = AlignSysMatrix2DPos(header->ColumnOffsetPos + (A->Nstored+1)*sizeof(long));
+    header->RunPos = AlignSysMatrix2DPos(header->RunOffsetPos + (A->Nstored+1)*sizeof(long));
+    header->ValueType = A->ValueType;
+    header->ValuePos = AlignSysMatrix2DPos(header->RunPos + RunCapacity*sizeof(struct SparseRun));
+    header->FileSize = header->ValuePos + A->Nnonzero*SysMatrix2DValueSize(A->ValueType);
+    if (A->ValueType != SYSMATRIX2D_VALUE_FLOAT)
+    {
+        header->ScalePos = AlignSysMatrix2DPos(header->FileSize);
+        header->FileSize = header->ScalePos + A->Nstored*sizeof(float);
+    }
+    if (A->SymColumn != NULL)
+    {
+        header->NImageColumns = A->Ncolumns;
+        header->SymColumnPos = AlignSysMatrix2DPos(header->FileSize);
+        header->SymOpPos = AlignSysMatrix2DPos(header->SymColumnPos + A->Ncolumns*sizeof(int));
+        header->SymViewPos = AlignSysMatrix2DPos(header->SymOpPos + A->Ncolumns*sizeof(unsigned char));
+        header->FileSize = header->SymViewPos + SYSMATRIX2D_NSYM*A->params.NViews*sizeof(int);
+    }
+}
+
+/* Write the symmetry sections, if any; returns 1 if no error occurs */
+static int WriteSysMatrix2DSymmetries(FILE *fp, struct SysMatrix2DHeader *header, struct SysMatrix2D *A)
+{
+    int ok = 1;
+
+    if (A->SymColumn != NULL)
+    {
+        PadSysMatrix2DFile(fp, header->SymColumnPos);
+        ok = ok && (fwrite(A->SymColumn, sizeof(int), A->Ncolumns, fp) == A->Ncolumns);
+        PadSysMatrix2DFile(fp, header->SymOpPos);
+        ok = ok && (fwrite(A->SymOp, sizeof(unsigned char), A->Ncolumns, fp) == A->Ncolumns);
+        PadSysMatrix2DFile(fp, header->SymViewPos);
+        ok = ok && (fwrite(A->SymView, sizeof(int), SYSMATRIX2D_NSYM*A->params.NViews, fp) == SYSMATRIX2D_NSYM*A->params.NViews);
+    }
+    return ok;
+}
+
+/* Quantize the N values of a column to ValueType (into Value16 or Value8) and return the scale */
+/* Adds the squared values and errors to SumSq and SumSqErr, and raises MaxRelErr to the largest */
+/* error relative to the column maximum */
+static float QuantizeSysMatrix2DColumn(
+    float *Value,
+    long N,
+    int ValueType,
+    unsigned short *Value16,
+    unsigned char *Value8,
+    double *SumSq,
+    double *SumSqErr,
+    double *MaxRelErr)
+{
+    long n;
+    int MaxLevel = (ValueType == SYSMATRIX2D_VALUE_UINT16) ? 65535 : 255;
+    float MaxValue = 0.0, Scale, q, err;
+
+    for (n = 0; n < N; n++)
+        MaxValue = (Value[n] > MaxValue) ? Value[n] : MaxValue;
+    Scale = (MaxValue > 0.0) ? MaxValue/MaxLevel : 1.0;
+
+    for (n = 0; n < N; n++)
+    {
+        q = Value[n]/Scale + 0.5;
+        q = (q > MaxLevel) ? MaxLevel : q;
+        if (ValueType == SYSMATRIX2D_VALUE_UINT16)
+            Value16[n] = q;
+        else
+            Value8[n] = q;
+        err = Scale*(int)q - Value[n];
+        *SumSq += (double)Value[n]*Value[n];
+        *SumSqErr += (double)err*err;
+        if (MaxValue > 0.0 && fabs(err)/MaxValue > *MaxRelErr)
+            *MaxRelErr = fabs(err)/MaxValue;
+    }
+    return Scale;
+}
+
+/* Utility for writing the Sparse System Matrix */
+/* Writes the version 5 format; the matrix must be stored in a single arena */
+/* Returns 0 if no error occurs */
+int WriteSysMatrix2D(
+	char *fname,	/* Destination base filename, i.e. <fname>.2dsysmatrix */
+	struct SysMatrix2D *A)  /* Sparse system matrix structure */
+{
+    FILE *fp;
+    struct SysMatrix2DHeader header;
+    int ok;
+
+    strcat(fname,".2Dsysmatrix"); /* append file extension */
+   
+    if ((fp = fopen(fname, "w")) == NULL)
+    {
+        fprintf(stderr, "ERROR in WriteSysMatrix2D: can't open file %s.\n", fname);
+        exit(-1);
+    }
+
+    SetSysMatrix2DHeader(&header, A, A->Nrun);
+    ok = (fwrite(&header, sizeof(struct SysMatrix2DHeader), 1, fp) == 1);
+    PadSysMatrix2DFile(fp, header.ColumnOffsetPos);
+    ok = ok && (fwrite(A->ColumnOffset, sizeof(long), A->Nstored+1, fp) == A->Nstored+1);
+    PadSysMatrix2DFile(fp, header.RunOffsetPos);
+    ok = ok && (fwrite(A->RunOffset, sizeof(long), A->Nstored+1, fp) == A->Nstored+1);
+    PadSysMatrix2DFile(fp, header.RunPos);
+    ok = ok && (fwrite(A->Run, sizeof(struct SparseRun), A->Nrun, fp) == A->Nrun);
+    PadSysMatrix2DFile(fp, header.ValuePos);
+    if (A->ValueType == SYSMATRIX2D_VALUE_FLOAT)
+        ok = ok && (fwrite(A->Value, sizeof(float), A->Nnonzero, fp) == A->Nnonzero);
+    else if (A->ValueType == SYSMATRIX2D_VALUE_UINT16)
+        ok = ok && (fwrite(A->Value16, sizeof(unsigned short), A->Nnonzero, fp) == A->Nnonzero);
+    else
+        ok = ok && (fwrite(A->Value8, sizeof(unsigned char), A->Nnonzero, fp) == A->Nnonzero);
+    if (A->ValueType != SYSMATRIX2D_VALUE_FLOAT)
+    {
+        PadSysMatrix2DFile(fp, header.ScalePos);
+        ok = ok && (fwrite(A->Scale, sizeof(float), A->Nstored, fp) == A->Nstored);
+    }
+    ok = ok && WriteSysMatrix2DSymmetries(fp, &header, A);
+
+    if (fclose(fp) != 0 || !ok)
+    {
+        fprintf(stderr, "ERROR in WriteSysMatrix2D: write to file %s terminated early.\n", fname);
+        return 1;
+    }
+    return 0;
+}
+
+/* Print the error and the storage saved by quantizing the values of A */
+static void PrintSysMatrix2DQuantization(struct SysMatrix2D *A, double SumSq, double SumSqErr, double MaxRelErr)
+{
+    fprintf(stdout, "Quantized System Matrix values to %d bits\n", (A->ValueType == SYSMATRIX2D_VALUE_UINT16) ? 16 : 8);
+    fprintf(stdout, "\tRelative RMS error = %e, max error relative to column maximum = %e\n",
+        (SumSq > 0.0) ? sqrt(SumSqErr/SumSq) : 0.0, MaxRelErr);
+    fprintf(stdout, "\tValue storage %.1f MB -> %.1f MB\n", A->Nnonzero*sizeof(float)/1048576.0,
+        (A->Nnonzero*SysMatrix2DValueSize(A->ValueType) + A->Nstored*sizeof(float))/1048576.0);
+}
+
+/* Utility for quantizing the values of a Sparse System Matrix to 16 or 8 bit integers */
+/* Each column gets its own scale, so the largest entry of the column maps to the largest integer */
+/* Prints the error of the quantized matrix relative to the float matrix */
+/* Returns 0 if no error occurs */
+int QuantizeSysMatrix2D(
+    struct SysMatrix2D *A,
+    int ValueType)
+{
+    float *Value;
+    int i;
+    double SumSq, SumSqErr, MaxRelErr;
+
+    if (A->ValueType != SYSMATRIX2D_VALUE_FLOAT || A->MapAddr != NULL)
+    {
+        fprintf(stderr, "ERROR in QuantizeSysMatrix2D: matrix must hold float values in memory.\n");
+        return 1;
+    }
+    if (ValueType != SYSMATRIX2D_VALUE_UINT16 && ValueType != SYSMATRIX2D_VALUE_UINT8)
+    {
+        fprintf(stderr, "ERROR in QuantizeSysMatrix2D: unknown value type %d.\n", ValueType);
+        return 1;
+    }
+
+    Value = A->Value;
+    A->ValueType = ValueType;
+    A->Value = NULL;
+    A->Value16 = (ValueType == SYSMATRIX2D_VALUE_UINT16) ? (unsigned short *)get_aligned_spc(A->Nnonzero, sizeof(unsigned short)) : NULL;
+    A->Value8 = (ValueType == SYSMATRIX2D_VALUE_UINT8) ? (unsigned char *)get_aligned_spc(A->Nnonzero, sizeof(unsigned char)) : NULL;
+    A->Scale = (float *)get_spc(A->Nstored, sizeof(float));
+
+    SumSq = SumSqErr = MaxRelErr = 0.0;
+    #pragma omp parallel for schedule(dynamic, 256) reduction(+:SumSq, SumSqErr) reduction(max:MaxRelErr)
+    for (i = 0; i < A->Nstored; i++)
+    {
+        long n = A->ColumnOffset[i];
+
+        A->Scale[i] = QuantizeSysMatrix2DColumn(Value + n, A->ColumnOffset[i+1] - n, ValueType,
+            (A->Value16 != NULL) ? A->Value16 + n : NULL, (A->Value8 != NULL) ? A->Value8 + n : NULL,
+            &SumSq, &SumSqErr, &MaxRelErr);
+    }
+    free((void *)Value);
+    SetSysMatrix2DColumns(A);
+
+    PrintSysMatrix2DQuantization(A, SumSq, SumSqErr, MaxRelErr);
+    return 0;
+}
+
+/* Streaming writer: the columns of a matrix are written one by one in order, and nothing but */
+/* the offset and scale tables (and the symmetry tables of A) is held in memory. The total number */
+/* of runs is only known at the end, so the Run section is given room for one run per view of each */
+/* column, which the columns computed for parallel-beam geometries never exceed, and the values are */
+/* written at their final position right after it through a second stream on the file. Room left */
+/* unused by the runs is never written, so it takes no disk space on file systems with sparse files */
+
+#define SYSMATRIX2D_WRITE_BUFFER (4*1048576)   /* Size of the stdio buffers (bytes) */
+
+struct SysMatrix2DWriter
+{
+    struct SysMatrix2D *A;  /* Layout of the matrix; Nnonzero and Nrun count the columns written so far */
+    FILE *fp;               /* Destination file, at the end of the runs written so far */
+    FILE *ValueFp;          /* Destination file, at the end of the values written so far */
+    char fname[1024];       /* <fname>.2Dsysmatrix */
+    long *ColumnOffset;
+    long *RunOffset;
+    float *Scale;           /* Quantization step of each column, NULL for float values */
+    unsigned short *Value16;    /* Scratch for quantizing a column */
+    unsigned char *Value8;
+    int Nwritten;           /* Number of columns written */
+    int Failed;             /* Set if a column couldn't be written */
+    long RunCapacity;       /* Number of runs the Run section has room for */
+    double SumSq, SumSqErr, MaxRelErr;  /* Quantization error */
+};
+
+struct SysMatrix2DWriter *OpenSysMatrix2DWriter(
+    char *fname,
+    struct SysMatrix2D *A)
+{
+    struct SysMatrix2DWriter *w;
+    struct SysMatrix2DHeader header;
+
+    w = (struct SysMatrix2DWriter *)get_spc(1, sizeof(struct SysMatrix2DWriter));
+    w->A = A;
+    snprintf(w->fname, sizeof(w->fname), "%s.2Dsysmatrix", fname); /* append file extension */
+    if ((w->fp = fopen(w->fname, "w")) == NULL)
+    {
+        fprintf(stderr, "ERROR in OpenSysMatrix2DWriter: can't open file %s.\n", w->fname);
+        exit(-1);
+    }
+    if ((w->ValueFp = fopen(w->fname, "r+")) == NULL)
+    {
+        fprintf(stderr, "ERROR in OpenSysMatrix2DWriter: can't open file %s.\n", w->fname);
+        fclose(w->fp);
+        remove(w->fname);
+        exit(-1);
+    }
+    setvbuf(w->fp, NULL, _IOFBF, SYSMATRIX2D_WRITE_BUFFER);
+    setvbuf(w->ValueFp, NULL, _IOFBF, SYSMATRIX2D_WRITE_BUFFER);
+
+    A->Nnonzero = 0;
+    A->Nrun = 0;
+    w->RunCapacity = (long)A->Nstored*A->params.NViews;
+    SetSysMatrix2DHeader(&header, A, w->RunCapacity);
+    fseek(w->fp, header.RunPos, SEEK_SET);
+    fseek(w->ValueFp, header.ValuePos, SEEK_SET);
+
+    w->ColumnOffset = (long *)get_spc(A->Nstored+1, sizeof(long));
+    w->RunOffset = (long *)get_spc(A->Nstored+1, sizeof(long));
+    w->Scale = NULL;
+    if (A->ValueType != SYSMATRIX2D_VALUE_FLOAT)
+    {
+        w->Scale = (float *)get_spc(A->Nstored, sizeof(float));
+        w->Value16 = (unsigned short *)get_spc(A->MaxColumnNnonzero, sizeof(unsigned short));
+        w->Value8 = (unsigned char *)get_spc(A->MaxColumnNnonzero, sizeof(unsigned char));
+    }
+    return w;
+}
+
+int WriteSysMatrix2DColumn(
+    struct SysMatrix2DWriter *w,
+    struct SparseColumn *column)
+{
+    struct SysMatrix2D *A = w->A;
+    long N = column->Nnonzero;
+    int ok;
+
+    if (w->Nwritten >= A->Nstored || N > A->MaxColumnNnonzero || A->Nrun + column->Nrun > w->RunCapacity)
+    {
+        fprintf(stderr, "ERROR in WriteSysMatrix2DColumn: column %d doesn't fit the matrix.\n", w->Nwritten);
+        w->Failed = 1;
+        return 1;
+    }
+    ok = (fwrite(column->Run, sizeof(struct SparseRun), column->Nrun, w->fp) == column->Nrun);
+    if (A->ValueType == SYSMATRIX2D_VALUE_FLOAT)
+        ok = ok && (fwrite(column->Value, sizeof(float), N, w->ValueFp) == N);
+    else
+    {
+        w->Scale[w->Nwritten] = QuantizeSysMatrix2DColumn(column->Value, N, A->ValueType, w->Value16, w->Value8,
+            &w->SumSq, &w->SumSqErr, &w->MaxRelErr);
+        if (A->ValueType == SYSMATRIX2D_VALUE_UINT16)
+            ok = ok && (fwrite(w->Value16, sizeof(unsigned short), N, w->ValueFp) == N);
+        else
+            ok = ok && (fwrite(w->Value8, sizeof(unsigned char), N, w->ValueFp) == N);
+    }
+    A->Nnonzero += N;
+    A->Nrun += column->Nrun;
+    w->Nwritten++;
+    w->ColumnOffset[w->Nwritten] = A->Nnonzero;
+    w->RunOffset[w->Nwritten] = A->Nrun;
+    if (!ok)
+    {
+        fprintf(stderr, "ERROR in WriteSysMatrix2DColumn: write to file %s terminated early.\n", w->fname);
+        w->Failed = 1;
+        return 1;
+    }
+    return 0;
+}
+
+/* The file is removed if it couldn't be completed */
+int CloseSysMatrix2DWriter(struct SysMatrix2DWriter *w)
+{
+    struct SysMatrix2D *A = w->A;
+    struct SysMatrix2DHeader header;
+    int ok;
+
+    ok = (w->Nwritten == A->Nstored) && !w->Failed;
+    if (w->Nwritten != A->Nstored)
+        fprintf(stderr, "ERROR in CloseSysMatrix2DWriter: %d of %d columns written to %s.\n", w->Nwritten, A->Nstored, w->fname);
+    SetSysMatrix2DHeader(&header, A, w->RunCapacity);
+
+    /* The values end the part of the file written so far */
+    ok = ok && (ftell(w->ValueFp) == header.ValuePos + A->Nnonzero*SysMatrix2DValueSize(A->ValueType));
+    ok = (fclose(w->ValueFp) == 0) && ok;
+    ok = ok && (fseek(w->fp, 0, SEEK_END) == 0);
+
+    if (A->ValueType != SYSMATRIX2D_VALUE_FLOAT)
+    {
+        PadSysMatrix2DFile(w->fp, header.ScalePos);
+        ok = ok && (fwrite(w->Scale, sizeof(float), A->Nstored, w->fp) == A->Nstored);
+    }
+    ok = ok && WriteSysMatrix2DSymmetries(w->fp, &header, A);
+
+    /* Header and offset tables go in front */
+    ok = ok && (fseek(w->fp, 0, SEEK_SET) == 0);
+    ok = ok && (fwrite(&header, sizeof(struct SysMatrix2DHeader), 1, w->fp) == 1);
+    PadSysMatrix2DFile(w->fp, header.ColumnOffsetPos);
+    ok = ok && (fwrite(w->ColumnOffset, sizeof(long), A->Nstored+1, w->fp) == A->Nstored+1);
+    PadSysMatrix2DFile(w->fp, header.RunOffsetPos);
+    ok = ok && (fwrite(w->RunOffset, sizeof(long), A->Nstored+1, w->fp) == A->Nstored+1);
+
+    if (fclose(w->fp) != 0 || !ok)
+    {
+        fprintf(stderr, "ERROR in CloseSysMatrix2DWriter: write to file %s terminated early.\n", w->fname);
+        remove(w->fname);
+        ok = 0;
+    }
+    else if (A->ValueType != SYSMATRIX2D_VALUE_FLOAT)
+        PrintSysMatrix2DQuantization(A, w->SumSq, w->SumSqErr, w->MaxRelErr);
+
+    free((void *)w->ColumnOffset);
+    free((void *)w->RunOffset);
+    free((void *)w->Scale);
+    free((void *)w->Value16);
+    free((void *)w->Value8);
+    free((void *)w);
+    return ok ? 0 : 1;
+}
+
+/* Remap a stored column with symmetry op into dst, i.e. move each view and reverse its channels */
+/* as given by A->SymView. Runs keep their order, so the views of dst are not sorted */
+static void RemapSysMatrix2DColumn(
+    struct SysMatrix2D *A,
+    struct SparseColumn *src,
+    int op,
+    struct SparseColumn *dst)
+{
+    int *ViewMap = A->SymView + op*A->params.NViews;
+    int r, n, m, v, len;
+
+    for (r = 0, m = 0; r < src->Nrun; r++, m += len)
+    {
+        len = src->Run[r].Length;
+        v = ViewMap[src->Run[r].View];
+        dst->Run[r].Length = len;
+        if (v >= 0)
+        {
+            dst->Run[r].View = v;
+            dst->Run[r].FirstChannel = src->Run[r].FirstChannel;
+            if (A->ValueType == SYSMATRIX2D_VALUE_UINT8)
+                memcpy(dst->Value8 + m, src->Value8 + m, len*sizeof(unsigned char));
+            else if (A->ValueType == SYSMATRIX2D_VALUE_UINT16)
+                memcpy(dst->Value16 + m, src->Value16 + m, len*sizeof(unsigned short));
+            else
+                memcpy(dst->Value + m, src->Value + m, len*sizeof(float));
+        }
+        else
+        {
+            dst->Run[r].View = -1-v;
+            dst->Run[r].FirstChannel = A->params.NChannels - src->Run[r].FirstChannel - len;
+            for (n = 0; n < len; n++)
+            {
+                if (A->ValueType == SYSMATRIX2D_VALUE_UINT8)
+                    dst->Value8[m+n] = src->Value8[m+len-1-n];
+                else if (A->ValueType == SYSMATRIX2D_VALUE_UINT16)
+                    dst->Value16[m+n] = src->Value16[m+len-1-n];
+                else
+                    dst->Value[m+n] = src->Value[m+len-1-n];
+            }
+        }
+    }
+    dst->Nrun = src->Nrun;
+    dst->Nnonzero = src->Nnonzero;
+    dst->Scale = src->Scale;
+}
+
+/* Copy a column with float values into dst */
+static void CopySysMatrix2DColumn(struct SparseColumn *src, struct SparseColumn *dst)
+{
+    memcpy(dst->Run, src->Run, src->Nrun*sizeof(struct SparseRun));
+    memcpy(dst->Value, src->Value, src->Nnonzero*sizeof(float));
+    dst->Nrun = src->Nrun;
+    dst->Nnonzero = src->Nnonzero;
+    dst->Scale = src->Scale;
+}
+
+/* Utility for accessing column i of the Sparse System Matrix */
+/* For a stored matrix this is the stored column, remapped into Scratch if the matrix uses symmetries. */
+/* In the matrix-free mode the column is computed into Scratch, unless slot i%NCacheColumns of the */
+/* column cache holds it. Each slot has its own lock, so threads with their own Scratch only wait for */
+/* each other on the same slot, and a slot another thread is using is not refilled */
+struct SparseColumn *GetSysMatrixColumn(
+    struct SysMatrix2D *A,
+    int i,
+    struct SparseColumn *Scratch)
+{
+    int s = 0, hit = 0;
+
+    if (A->ComputeColumn == NULL)
+    {
+        if (A->SymColumn == NULL)
+            return &A->column[i];
+        if (A->SymOp[i] == SYSMATRIX2D_SYM_IDENTITY)
+            return &A->column[A->SymColumn[i]];
+        RemapSysMatrix2DColumn(A, &A->column[A->SymColumn[i]], A->SymOp[i], Scratch);
+        return Scratch;
+    }
+
+    if (A->NCacheColumns > 0)
+    {
+        s = i % A->NCacheColumns;
+        omp_set_lock(&A->CacheLock[s]);
+        hit = (A->CacheTag[s] == i);
+        if (hit)
+            CopySysMatrix2DColumn(&A->CacheColumn[s], Scratch);
+        omp_unset_lock(&A->CacheLock[s]);
+        if (hit)
+            return Scratch;
+    }
+
+    A->ComputeColumn(i, A->ColumnContext, Scratch);
+
+    if (A->NCacheColumns > 0 && omp_test_lock(&A->CacheLock[s]))
+    {
+        CopySysMatrix2DColumn(Scratch, &A->CacheColumn[s]);
+        A->CacheTag[s] = i;
+        omp_unset_lock(&A->CacheLock[s]);
+    }
+    return Scratch;
+}
+
+/* Utility for allocating a scratch column large enough for any computed column of A */
+/* Nothing is allocated for a stored matrix without symmetries */
+void AllocateSysMatrix2DColumn(struct SysMatrix2D *A, struct SparseColumn *column)
+{
+    memset(column, 0, sizeof(struct SparseColumn));
+    column->Scale = 1.0;
+    if (A->ComputeColumn != NULL || A->SymColumn != NULL)
+    {
+        /* A column has at most one run per entry */
+        column->Run = (struct SparseRun *)get_spc(A->MaxColumnNnonzero, sizeof(struct SparseRun));
+        if (A->ComputeColumn != NULL || A->ValueType == SYSMATRIX2D_VALUE_FLOAT)
+            column->Value = (float *)get_spc(A->MaxColumnNnonzero, sizeof(float));
+        else if (A->ValueType == SYSMATRIX2D_VALUE_UINT16)
+            column->Value16 = (unsigned short *)get_spc(A->MaxColumnNnonzero, sizeof(unsigned short));
+        else
+            column->Value8 = (unsigned char *)get_spc(A->MaxColumnNnonzero, sizeof(unsigned char));
+    }
+}
+
+/* Utility for freeing a column allocated by AllocateSysMatrix2DColumn */
+void FreeSysMatrix2DColumn(struct SparseColumn *column)
+{
+    free((void *)column->Run);
+    free((void *)column->Value);
+    free((void *)column->Value16);
+    free((void *)column->Value8);
+}
+
+/* Utility for allocating the column cache of a matrix-free Sparse System Matrix */
+/* A->Ncolumns, A->ComputeColumn and A->MaxColumnNnonzero must be set before use */
+void AllocateSysMatrix2DCache(struct SysMatrix2D *A, int NCacheColumns)
+{
+    int s;
+
+    A->NCacheColumns = (NCacheColumns > A->Ncolumns) ? A->Ncolumns : NCacheColumns;
+    A->CacheTag = NULL;
+    A->CacheLock = NULL;
+    A->CacheColumn = NULL;
+    if (A->NCacheColumns <= 0)
+    {
+        A->NCacheColumns = 0;
+        return;
+    }
+
+    A->CacheTag = (int *)get_spc(A->NCacheColumns, sizeof(int));
+    A->CacheLock = (omp_lock_t *)get_spc(A->NCacheColumns, sizeof(omp_lock_t));
+    A->CacheColumn = (struct SparseColumn *)get_spc(A->NCacheColumns, sizeof(struct SparseColumn));
+    for (s = 0; s < A->NCacheColumns; s++)
+    {
+        A->CacheTag[s] = -1;
+        omp_init_lock(&A->CacheLock[s]);
+        AllocateSysMatrix2DColumn(A, &A->CacheColumn[s]);
+    }
+}
+
+/* Utility for freeing memory from Sparse System Matrix */
+/* Returns 0 if no error occurs */
+int FreeSysMatrix2D(struct SysMatrix2D *A)
+{
+    int s;
+
+    if (A->ComputeColumn != NULL)
+    {
+        for (s = 0; s < A->NCacheColumns; s++)
+        {
+            omp_destroy_lock(&A->CacheLock[s]);
+            FreeSysMatrix2DColumn(&A->CacheColumn[s]);
+        }
+        free((void *)A->CacheTag);
+        free((void *)A->CacheLock);
+        free((void *)A->CacheColumn);
+        A->NCacheColumns = 0;
+        return 0;
+    }
+
+    free((void *)A->column);
+    if (A->MapAddr != NULL)
+    {
+        munmap(A->MapAddr, A->MapLength);
+        A->MapAddr = NULL;
+    }
+    else
+    {
+        free((void *)A->ColumnOffset);
+        free((void *)A->RunOffset);
+        free((void *)A->Run);
+        free((void *)A->Value);
+        free((void *)A->Value16);
+        free((void *)A->Value8);
+        free((void *)A->Scale);
+        free((void *)A->SymColumn);
+        free((void *)A->SymOp);
+        free((void *)A->SymView);
+    }
+    return 0;
+}
+
+
+
+/************************************************************/
 /*     Strictly 2D sinogram/image memory allocation     */
 /************************************************************/
 
@@ -1001,6 +2505,24 @@ int NumSinoSliceDigits(char *basename, int slice)
 }
 
 
+/* 64-bit FNV-1a hash of a block of memory */
+/* Pass 0 as the seed for a new hash, or a previous result to hash several blocks in a row */
+unsigned long HashBytes(const void *data, size_t nbytes, unsigned long seed)
+{
+    const unsigned char *p = (const unsigned char *)data;
+    unsigned long h;
+    size_t i;
+
+    h = (seed == 0) ? 14695981039346656037UL : seed;
+    for (i = 0; i < nbytes; i++)
+    {
+        h ^= p[i];
+        h *= 1099511628211UL;
+    }
+    return(h);
+}
+
+
 /* Compute sinogram weights */
 void ComputeSinoWeights(
 	struct Sino3DParallel sinogram,
@@ -57,6 +57,8 @@ int WriteFloatArray(
 /**********************************************/
 
 /* Utilities for reading 3D parallel beam projections and weights */
+/* If <basename>.3Dsinodata (.3Dweightdata) exists, the slices are mapped from that single-file */
+/* volume instead of read from the per-slice files; the slice pointers then point into the mapping */
 /* Warning: Memory must be allocated before use */
 /* Returns 0 if no error occurs */
 int ReadSinoData3DParallel(
@@ -81,6 +83,20 @@ int WriteWeights3D(
 /* Returns 0 if no error occurs */
 int AllocateSinoData3DParallel(struct Sino3DParallel *sinogram);
 
+/* Utility that allocates memory for the sinogram and for weights that are all the same value weight: */
+/* the weight pointers of all slices point to a single slice of that value, instead of being read */
+/* with ReadWeights3D */
+/* Returns 0 if no error occurs */
+int AllocateSinoScalarWeights3DParallel(struct Sino3DParallel *sinogram, float weight);
+
+/* Utility that checks whether the weights of the slices of sinoparams are all the same value, reading */
+/* them a slice at a time (see ReadWeights3D) */
+/* Returns 1 and sets *weight to that value if they are, else 0 */
+int UniformWeights3D(
+	char *basename,		/* Source base filename, i.e. <basename>_slice<Index>.2Dweightdata for given index range */
+	struct SinoParams3DParallel *sinoparams,
+	float *weight);
+
 /* Utility for freeing memory allocated for sinogram, weights and ViewAngles */
 /* Returns 0 if no error occurs */
 int FreeSinoData3DParallel(struct Sino3DParallel *sinogram);
@@ -91,6 +107,7 @@ int FreeSinoData3DParallel(struct Sino3DParallel *sinogram);
 /******************************************/
 
 /* Utility for reading 3D image data */
+/* If <basename>.3Dimgdata exists, the slices are mapped from that single-file volume */
 /* Warning: Memory must be allocated before use */
 /* Returns 0 if no error occurs */
 int ReadImage3D(
@@ -103,6 +120,29 @@ int WriteImage3D(
 	char *basename,		/* Destination base filename, i.e. <basename>_slice<Index>.2Dimgdata for given index range */ 
 	struct Image3D *Image);  /* Image data+params data structure */
 
+/* Utility for writing 3D image data to the single-file volume <basename>.3Dimgdata */
+/* Returns 0 if no error occurs */
+int WriteImageVolume3D(
+	char *basename,		/* Destination base filename, i.e. <basename>.3Dimgdata */
+	struct Image3D *Image);  /* Image data+params data structure */
+
+/* Utility for creating the single-file volume <basename>.3Dimgdata of the slices of imgparams, all zero, */
+/* to be filled by WriteImageVolumeSlices3D */
+/* Returns 0 if no error occurs */
+int CreateImageVolume3D(
+	char *basename,		/* Destination base filename, i.e. <basename>.3Dimgdata */
+	struct ImageParams3D *imgparams);  /* Image params of the volume */
+
+/* Utility for writing 3D image data into the existing volume <basename>.3Dimgdata, at the positions of */
+/* its slices, e.g. a slab of the volume */
+/* Returns 0 if no error occurs */
+int WriteImageVolumeSlices3D(
+	char *basename,		/* Destination base filename, i.e. <basename>.3Dimgdata */
+	struct Image3D *Image);  /* Image data+params data structure */
+
+/* Whether the single-file volume <basename>.<extension> exists, e.g. for extension "3Dsinodata" */
+int IsVolume3D(char *basename, char *extension);
+
 /* Utility for allocating memory for a 3D Image */
 /* Returns 0 if no error occurs */
 int AllocateImageData3D(struct Image3D *Image);
@@ -117,18 +157,116 @@ int FreeImageData3D(struct Image3D *Image);
 /*********************************************************/
 
 /* Utility for reading/allocating the Sparse System Matrix */
+/* Version 3 and up files are memory mapped read-only; version 2 and legacy (headerless) files are */
+/* converted to runs in memory */
+/* A->Ncolumns and A->params (see SetSysMatrixParams2D) must be set before use; */
+/* on return A->params holds the parameters stored in the file, if any */
 /* Returns 0 if no error occurs */
 /* Warning: Memory is allocated for the data structure inside subroutine */
 int ReadSysMatrix2D(
 	char *fname,		/* Source base filename, i.e. <fname>.2dsysmatrix */
 	struct SysMatrix2D *A);	/* Sparse system matrix structure */
 
-/* Utility for writing the Sparse System Matrix */
+/* Memory (bytes) that ReadSysMatrix2D takes for <fname>.2Dsysmatrix, from the header of the file without */
+/* reading the matrix: the size of the mapping and of the column table for version 3 and up files, */
+/* and the peak of converting older ones into heap arenas */
+long SysMatrix2DFootprint(
+	char *fname,	/* Source base filename, i.e. <fname>.2dsysmatrix */
+	int Ncolumns,	/* Number of columns and views, for legacy files, which don't record them */
+	int NViews);
+
+/* Utility for writing the Sparse System Matrix in the version 5 format */
+/* The symmetry tables are written if A->SymColumn is set */
 /* Returns 0 if no error occurs */
 int WriteSysMatrix2D(
 	char *fname,		/* Destination base filename, i.e. <fname>.2dsysmatrix */
 	struct SysMatrix2D *A);	/* Sparse system matrix structure */
 
+/* Utility for allocating the arena of the Sparse System Matrix */
+/* A->Ncolumns, A->Nstored, A->Nnonzero, A->Nrun and A->ValueType must be set before use */
+/* The matrix is set up without symmetries */
+/* Returns 0 if no error occurs */
+int AllocateSysMatrix2D(struct SysMatrix2D *A);
+
+/* Utility for pointing each column of the Sparse System Matrix into the arena */
+/* A->ColumnOffset and A->RunOffset must be filled in before use; also sets A->MaxColumnNnonzero */
+void SetSysMatrix2DColumns(struct SysMatrix2D *A);
+
+/* Utility for filling in the geometry parameters stored with a Sparse System Matrix */
+/* LenPix and LenDet depend on the projector and are left to the caller */
+void SetSysMatrixParams2D(
+	struct SysMatrixParams2D *params,	/* Destination */
+	struct SinoParams3DParallel *sinoparams,
+	struct ImageParams3D *imgparams);
+
+/* Utility for checking that the geometry of a Sparse System Matrix read from file fname matches */
+/* the expected one (projector parameters are not compared). Prints the fields that differ */
+/* Returns the number of fields that differ */
+int CompareSysMatrixParams2D(
+	struct SysMatrixParams2D *expected,
+	struct SysMatrixParams2D *params,
+	char *fname);
+
+/* Utility for hashing all fields of the System Matrix parameters, e.g. to key a cache of matrices */
+unsigned long HashSysMatrixParams2D(struct SysMatrixParams2D *params);
+
+/* Utility for run-length encoding the (increasing) row indices of a sparse column */
+/* Run must have room for Nnonzero runs. Returns the number of runs, or -1 if a row index */
+/* is out of range for NViews*NChannels rows or doesn't fit a SparseRun */
+int EncodeSparseRuns(
+	int *RowIndex,		/* Row indices of the nonzero entries */
+	int Nnonzero,		/* Number of nonzero entries */
+	int NViews,
+	int NChannels,
+	struct SparseRun *Run);	/* Destination */
+
+/* Utility for quantizing the values of a Sparse System Matrix to 16 or 8 bit integers */
+/* Each column gets its own scale, so the largest entry of the column maps to the largest integer */
+/* Prints the error of the quantized matrix relative to the float matrix */
+/* A must hold float values in memory (not mapped from a file) */
+/* Returns 0 if no error occurs */
+int QuantizeSysMatrix2D(
+	struct SysMatrix2D *A,	/* Sparse system matrix structure */
+	int ValueType);		/* SYSMATRIX2D_VALUE_UINT16 or SYSMATRIX2D_VALUE_UINT8 */
+
+/* Utilities for writing a Sparse System Matrix column by column in the version 5 format, without */
+/* holding the matrix in memory. A describes the matrix: A->Ncolumns, A->Nstored, A->params, */
+/* A->ValueType, A->MaxColumnNnonzero and the symmetry tables (or NULL) must be set; A->Nnonzero */
+/* and A->Nrun are counted by the writer. Columns are passed with float values in stored order, and */
+/* quantized to A->ValueType on the fly. The file is <fname>.2Dsysmatrix; fname is not changed */
+/* Open exits if the file can't be created; the others return 0 if no error occurs, and Close */
+/* removes the file if it couldn't be completed */
+struct SysMatrix2DWriter;
+struct SysMatrix2DWriter *OpenSysMatrix2DWriter(
+	char *fname,		/* Destination base filename, i.e. <fname>.2dsysmatrix */
+	struct SysMatrix2D *A);	/* Layout of the matrix; must stay valid until the writer is closed */
+int WriteSysMatrix2DColumn(
+	struct SysMatrix2DWriter *w,
+	struct SparseColumn *column);
+int CloseSysMatrix2DWriter(struct SysMatrix2DWriter *w);
+
+/* Utility for accessing column i of the Sparse System Matrix */
+/* For a stored matrix this is the stored column, remapped into Scratch if the matrix uses pixel-grid */
+/* symmetries (see A->SymColumn). In the matrix-free mode the column is copied from the column cache */
+/* into Scratch, or computed into Scratch on a cache miss. Scratch comes from AllocateSysMatrix2DColumn */
+/* The returned column is valid until the next call with the same Scratch. Threads may call this */
+/* concurrently, each with its own Scratch */
+struct SparseColumn *GetSysMatrixColumn(
+	struct SysMatrix2D *A,	/* Sparse system matrix structure */
+	int i,			/* Column index */
+	struct SparseColumn *Scratch);
+
+/* Utility for allocating a scratch column large enough for any computed or remapped column of A */
+/* Nothing is allocated for a stored matrix without symmetries */
+void AllocateSysMatrix2DColumn(struct SysMatrix2D *A, struct SparseColumn *column);
+
+/* Utility for freeing a column allocated by AllocateSysMatrix2DColumn */
+void FreeSysMatrix2DColumn(struct SparseColumn *column);
+
+/* Utility for allocating the column cache of a matrix-free Sparse System Matrix */
+/* A->Ncolumns, A->ComputeColumn and A->MaxColumnNnonzero must be set before use */
+void AllocateSysMatrix2DCache(struct SysMatrix2D *A, int NCacheColumns);
+
 /* Utility for freeing memory from Sparse System Matrix */
 /* Returns 0 if no error occurs */
 int FreeSysMatrix2D(struct SysMatrix2D *A);
@@ -168,6 +306,10 @@ int FreeImageData2D(
 /* Returns number of digits, or 0 if no readable files found */
 int NumSinoSliceDigits(char *basename, int slice);
 
+/* 64-bit FNV-1a hash of a block of memory */
+/* Pass 0 as the seed for a new hash, or a previous result to hash several blocks in a row */
+unsigned long HashBytes(const void *data, size_t nbytes, unsigned long seed);
+
 /* Compute sinogram weights */
 void ComputeSinoWeights(struct Sino3DParallel sinogram, struct ReconParams reconparams);
 
@@ -29,6 +29,26 @@ void *mget_spc(int num,size_t size)
 	return(pt);
 }
 
+/* Allocates num*size bytes aligned to ALLOC_ALIGNMENT, for large arrays */
+/* that are streamed through. Memory is not cleared. Release with free() */
+void *get_aligned_spc(size_t num, size_t size)
+{
+	void *pt;
+	size_t nbytes;
+
+	nbytes = num*size;
+	nbytes = (nbytes + ALLOC_ALIGNMENT - 1)/ALLOC_ALIGNMENT*ALLOC_ALIGNMENT;
+	if (nbytes == 0)
+		nbytes = ALLOC_ALIGNMENT;
+
+	if ((pt = aligned_alloc(ALLOC_ALIGNMENT, nbytes)) == NULL)
+	{
+		fprintf(stderr, "==> aligned_alloc() error\n");
+		exit(-1);
+	}
+	return(pt);
+}
+
 
 void **get_img(int wd,int ht,size_t size)
 {
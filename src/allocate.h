@@ -3,8 +3,11 @@
 
 #include <stdlib.h>
 
+#define ALLOC_ALIGNMENT 64  /* byte alignment of get_aligned_spc blocks (cache line) */
+
 void *get_spc(int num, size_t size);
 void *mget_spc(int num, size_t size);
+void *get_aligned_spc(size_t num, size_t size);
 void **get_img(int wd,int ht, size_t size);
 void ***get_3D(int N, int M, int A, size_t size);
 void free_img(void **pt);
@@ -0,0 +1,262 @@
+#define _DEFAULT_SOURCE  /* for MAP_ANONYMOUS, nanosleep */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <signal.h>  /* for siginfo_t */
+#ifdef MBIR_MPI
+#include <mpi.h>
+#endif
+
+#include "allocate.h"
+#include "comm_3D.h"
+
+/* Memory shared by local processes: the barrier, then SLABCOMM_MAX_VALUES partial sums of each */
+/* process, then the two edge slices of each process */
+struct SlabCommShared3D
+{
+    atomic_int Count;       /* Processes waiting at the barrier */
+    atomic_int Generation;  /* Number of barriers passed */
+    atomic_int Abort;       /* Set by a process that exits before the end */
+};
+
+#define SLABCOMM_HEADER_SIZE 64 /* Room for struct SlabCommShared3D, keeping the arrays after it aligned */
+
+#define SLABCOMM_MPI_RUNTIME_BYTES (12L*1024*1024) /* Peak memory added by Open MPI on a single node, rounded up */
+
+#ifndef MBIR_MPI
+static double *SlabCommValues3D(struct SlabComm3D *comm, int Rank);
+static float *SlabCommEdge3D(struct SlabComm3D *comm, int Rank, int Top);
+static void SlabCommAtExit3D(void);
+
+/* Set for the atexit handler, which tells the other processes if this one exits before the end */
+static struct SlabCommShared3D *ExitShared = NULL;
+static pid_t ParentPid;
+#endif
+
+
+void SlabCommInit3D(struct SlabComm3D *comm, int *argc, char ***argv)
+{
+    comm->Rank = 0;
+    comm->NRanks = 1;
+    comm->Nxy = 0;
+    comm->Shared = NULL;
+    comm->SharedLength = 0;
+    comm->Child = NULL;
+#ifdef MBIR_MPI
+    MPI_Init(argc, argv);
+    MPI_Comm_rank(MPI_COMM_WORLD, &comm->Rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &comm->NRanks);
+    if (comm->Rank != 0 && freopen("/dev/null", "w", stdout) == NULL)
+        fprintf(stderr, "Warning : rank %d can't redirect stdout\n", comm->Rank);
+#endif
+}
+
+void SlabCommStart3D(struct SlabComm3D *comm, int NProcesses, int Nxy)
+{
+#ifdef MBIR_MPI
+    comm->Nxy = Nxy;
+    if (NProcesses > 1)
+    {
+        fprintf(stderr, "Error : option -n doesn't apply to MPI; the processes are those started by mpirun\n");
+        exit(-1);
+    }
+#else
+    pid_t pid;
+    int k;
+
+    comm->Nxy = Nxy;
+    if (NProcesses <= 1)
+        return;
+
+    comm->SharedLength = SLABCOMM_HEADER_SIZE + (size_t)NProcesses*SLABCOMM_MAX_VALUES*sizeof(double)
+                       + (size_t)NProcesses*2*Nxy*sizeof(float);
+    comm->Shared = mmap(NULL, comm->SharedLength, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (comm->Shared == MAP_FAILED)
+    {
+        fprintf(stderr, "Error : can't allocate memory shared by %d processes\n", NProcesses);
+        exit(-1);
+    }
+    ExitShared = (struct SlabCommShared3D *)comm->Shared;
+    atomic_init(&ExitShared->Count, 0);
+    atomic_init(&ExitShared->Generation, 0);
+    atomic_init(&ExitShared->Abort, 0);
+    ParentPid = getpid();
+    atexit(SlabCommAtExit3D);
+
+    comm->NRanks = NProcesses;
+    comm->Child = (int *)get_spc(NProcesses, sizeof(int));
+    fflush(stdout);
+    fflush(stderr);
+    for (k = 1; k < NProcesses; k++)
+    {
+        if ((pid = fork()) < 0)
+        {
+            fprintf(stderr, "Error : can't start process %d of %d\n", k, NProcesses);
+            exit(-1);
+        }
+        if (pid == 0)
+        {
+            comm->Rank = k;
+            free((void *)comm->Child);
+            comm->Child = NULL;
+            if (freopen("/dev/null", "w", stdout) == NULL)
+                fprintf(stderr, "Warning : process %d can't redirect stdout\n", k);
+            return;
+        }
+        comm->Child[k] = pid;
+    }
+#endif
+}
+
+#ifndef MBIR_MPI
+static double *SlabCommValues3D(struct SlabComm3D *comm, int Rank)
+{
+    return (double *)((char *)comm->Shared + SLABCOMM_HEADER_SIZE) + (long)Rank*SLABCOMM_MAX_VALUES;
+}
+
+/* Top: the last slice of the slab, else its first slice */
+static float *SlabCommEdge3D(struct SlabComm3D *comm, int Rank, int Top)
+{
+    float *edges = (float *)(SlabCommValues3D(comm, comm->NRanks));
+    return edges + ((long)Rank*2 + Top)*comm->Nxy;
+}
+
+static void SlabCommAtExit3D(void)
+{
+    if (ExitShared != NULL)
+        atomic_store(&ExitShared->Abort, 1);
+}
+#endif
+
+/* Spin (sleeping a little) until all processes are here; give up if one of them exited */
+void SlabCommBarrier3D(struct SlabComm3D *comm)
+{
+#ifdef MBIR_MPI
+    MPI_Barrier(MPI_COMM_WORLD);
+#else
+    struct SlabCommShared3D *shared = (struct SlabCommShared3D *)comm->Shared;
+    struct timespec pause = {0, 100000};
+    siginfo_t info;
+    int generation;
+
+    if (shared == NULL)
+        return;
+
+    generation = atomic_load(&shared->Generation);
+    if (atomic_fetch_add(&shared->Count, 1) == comm->NRanks-1)
+    {
+        atomic_store(&shared->Count, 0);
+        atomic_fetch_add(&shared->Generation, 1);
+        return;
+    }
+    while (atomic_load(&shared->Generation) == generation)
+    {
+        /* A process that exited (leaving it to be waited for) may have passed the last barrier */
+        info.si_pid = 0;
+        if ((atomic_load(&shared->Abort)
+            || (comm->Rank > 0 && getppid() != ParentPid)
+            || (comm->Rank == 0 && waitid(P_ALL, 0, &info, WEXITED | WNOHANG | WNOWAIT) == 0 && info.si_pid != 0))
+            && atomic_load(&shared->Generation) == generation)
+        {
+            fprintf(stderr, "Error : process %d stops, another process of the reconstruction exited\n", comm->Rank);
+            exit(-1);
+        }
+        nanosleep(&pause, NULL);
+    }
+#endif
+}
+
+void SlabCommExchange3D(struct SlabComm3D *comm, float **x, int Nz)
+{
+    int below, above;
+
+    below = (comm->Rank + comm->NRanks - 1)%comm->NRanks;
+    above = (comm->Rank + 1)%comm->NRanks;
+#ifdef MBIR_MPI
+    MPI_Sendrecv(x[Nz-1], comm->Nxy, MPI_FLOAT, above, 0, x[-1], comm->Nxy, MPI_FLOAT, below, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+    MPI_Sendrecv(x[0], comm->Nxy, MPI_FLOAT, below, 1, x[Nz], comm->Nxy, MPI_FLOAT, above, 1, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+#else
+    if (comm->Shared == NULL)
+    {
+        /* A single slab is its own neighbor */
+        memcpy(x[-1], x[Nz-1], comm->Nxy*sizeof(float));
+        memcpy(x[Nz], x[0], comm->Nxy*sizeof(float));
+        return;
+    }
+    memcpy(SlabCommEdge3D(comm, comm->Rank, 0), x[0], comm->Nxy*sizeof(float));
+    memcpy(SlabCommEdge3D(comm, comm->Rank, 1), x[Nz-1], comm->Nxy*sizeof(float));
+    SlabCommBarrier3D(comm);
+    memcpy(x[-1], SlabCommEdge3D(comm, below, 1), comm->Nxy*sizeof(float));
+    memcpy(x[Nz], SlabCommEdge3D(comm, above, 0), comm->Nxy*sizeof(float));
+    SlabCommBarrier3D(comm); /* before the edges are written again */
+#endif
+}
+
+/* The partial sums are added up in the order of the processes, so that all get the same sums */
+void SlabCommSum3D(struct SlabComm3D *comm, double *value, int n)
+{
+#ifdef MBIR_MPI
+    MPI_Allreduce(MPI_IN_PLACE, value, n, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
+#else
+    int i, k;
+
+    if (comm->Shared == NULL)
+        return;
+    for (i = 0; i < n; i++)
+        SlabCommValues3D(comm, comm->Rank)[i] = value[i];
+    SlabCommBarrier3D(comm);
+    for (i = 0; i < n; i++)
+    {
+        value[i] = 0;
+        for (k = 0; k < comm->NRanks; k++)
+            value[i] += SlabCommValues3D(comm, k)[i];
+    }
+    SlabCommBarrier3D(comm); /* before the partial sums are written again */
+#endif
+}
+
+long SlabCommRuntimeBytes3D(void)
+{
+#ifdef MBIR_MPI
+    return SLABCOMM_MPI_RUNTIME_BYTES;
+#else
+    return 0;
+#endif
+}
+
+void SlabCommFree3D(struct SlabComm3D *comm)
+{
+#ifdef MBIR_MPI
+    MPI_Finalize();
+#else
+    int k, status, failed;
+
+    if (comm->Shared == NULL)
+        return;
+
+    SlabCommBarrier3D(comm); /* all are done, so none exits early from here on */
+    ExitShared = NULL;
+    failed = 0;
+    if (comm->Rank == 0)
+    {
+        for (k = 1; k < comm->NRanks; k++)
+        if (waitpid(comm->Child[k], &status, 0) != comm->Child[k] || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+            failed = 1;
+        free((void *)comm->Child);
+    }
+    munmap(comm->Shared, comm->SharedLength);
+    comm->Shared = NULL;
+    if (failed)
+    {
+        fprintf(stderr, "Error : a process of the reconstruction failed\n");
+        exit(-1);
+    }
+#endif
+}
@@ -0,0 +1,34 @@
+#ifndef _COMM_3D_H_
+#define _COMM_3D_H_
+
+/* Processes that reconstruct a volume together, each one a slab of its slices, exchanging the */
+/* slices at the edges of their slabs. Built with MBIR_MPI, they are the ranks of MPI_COMM_WORLD; */
+/* otherwise they are processes on the local machine forked by SlabCommStart3D, sharing memory */
+struct SlabComm3D
+{
+    int Rank;       /* This process, from 0 to NRanks-1. Only rank 0 writes to stdout */
+    int NRanks;
+    int Nxy;        /* Size of the slices exchanged */
+    void *Shared;   /* Memory shared by local processes (NULL for a single process, or with MPI) */
+    size_t SharedLength;
+    int *Child;     /* Process IDs of the local processes started by rank 0 */
+};
+
+/* Before anything else: find this process among the MPI ranks, if any, else a single process */
+void SlabCommInit3D(struct SlabComm3D *comm, int *argc, char ***argv);
+/* Start NProcesses local processes (without MPI), which return from here as ranks 1 to NProcesses-1 */
+void SlabCommStart3D(struct SlabComm3D *comm, int NProcesses, int Nxy);
+/* Send the edge slices x[0] and x[Nz-1] of this slab to the neighboring slabs, wrapping around in z, */
+/* and receive theirs into the halo slices x[-1] and x[Nz] */
+void SlabCommExchange3D(struct SlabComm3D *comm, float **x, int Nz);
+/* Replace value[0] to value[n-1] with their sums over all processes (n <= SLABCOMM_MAX_VALUES), the same in all */
+#define SLABCOMM_MAX_VALUES 8
+void SlabCommSum3D(struct SlabComm3D *comm, double *value, int n);
+void SlabCommBarrier3D(struct SlabComm3D *comm);
+/* Memory (bytes) of the message passing library in each process, for the memory plan: an estimate */
+/* with MPI, 0 otherwise */
+long SlabCommRuntimeBytes3D(void);
+/* After the reconstruction: rank 0 waits for the local processes, and exits if one of them failed */
+void SlabCommFree3D(struct SlabComm3D *comm);
+
+#endif
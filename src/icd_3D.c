@@ -2,40 +2,193 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <math.h>
+#include <float.h>
 
 #include "MBIRModularDefs.h"
+#include "MBIRModularUtils.h"
 #include "icd_3D.h"
 
 
+/* Rows of e and w that the column of the voxel applies to: the voxel's slice, or the super-voxel */
+/* buffer if there is one. Entry (View, Channel) is at e_row[ViewOffset[View] + Channel] */
+static void SliceRows3D(
+    float **e,
+    float **w,
+    struct ICDInfo *icd_info,
+    int SliceIndex,
+    float **e_row,
+    float **w_row,
+    long **ViewOffset)
+{
+    if (icd_info->SV != NULL)
+    {
+        *e_row = icd_info->SV->e;
+        *w_row = icd_info->SV->w;
+        *ViewOffset = icd_info->SV->ViewOffset;
+    }
+    else
+    {
+        *e_row = e[SliceIndex];
+        *w_row = (w != NULL) ? w[SliceIndex] : NULL;
+        *ViewOffset = icd_info->ViewOffset;
+    }
+}
+
+
+/* theta1 = -sum A*w*e and theta2 = sum A^2*w over a column, in a row of e and w */
+/* Each run covers consecutive channels of one view, i.e. contiguous stretches of e and w */
+/* Quantized values are summed as integers and scaled once per run */
+static void ColumnThetas3D(
+    struct SparseColumn *A_column,
+    int ValueType,
+    long *ViewOffset,
+    float *e_row,
+    float *w_row,
+    float *theta1,
+    float *theta2)
+{
+    int m, n, r;
+    long i;
+    float sum1, sum2, *w_run, *e_run;
+
+    *theta1 = 0.0;
+    *theta2 = 0.0;
+    m = 0; /* Index of the first value of the run */
+    for (r = 0; r < A_column->Nrun; r++)
+    {
+        /* (View, Detector-Channel) index pertaining to same slice as voxel */
+        i = ViewOffset[A_column->Run[r].View] + A_column->Run[r].FirstChannel;
+        w_run = &w_row[i];
+        e_run = &e_row[i];
+        sum1 = 0.0;
+        sum2 = 0.0;
+        if (ValueType == SYSMATRIX2D_VALUE_UINT8)
+        {
+            unsigned char *A_run = A_column->Value8 + m;
+            #pragma omp simd reduction(+:sum1,sum2)
+            for (n = 0; n < A_column->Run[r].Length; n++)
+            {
+                sum1 += A_run[n]*w_run[n]*e_run[n];
+                sum2 += A_run[n]*w_run[n]*A_run[n];
+            }
+        }
+        else if (ValueType == SYSMATRIX2D_VALUE_UINT16)
+        {
+            unsigned short *A_run = A_column->Value16 + m;
+            #pragma omp simd reduction(+:sum1,sum2)
+            for (n = 0; n < A_column->Run[r].Length; n++)
+            {
+                sum1 += A_run[n]*w_run[n]*e_run[n];
+                sum2 += A_run[n]*w_run[n]*A_run[n];
+            }
+        }
+        else
+        {
+            float *A_run = A_column->Value + m;
+            #pragma omp simd reduction(+:sum1,sum2)
+            for (n = 0; n < A_column->Run[r].Length; n++)
+            {
+                sum1 += A_run[n]*w_run[n]*e_run[n];
+                sum2 += A_run[n]*w_run[n]*A_run[n];
+            }
+        }
+        *theta1 -= A_column->Scale*sum1;
+        *theta2 += A_column->Scale*A_column->Scale*sum2;
+        m += A_column->Run[r].Length;
+    }
+}
+
+
+/* sum A*w*e over a column, in a row of e and w */
+static float ColumnProduct3D(
+    struct SparseColumn *A_column,
+    int ValueType,
+    long *ViewOffset,
+    float *e_row,
+    float *w_row)
+{
+    int m, n, r;
+    long i;
+    float sum, total, *w_run, *e_run;
+
+    total = 0.0;
+    m = 0;
+    for (r = 0; r < A_column->Nrun; r++)
+    {
+        i = ViewOffset[A_column->Run[r].View] + A_column->Run[r].FirstChannel;
+        w_run = &w_row[i];
+        e_run = &e_row[i];
+        sum = 0.0;
+        if (ValueType == SYSMATRIX2D_VALUE_UINT8)
+        {
+            unsigned char *A_run = A_column->Value8 + m;
+            #pragma omp simd reduction(+:sum)
+            for (n = 0; n < A_column->Run[r].Length; n++)
+                sum += A_run[n]*w_run[n]*e_run[n];
+        }
+        else if (ValueType == SYSMATRIX2D_VALUE_UINT16)
+        {
+            unsigned short *A_run = A_column->Value16 + m;
+            #pragma omp simd reduction(+:sum)
+            for (n = 0; n < A_column->Run[r].Length; n++)
+                sum += A_run[n]*w_run[n]*e_run[n];
+        }
+        else
+        {
+            float *A_run = A_column->Value + m;
+            #pragma omp simd reduction(+:sum)
+            for (n = 0; n < A_column->Run[r].Length; n++)
+                sum += A_run[n]*w_run[n]*e_run[n];
+        }
+        total += A_column->Scale*sum;
+        m += A_column->Run[r].Length;
+    }
+    return total;
+}
+
+
 float ICDStep3D(
     float **e,  /* e=y-AX */
     float **w,
     struct SysMatrix2D *A,
     struct ICDInfo *icd_info)
 {
-    int i, n, Nxy, XYPixelIndex, SliceIndex;
+    int Nxy, SliceIndex;
+    long *ViewOffset;
     struct SparseColumn A_column;
-    float UpdatedVoxelValue,step;
+    float *e_row, *w_row;
 
     Nxy = icd_info->Nxy; /* No. of pixels within a given slice */
     
     /* Voxel Index: jz*Nx*Ny + jy*Nx + jx */
-    XYPixelIndex = icd_info->VoxelIndex%Nxy; /* XY pixel index within a given slice */
     SliceIndex = icd_info->VoxelIndex/Nxy;   /* Index of slice : between 0 to NSlices-1 */
+    SliceRows3D(e, w, icd_info, SliceIndex, &e_row, &w_row, &ViewOffset);
     
-    A_column = A->column[XYPixelIndex]; /* System matrix does not vary with slice for 3-D Parallel beam geometry */
+    A_column = *icd_info->A_column; /* System matrix does not vary with slice for 3-D Parallel beam geometry */
     
     /* Formulate the quadratic surrogate function (with coefficients theta1, theta2) for the local cost function */
-    icd_info->theta1 = 0.0;
-    icd_info->theta2 = 0.0;
-   
-    for (n = 0; n < A_column.Nnonzero; n++)
+    /* theta2 doesn't change with e, so it is taken from the cache if there is one */
+    if (icd_info->Theta2 != NULL)
     {
-        i = A_column.RowIndex[n] ; /* (View, Detector-Channel) index pertaining to same slice as voxel */
-        icd_info->theta1 -= A_column.Value[n]*w[SliceIndex][i]*e[SliceIndex][i];
-        icd_info->theta2 += A_column.Value[n]*w[SliceIndex][i]*A_column.Value[n];
+        icd_info->theta1 = -ColumnProduct3D(&A_column, A->ValueType, ViewOffset, e_row, w_row);
+        icd_info->theta2 = icd_info->Theta2[icd_info->VoxelIndex];
     }
+    else
+        ColumnThetas3D(&A_column, A->ValueType, ViewOffset, e_row, w_row, &icd_info->theta1, &icd_info->theta2);
+
+    return ICDPriorStep3D(icd_info);
+}
+
+
+/* Complete the ICD update of a voxel from theta1 and theta2 of the likelihood term */
+/* Returns the updated voxel value */
+float ICDPriorStep3D(struct ICDInfo *icd_info)
+{
+    float UpdatedVoxelValue,step;
    
+    icd_info->DataTheta1 = icd_info->theta1;
+    icd_info->DataTheta2 = icd_info->theta2;
+
     /* theta1 and theta2 must be further adjusted according to Prior Model */
     /* Step can be skipped if merely ML estimation (no prior model) is followed rather than MAP estimation */
     if(icd_info->Rparams.ReconType == MBIR_MODULAR_RECONTYPE_QGGMRF_3D)
@@ -75,44 +228,58 @@ float PandP_Update(struct ICDInfo *icd_info)
 float QGGMRF3D_Update(struct ICDInfo *icd_info)
 {
     int j; /* Neighbor relative position to Pixel being updated */
-    float delta, SurrogateCoeff;
-    float sum1_Nearest=0, sum1_Diag=0, sum1_Interslice=0; /* for theta1 calculation */
-    float sum2_Nearest=0, sum2_Diag=0, sum2_Interslice=0; /* for theta2 calculation */
-    float b_nearest, b_diag, b_interslice;
-    
-    b_nearest=icd_info->Rparams.b_nearest;
-    b_diag=icd_info->Rparams.b_diag;
-    b_interslice = icd_info->Rparams.b_interslice;
-    
+    float delta[10], SurrogateCoeff[10];
+    float sum1=0, sum2=0; /* for theta1 and theta2 calculation */
+    struct QGGMRFPrior *prior = icd_info->Prior;
+
     for (j = 0; j < 10; j++)
+        delta[j] = icd_info->v - icd_info->neighbors[j];
+
+    if (prior->Kernel == QGGMRF_KERNEL_EXACT)
     {
-        delta = icd_info->v - icd_info->neighbors[j];
-        SurrogateCoeff = QGGMRF_SurrogateCoeff(delta,icd_info);
-        
-        if (j < 4)
-        {
-            sum1_Nearest += (SurrogateCoeff * delta);
-            sum2_Nearest += SurrogateCoeff;
-        }
-        if(j>=4 && j<6)
-        {
-            sum1_Interslice += (SurrogateCoeff * delta);
-            sum2_Interslice += SurrogateCoeff;
-        }
-        if (j >= 6)
-        {
-            sum1_Diag += (SurrogateCoeff * delta);
-            sum2_Diag += SurrogateCoeff;
-        }
+        for (j = 0; j < 10; j++)
+            SurrogateCoeff[j] = QGGMRF_SurrogateCoeff(delta[j],icd_info);
+    }
+    else
+        QGGMRF_SurrogateCoeffs(delta, SurrogateCoeff, 10, prior);
+
+    /* Nearest, interslice and diagonal neighbors are told apart by their weights b[j] */
+    #pragma omp simd reduction(+:sum1,sum2)
+    for (j = 0; j < 10; j++)
+    {
+        sum1 += prior->b[j] * SurrogateCoeff[j] * delta[j];
+        sum2 += prior->b[j] * SurrogateCoeff[j];
     }
     
-    icd_info->theta1 +=  (b_nearest * sum1_Nearest + b_diag * sum1_Diag + b_interslice * sum1_Interslice) ;
-    icd_info->theta2 +=  (b_nearest * sum2_Nearest + b_diag * sum2_Diag + b_interslice * sum2_Interslice) ;
+    icd_info->theta1 += sum1;
+    icd_info->theta2 += sum2;
 
     return(-icd_info->theta1 / icd_info->theta2);
 }
 
 
+/* The likelihood term changes by theta1*diff + theta2*diff^2/2, and the prior term by the change */
+/* of the potentials of the 10 cliques of the voxel */
+float ICDCostChange3D(struct ICDInfo *icd_info, float UpdatedValue, int NzDataset)
+{
+    int j;
+    float diff, change;
+
+    diff = UpdatedValue - icd_info->v;
+    if (diff == 0.0)
+        return 0.0;
+
+    change = 0.0;
+    if (icd_info->SV == NULL)
+        change = icd_info->DataTheta1*diff + 0.5*icd_info->DataTheta2*diff*diff;
+    for (j = 0; j < 10; j++)
+    if (NzDataset > 1 || j < 4 || j >= 6)
+        change += icd_info->Prior->b[j]*(QGGMRF_PriorPotential(UpdatedValue - icd_info->neighbors[j], icd_info->Prior)
+                                        - QGGMRF_PriorPotential(icd_info->v - icd_info->neighbors[j], icd_info->Prior));
+    return change;
+}
+
+
 /* the potential function of the QGGMRF prior model.  p << q <= 2 */
 float QGGMRF_Potential(float delta, struct ReconParams *Rparams)
 {
@@ -172,17 +339,152 @@ float QGGMRF_SurrogateCoeff(float delta, struct ICDInfo *icd_info)
 }
 
 
+static void InitPowTable(struct PowTable *table, double a)
+{
+    int E, k;
+    double value;
+
+    for (E = 0; E < 256; E++)
+    {
+        value = pow(2.0, a*(E-127));
+        if (E == 0)     /* zero and denormals */
+            value = (a > 0) ? 0.0 : ((a < 0) ? FLT_MAX : 1.0);
+        table->Exponent[E] = (value > FLT_MAX) ? FLT_MAX : value;
+    }
+    for (k = 0; k <= POWTABLE_SIZE; k++)
+        table->Mantissa[k] = pow(1.0 + (double)k/POWTABLE_SIZE, a);
+}
+
+/* u^a from a PowTable, u >= 0 */
+static inline float TablePow(float u, const struct PowTable *table)
+{
+    union { float f; unsigned int i; } bits;
+    unsigned int k;
+    float frac;
+
+    bits.f = u;
+    k = (bits.i >> (23-POWTABLE_BITS)) & (POWTABLE_SIZE-1);
+    frac = (bits.i & ((1u<<(23-POWTABLE_BITS))-1)) * (1.0f/(1u<<(23-POWTABLE_BITS)));
+    return table->Exponent[bits.i >> 23] * (table->Mantissa[k] + frac*(table->Mantissa[k+1] - table->Mantissa[k]));
+}
+
+
+/* Choose the kernel of the QGGMRF prior and precompute its constants and tables */
+void QGGMRF_InitPrior(struct QGGMRFPrior *prior, struct ReconParams *Rparams)
+{
+    int j;
+    double p = Rparams->p, q = Rparams->q;
+
+    prior->Rparams = Rparams;
+    prior->p = p;
+    prior->q = q;
+    prior->Scale = 1.0/(Rparams->T*Rparams->SigmaX);
+    prior->K = 1.0/(Rparams->pow_sigmaX_q*Rparams->pow_T_qmp);
+    prior->Coeff0 = 2.0/(p*Rparams->pow_sigmaX_q*Rparams->pow_T_qmp);
+    for (j = 0; j < 10; j++)
+    {
+        if (j < 4)
+            prior->b[j] = Rparams->b_nearest;
+        else if (j < 6)
+            prior->b[j] = Rparams->b_interslice;
+        else
+            prior->b[j] = Rparams->b_diag;
+    }
+
+    if (!Rparams->FastPrior)
+        prior->Kernel = QGGMRF_KERNEL_EXACT;
+    else if (q == 2.0 && p == 1.0)
+        prior->Kernel = QGGMRF_KERNEL_Q2_P1;
+    else if (q == 2.0 && p == 2.0)
+        prior->Kernel = QGGMRF_KERNEL_Q2_P2;
+    else if (q == 2.0)
+        prior->Kernel = QGGMRF_KERNEL_Q2;
+    else
+        prior->Kernel = QGGMRF_KERNEL_GENERAL;
+
+    InitPowTable(&prior->Pow_qmp, q-p);
+    InitPowTable(&prior->Pow_qm2, q-2.0);
+    InitPowTable(&prior->Pow_q, q);
+}
+
+
+/* QGGMRF_SurrogateCoeff for n values of delta, with the kernel of prior (other than the exact one) */
+/* Each kernel is its own loop, so that it is vectorized over the neighbors */
+void QGGMRF_SurrogateCoeffs(float *delta, float *coeff, int n, struct QGGMRFPrior *prior)
+{
+    int j;
+    float t, u, qdivp = prior->q/prior->p, Scale = prior->Scale, K = prior->K;
+
+    switch (prior->Kernel)
+    {
+        case QGGMRF_KERNEL_Q2_P1:
+            #pragma omp simd private(t)
+            for (j = 0; j < n; j++)
+            {
+                t = fabsf(Scale*delta[j]);
+                coeff[j] = (2.0f + t)*K/((1.0f+t)*(1.0f+t));
+            }
+            break;
+        case QGGMRF_KERNEL_Q2_P2:  /* t=1 for any delta */
+            for (j = 0; j < n; j++)
+                coeff[j] = 0.5f*K;
+            break;
+        case QGGMRF_KERNEL_Q2:
+            #pragma omp simd private(t)
+            for (j = 0; j < n; j++)
+            {
+                t = TablePow(fabsf(Scale*delta[j]), &prior->Pow_qmp);
+                coeff[j] = (qdivp + t)*K/((1.0f+t)*(1.0f+t));
+            }
+            break;
+        default:
+            #pragma omp simd private(t, u)
+            for (j = 0; j < n; j++)
+            {
+                u = fabsf(delta[j]);
+                t = TablePow(Scale*u, &prior->Pow_qmp);
+                coeff[j] = (u == 0.0f) ? prior->Coeff0 : (qdivp + t)*TablePow(u, &prior->Pow_qm2)*K/((1.0f+t)*(1.0f+t));
+            }
+            break;
+    }
+}
+
+
+/* QGGMRF_Potential with the kernel of prior */
+float QGGMRF_PriorPotential(float delta, struct QGGMRFPrior *prior)
+{
+    float t, u = fabsf(delta);
+
+    switch (prior->Kernel)
+    {
+        case QGGMRF_KERNEL_EXACT:
+            return QGGMRF_Potential(delta, prior->Rparams);
+        case QGGMRF_KERNEL_Q2_P1:
+            t = prior->Scale*u;
+            return u*u*prior->K/(prior->p*(1.0f+t));
+        case QGGMRF_KERNEL_Q2_P2:
+            return u*u*prior->K/(prior->p*2.0f);
+        case QGGMRF_KERNEL_Q2:
+            t = TablePow(prior->Scale*u, &prior->Pow_qmp);
+            return u*u*prior->K/(prior->p*(1.0f+t));
+        default:
+            t = TablePow(prior->Scale*u, &prior->Pow_qmp);
+            return TablePow(u, &prior->Pow_q)*prior->K/(prior->p*(1.0f+t));
+    }
+}
+
+
 /* extract the neighborhood system */
 void ExtractNeighbors3D(
                         struct ICDInfo *icd_info,
                         struct Image3D *Image)
 {
     int jx, jy, jz, plusx, minusx, plusy, minusy, plusz, minusz;
-    int Nx, Ny, Nz, Nxy;
+    int Nx, Ny, Nz, Nxy, FirstSlice;
     
     Nx = Image->imgparams.Nx;
     Ny = Image->imgparams.Ny;
-    Nz = Image->imgparams.Nz;
+    Nz = Image->imgparams.Nz/icd_info->Rparams.NDatasets; /* Slices of one dataset of a batch */
     Nxy = Nx*Ny;
     
     /* Voxel Index = jz*Ny*Nx+jy*Nx+jx */
@@ -198,10 +500,15 @@ void ExtractNeighbors3D(
     plusy = ((plusy < Ny) ? plusy : 0);
     minusy = jy - 1;
     minusy = ((minusy < 0) ? (Ny-1) : minusy);
+    /* Wrap around in z within the dataset of the voxel, unless the halo slices of a slab are there */
+    FirstSlice = (jz/Nz)*Nz;
     plusz = jz + 1;
-    plusz = ((plusz < Nz) ? plusz : 0);
     minusz = jz - 1;
-    minusz = ((minusz < 0) ? (Nz-1) : minusz);
+    if (!icd_info->Rparams.Halo)
+    {
+        plusz = ((plusz < FirstSlice+Nz) ? plusz : FirstSlice);
+        minusz = ((minusz < FirstSlice) ? (FirstSlice+Nz-1) : minusz);
+    }
     
     icd_info->neighbors[0] = Image->image[jz][jy*Nx+plusx];
     icd_info->neighbors[1] = Image->image[jz][jy*Nx+minusx];
@@ -224,22 +531,181 @@ void UpdateError3D(
     float diff,
     struct ICDInfo *icd_info)
 {
-    int n, i, XYPixelIndex, SliceIndex;
+    int n, r, SliceIndex;
     int Nxy;
+    long *ViewOffset;
+    struct SparseColumn A_column;
+    float *e_run, *e_row, *w_row, ScaledDiff;
+    int m;
     
     Nxy = icd_info->Nxy; /* No. of pixels within a given slice */
     
     /* Voxel Index: jz*Nx*Ny + jy*Nx + jx */
-    XYPixelIndex = icd_info->VoxelIndex%Nxy; /* XY pixel index within a given slice */
     SliceIndex = icd_info->VoxelIndex/Nxy;   /* Index of slice : between 0 to NSlices-1 */
+    SliceRows3D(e, NULL, icd_info, SliceIndex, &e_row, &w_row, &ViewOffset);
     
-    /* System matrix does not vary with slice for 3-D Parallel beam geometry, so A->column only indexed by XYPixelIndex */
+    /* System matrix does not vary with slice for 3-D Parallel beam geometry, so the column only depends on the XY pixel index */
     /* Update sinogram error */
-    for (n = 0; n < A->column[XYPixelIndex].Nnonzero; n++)
+    A_column = *icd_info->A_column;
+    ScaledDiff = A_column.Scale*diff; /* dequantizes the entries of the column */
+    m = 0; /* Index of the first value of the run */
+    for (r = 0; r < A_column.Nrun; r++)
     {
-        i = A->column[XYPixelIndex].RowIndex[n]  ; /* (View, Detector-Channel) index pertaining to same slice as voxel */
-        e[SliceIndex][i] -= A->column[XYPixelIndex].Value[n]*diff;
+        /* (View, Detector-Channel) index pertaining to same slice as voxel */
+        e_run = &e_row[ViewOffset[A_column.Run[r].View] + A_column.Run[r].FirstChannel];
+        if (A->ValueType == SYSMATRIX2D_VALUE_UINT8)
+        {
+            unsigned char *A_run = A_column.Value8 + m;
+            #pragma omp simd
+            for (n = 0; n < A_column.Run[r].Length; n++)
+                e_run[n] -= A_run[n]*ScaledDiff;
+        }
+        else if (A->ValueType == SYSMATRIX2D_VALUE_UINT16)
+        {
+            unsigned short *A_run = A_column.Value16 + m;
+            #pragma omp simd
+            for (n = 0; n < A_column.Run[r].Length; n++)
+                e_run[n] -= A_run[n]*ScaledDiff;
+        }
+        else
+        {
+            float *A_run = A_column.Value + m;
+            #pragma omp simd
+            for (n = 0; n < A_column.Run[r].Length; n++)
+                e_run[n] -= A_run[n]*ScaledDiff;
+        }
+        m += A_column.Run[r].Length;
     }
 }
 
 
+/* Value n of a column, scaled if quantized */
+static float ColumnValue3D(struct SparseColumn *A_column, int ValueType, int n)
+{
+    if (ValueType == SYSMATRIX2D_VALUE_UINT8)
+        return A_column->Scale*A_column->Value8[n];
+    else if (ValueType == SYSMATRIX2D_VALUE_UINT16)
+        return A_column->Scale*A_column->Value16[n];
+    else
+        return A_column->Value[n];
+}
+
+
+/* theta1 and theta2 of the likelihood term for the Nz voxels of a voxel line, in one pass over the */
+/* column. e and w hold the Nz slices of each entry together (see icd_3D.h) */
+void ICDThetaLine3D(
+    float *e,
+    float *w,
+    long *ViewOffset,
+    int Nz,
+    struct SparseColumn *A_column,
+    int ValueType,
+    float *theta1,
+    float *theta2)
+{
+    int m, n, r, jz;
+    float AValue, *e_entry, *w_entry;
+
+    for (jz = 0; jz < Nz; jz++)
+        theta1[jz] = 0.0;
+    if (theta2 != NULL)
+        for (jz = 0; jz < Nz; jz++)
+            theta2[jz] = 0.0;
+
+    m = 0;
+    for (r = 0; r < A_column->Nrun; r++)
+    {
+        e_entry = &e[(ViewOffset[A_column->Run[r].View] + A_column->Run[r].FirstChannel)*Nz];
+        w_entry = &w[(ViewOffset[A_column->Run[r].View] + A_column->Run[r].FirstChannel)*Nz];
+        for (n = 0; n < A_column->Run[r].Length; n++, m++, e_entry += Nz, w_entry += Nz)
+        {
+            AValue = ColumnValue3D(A_column, ValueType, m);
+            if (theta2 == NULL)
+            {
+                #pragma omp simd
+                for (jz = 0; jz < Nz; jz++)
+                    theta1[jz] -= AValue*w_entry[jz]*e_entry[jz];
+            }
+            else
+            {
+                #pragma omp simd
+                for (jz = 0; jz < Nz; jz++)
+                {
+                    theta1[jz] -= AValue*w_entry[jz]*e_entry[jz];
+                    theta2[jz] += AValue*w_entry[jz]*AValue;
+                }
+            }
+        }
+    }
+}
+
+
+/* theta2 of each voxel within the ROI, column by column. Theta2 is indexed like the image */
+void ComputeTheta2_3D(
+    float **w,
+    struct SysMatrix2D *A,
+    long *ViewOffset,
+    int Nxy,
+    int Nz,
+    char *ImageReconMask,
+    float *Theta2)
+{
+    #pragma omp parallel
+    {
+        struct SparseColumn A_scratch, *A_column;
+        int j, jz, m, n, r;
+        long i;
+        float AValue;
+
+        AllocateSysMatrix2DColumn(A, &A_scratch);
+
+        #pragma omp for schedule(dynamic,16)
+        for (j = 0; j < Nxy; j++)
+        {
+            for (jz = 0; jz < Nz; jz++)
+                Theta2[(long)jz*Nxy + j] = 0.0;
+            if (!ImageReconMask[j])
+                continue;
+            A_column = GetSysMatrixColumn(A, j, &A_scratch);
+            m = 0;
+            for (r = 0; r < A_column->Nrun; r++)
+            {
+                i = ViewOffset[A_column->Run[r].View] + A_column->Run[r].FirstChannel;
+                for (n = 0; n < A_column->Run[r].Length; n++, m++, i++)
+                {
+                    AValue = ColumnValue3D(A_column, A->ValueType, m);
+                    for (jz = 0; jz < Nz; jz++)
+                        Theta2[(long)jz*Nxy + j] += AValue*w[jz][i]*AValue;
+                }
+            }
+        }
+        FreeSysMatrix2DColumn(&A_scratch);
+    }
+}
+
+
+/* Update error term e=y-Ax after ICD updates of a voxel line, where diff[jz] is the change in slice jz */
+void UpdateErrorLine3D(
+    float *e,
+    long *ViewOffset,
+    int Nz,
+    struct SparseColumn *A_column,
+    int ValueType,
+    float *diff)
+{
+    int m, n, r, jz;
+    float AValue, *e_entry;
+
+    m = 0;
+    for (r = 0; r < A_column->Nrun; r++)
+    {
+        e_entry = &e[(ViewOffset[A_column->Run[r].View] + A_column->Run[r].FirstChannel)*Nz];
+        for (n = 0; n < A_column->Run[r].Length; n++, m++, e_entry += Nz)
+        {
+            AValue = ColumnValue3D(A_column, ValueType, m);
+            #pragma omp simd
+            for (jz = 0; jz < Nz; jz++)
+                e_entry[jz] -= AValue*diff[jz];
+        }
+    }
+}
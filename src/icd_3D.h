@@ -3,6 +3,51 @@
 
 #include "MBIRModularDefs.h"
 
+/* Sinogram band of a super-voxel: for each view, the range of channels touched by the columns of */
+/* the super-voxel, copied from one slice of e and w into compact buffers */
+/* Entry (View, Channel) of the slice is at e[ViewOffset[View] + Channel] */
+struct SVBuffer
+{
+    float *e;
+    float *w;
+    float *e0;  /* e as it was gathered, so that only the change is merged back */
+    long *ViewOffset;
+};
+
+/* u^a for u >= 0 without pow(): 2^(a*(E-127)) for each float exponent E, times m^a for the mantissa */
+/* m in [1,2), interpolated linearly in a table of POWTABLE_SIZE intervals. The relative error is */
+/* at most |a(a-1)|/(8*POWTABLE_SIZE^2), i.e. below 2e-6 for a in [-1,2] */
+#define POWTABLE_BITS 8
+#define POWTABLE_SIZE (1<<POWTABLE_BITS)
+struct PowTable
+{
+    float Exponent[256];
+    float Mantissa[POWTABLE_SIZE+1];
+};
+
+/* Kernels of the QGGMRF prior, chosen by QGGMRF_InitPrior from p and q */
+#define QGGMRF_KERNEL_EXACT 0   /* pow() as in QGGMRF_SurrogateCoeff and QGGMRF_Potential */
+#define QGGMRF_KERNEL_Q2_P1 1   /* q=2, p=1: no powers at all */
+#define QGGMRF_KERNEL_Q2_P2 2   /* q=2, p=2: quadratic */
+#define QGGMRF_KERNEL_Q2 3      /* q=2: one tabulated power */
+#define QGGMRF_KERNEL_GENERAL 4 /* tabulated powers */
+
+/* With t = |delta/(T*SigmaX)|^(q-p) and K = 1/(SigmaX^q*T^(q-p)), the surrogate coefficient is */
+/* (q/p+t)*|delta|^(q-2)*K/(1+t)^2 and the potential |delta|^q*K/(p*(1+t)), so q=2 needs t only */
+struct QGGMRFPrior
+{
+    int Kernel;
+    float p, q;
+    float Scale;    /* 1/(T*SigmaX) */
+    float K;
+    float Coeff0;   /* Surrogate coefficient at delta=0, i.e. rho"(0) */
+    float b[10];    /* Weight of each neighbor, in the order of ExtractNeighbors3D */
+    struct PowTable Pow_qmp;    /* u^(q-p) */
+    struct PowTable Pow_qm2;    /* u^(q-2), general kernel */
+    struct PowTable Pow_q;      /* u^q, general kernel */
+    struct ReconParams *Rparams;    /* For the exact kernel */
+};
+
 struct ICDInfo
 {
     int VoxelIndex ; /* Index of Voxel being updated */
@@ -12,24 +57,52 @@ struct ICDInfo
     
 	float theta1; /* Quadratic surrogate function parameters -theta1 and theta2 */
 	float theta2;
+	float DataTheta1; /* theta1 and theta2 of the likelihood term alone, kept by ICDPriorStep3D */
+	float DataTheta2;
     
     struct ReconParams Rparams; /* Reconstruction Parameters (includes prior parameters) */
     
     int Nxy;    /* Number of pixels within a given slice */
+
+    struct SparseColumn *A_column; /* System matrix column of the voxel, see GetSysMatrixColumn */
+    long *ViewOffset; /* Offset of each view within a slice of e and w, i.e. View*NChannels */
+    struct SVBuffer *SV; /* If not NULL, e and w are read and updated in this super-voxel buffer instead */
+    float *Theta2; /* If not NULL, theta2 of the likelihood term of each voxel, see ComputeTheta2_3D */
+    struct QGGMRFPrior *Prior; /* QGGMRF kernel, see QGGMRF_InitPrior */
 };
 
 float ICDStep3D(float **e, float **w, struct SysMatrix2D *A, struct ICDInfo *icd_info);
+float ICDPriorStep3D(struct ICDInfo *icd_info); /* The part of ICDStep3D after theta1 and theta2 of the likelihood */
 
 /* Prior-specific, independent of neighborhood */
 float QGGMRF_SurrogateCoeff(float delta, struct ICDInfo *icd_info);
 float QGGMRF_Potential(float delta, struct ReconParams *Rparams);
+void QGGMRF_InitPrior(struct QGGMRFPrior *prior, struct ReconParams *Rparams);
+void QGGMRF_SurrogateCoeffs(float *delta, float *coeff, int n, struct QGGMRFPrior *prior); /* n deltas at once */
+float QGGMRF_PriorPotential(float delta, struct QGGMRFPrior *prior); /* QGGMRF_Potential with the kernel of prior */
 /* Prior and neighborhood specific */
 float QGGMRF3D_Update(struct ICDInfo *icd_info);
 float PandP_Update(struct ICDInfo *icd_info);
 /* Only neighborhood specific */
 void ExtractNeighbors3D(struct ICDInfo *icd_info, struct Image3D *X);
 
+/* theta2 = sum A^2*w of the likelihood term of each voxel within the ROI, which stays the same */
+/* throughout the reconstruction */
+void ComputeTheta2_3D(float **w, struct SysMatrix2D *A, long *ViewOffset, int Nxy, int Nz, char *ImageReconMask, float *Theta2);
+
+/* Change of the MAP cost from the update of the voxel of icd_info to UpdatedValue, from its */
+/* likelihood theta1 and theta2 and its neighbors. Interslice cliques are left out for NzDataset=1, */
+/* where the voxel is its own interslice neighbor. With a super-voxel buffer, the likelihood term is */
+/* left to the merge of the buffer, see ScatterSVBand3D */
+float ICDCostChange3D(struct ICDInfo *icd_info, float UpdatedValue, int NzDataset);
+
 /* Update error term e=y-Ax after an ICD update on x */
 void UpdateError3D(float **e, struct SysMatrix2D *A, float diff, struct ICDInfo *icd_info);
 
+/* Voxel lines: the Nz voxels of an (x,y) pixel share one column of the system matrix. With e and w */
+/* stored slice-interleaved, entry (View, Channel) of slice jz at e[(ViewOffset[View] + Channel)*Nz + jz], */
+/* one pass over the column serves all Nz voxels. ICDThetaLine3D leaves theta2 out if it is NULL */
+void ICDThetaLine3D(float *e, float *w, long *ViewOffset, int Nz, struct SparseColumn *A_column, int ValueType, float *theta1, float *theta2);
+void UpdateErrorLine3D(float *e, long *ViewOffset, int Nz, struct SparseColumn *A_column, int ValueType, float *diff);
+
 #endif
@@ -12,7 +12,7 @@
 /* Initialize image state */
 void Initialize_Image(
 	struct Image3D *Image,
-	struct CmdLineMBIR *cmdline,
+	char *InitImageDataFile,   /* "NA" if not available */
 	char *ImageReconMask,
 	float InitValue,
 	float OutsideROIValue)
@@ -23,7 +23,7 @@ void Initialize_Image(
 
     fprintf(stdout, "\nInitializing Image ... \n");
 
-    if(strcmp(cmdline->InitImageDataFile,"NA") == 0) /* Image file not available */
+    if(strcmp(InitImageDataFile,"NA") == 0) /* Image file not available */
     {
         /* Generate constant image */
         for(jz=0; jz<Nz; jz++)
@@ -34,7 +34,7 @@ void Initialize_Image(
             Image->image[jz][j] = InitValue;
     }
     else 
-        ReadImage3D(cmdline->InitImageDataFile, Image);
+        ReadImage3D(InitImageDataFile, Image);
 
 }
 
@@ -147,13 +147,17 @@ void readSystemParams  (
     }
 
     /* Determine and SET number of slice index digits in data files */
+    /* With a single-file volume, the digits only matter for per-slice files written out */
     int Ndigits = NumSinoSliceDigits(cmdline->SinoDataFile, sinoparams->FirstSliceNumber);
+    if(Ndigits==0 && IsVolume3D(cmdline->SinoDataFile,"3Dsinodata"))
+        Ndigits = MBIR_MODULAR_MAX_NUMBER_OF_SLICE_DIGITS;
     if(Ndigits==0)
     {
         int i;
         fprintf(stderr,"Error: Can't read the first data file. Looking for any one of the following:\n");
         for(i=MBIR_MODULAR_MAX_NUMBER_OF_SLICE_DIGITS; i>0; i--)
             fprintf(stderr,"\t%s_slice%.*d.2Dsinodata\n",cmdline->SinoDataFile, i, sinoparams->FirstSliceNumber);
+        fprintf(stderr,"\t%s.3Dsinodata\n",cmdline->SinoDataFile);
         exit(-1);
     }
     //printf("Detected %d slice index digits\n",Ndigits);
@@ -162,7 +166,112 @@ void readSystemParams  (
 
 }
 
+/* Read the System Matrix given on the command line, or set up computing its columns on the fly */
+/* (then with geom and pix_prof, which must stay valid while A is in use) */
+void SetupSysMatrix3D(
+	struct CmdLineMBIR *cmdline,
+	struct SinoParams3DParallel *sinoparams,
+	struct ImageParams3D *imgparams,
+	struct SysMatrix2D *A,
+	struct SysMatrixGeom3DParallel *geom,
+	float ***pix_prof)
+{
+    struct SysMatrixParams2D ExpectedParams;
+
+    A->Ncolumns = imgparams->Nx * imgparams->Ny;
+    SetSysMatrixParams2D(&ExpectedParams, sinoparams, imgparams);
+    A->params = ExpectedParams; /* older files need NViews and NChannels */
+    *pix_prof = NULL;
+    if(cmdline->NCacheColumns >= 0)
+    {
+        *pix_prof = ComputePixelProfile3DParallel(sinoparams, imgparams);
+        InitSysMatrixGeom3DParallel(geom, sinoparams, imgparams, *pix_prof);
+        geom->Projector = cmdline->Projector;
+        InitSysMatrixOnTheFly3DParallel(A, geom, cmdline->NCacheColumns);
+        fprintf(stdout, "Computing System Matrix columns on the fly (%d cached columns)\n", A->NCacheColumns);
+    }
+    else if(cmdline->SysMatrixCacheDir[0] != '\0')
+        ReadCachedSysMatrix3DParallel(cmdline->SysMatrixCacheDir, sinoparams, imgparams, cmdline->Projector, A);
+    else
+    {
+        if(ReadSysMatrix2D(cmdline->SysMatrixFile,A))
+        {   fprintf(stderr, "Error in reading system matrix from file %s through function ReadSysMatrix2D \n",cmdline->SysMatrixFile);
+            exit(-1);
+        }
+        if(CompareSysMatrixParams2D(&ExpectedParams, &A->params, cmdline->SysMatrixFile))
+        {   fprintf(stderr, "Error : system matrix %s doesn't match the image and sinogram parameters; regenerate it with Gen_SysMatrix_3D \n",cmdline->SysMatrixFile);
+            exit(-1);
+        }
+    }
+}
+
+/* Free the System Matrix set up by SetupSysMatrix3D */
+void FreeSysMatrix3D(struct CmdLineMBIR *cmdline, struct SysMatrix2D *A, struct SysMatrixGeom3DParallel *geom, float **pix_prof)
+{
+    if(FreeSysMatrix2D(A))
+    {  fprintf(stderr, "Error System Matrix memory could not be freed through function FreeSysMatrix2D \n");
+        exit(-1);
+    }
+    if(cmdline->NCacheColumns >= 0)
+    {
+        FreeSysMatrixGeom3DParallel(geom);
+        free_img((void **)pix_prof);
+    }
+}
+
+/* Read the batch list: one dataset per line, given as */
+/*   <ProjectionsBaseFileName> <WeightsBaseFileName> <OutputImageBaseFileName> [<InitialImageBaseFileName>] */
+static void ReadBatchList(struct CmdLineMBIR *cmdline)
+{
+    FILE *fp;
+    char line[1000];
+    int n, Nlines;
+
+    if((fp=fopen(cmdline->BatchListFile,"r")) == NULL)
+    {
+        fprintf(stderr,"Error : can't open batch list file %s\n",cmdline->BatchListFile);
+        exit(-1);
+    }
+    Nlines = 0;
+    while(fgets(line, sizeof(line), fp) != NULL)
+        Nlines++;
+    cmdline->Dataset = (struct DatasetMBIR *)get_spc(Nlines > 0 ? Nlines : 1, sizeof(struct DatasetMBIR));
+
+    rewind(fp);
+    cmdline->NDatasets = 0;
+    while(fgets(line, sizeof(line), fp) != NULL)
+    {
+        struct DatasetMBIR *dataset = &cmdline->Dataset[cmdline->NDatasets];
+
+        strcpy(dataset->InitImageDataFile, "NA");
+        n = sscanf(line, "%199s %199s %199s %199s", dataset->SinoDataFile, dataset->SinoWeightsFile, dataset->ReconImageDataFile, dataset->InitImageDataFile);
+        if(n <= 0)
+            continue; /* blank line */
+        if(n < 3)
+        {
+            fprintf(stderr,"Error in %s : each line needs the sinogram, weights and output image base file names\n",cmdline->BatchListFile);
+            exit(-1);
+        }
+        cmdline->NDatasets++;
+    }
+    fclose(fp);
+
+    if(cmdline->NDatasets == 0)
+    {
+        fprintf(stderr,"Error : no datasets in batch list file %s\n",cmdline->BatchListFile);
+        exit(-1);
+    }
+}
+
 /* Read Command-line */
+/* Options without a single-letter form */
+static struct option LongOptions[] = {
+    {"mem-limit", required_argument, NULL, 'L'},
+    {"runtime-margin", required_argument, NULL, 'R'},
+    {"plan", no_argument, NULL, 'P'},
+    {NULL, 0, NULL, 0}
+};
+
 void readCmdLineMBIR(int argc, char *argv[], struct CmdLineMBIR *cmdline)
 {
     char ch;
@@ -170,8 +279,23 @@ void readCmdLineMBIR(int argc, char *argv[], struct CmdLineMBIR *cmdline)
     /* set defaults */
     strcpy(cmdline->InitImageDataFile, "NA"); /* default */
     cmdline->ReconType = MBIR_MODULAR_RECONTYPE_QGGMRF_3D;
+    cmdline->NCacheColumns = -1; /* read the System Matrix from a file */
+    cmdline->Projector = DEFAULT_PROJECTOR;
+    cmdline->SysMatrixFile[0] = '\0';
+    cmdline->SysMatrixCacheDir[0] = '\0';
+    cmdline->BatchListFile[0] = '\0';
+    cmdline->SinoDataFile[0] = '\0';
+    cmdline->SinoWeightsFile[0] = '\0';
+    cmdline->ReconImageDataFile[0] = '\0';
+    cmdline->MemoryBudget = 0; /* no budget, everything in memory */
+    cmdline->NProcesses = 1;
+    cmdline->MemoryLimit = 0; /* no limit */
+    cmdline->RuntimeMargin = 0; /* estimate */
+    cmdline->PlanOnly = 0;
+    cmdline->ScalarWeights = 0;
+    cmdline->ScalarWeight = 0;
     
-    if(argc<15)
+    if(argc<11)
     {
         if(argc==2 && CmdLineHelp(argv[1]))
         {
@@ -188,7 +312,7 @@ void readCmdLineMBIR(int argc, char *argv[], struct CmdLineMBIR *cmdline)
     }
     
     /* get options */
-    while ((ch = getopt(argc, argv, "i:j:k:m:s:w:r:t:p:v")) != EOF)
+    while ((ch = getopt_long(argc, argv, "i:j:k:m:c:f:d:s:w:r:t:p:b:l:n:v", LongOptions, NULL)) != EOF)
     {
         switch (ch)
         {
@@ -212,6 +336,34 @@ void readCmdLineMBIR(int argc, char *argv[], struct CmdLineMBIR *cmdline)
                 sprintf(cmdline->SysMatrixFile, "%s", optarg);
                 break;
             }
+            case 'c':
+            {
+                sprintf(cmdline->SysMatrixCacheDir, "%s", optarg);
+                break;
+            }
+            case 'f':
+            {
+                cmdline->NCacheColumns = atoi(optarg);
+                if(cmdline->NCacheColumns < 0)
+                {
+                    fprintf(stderr,"Error : -f option takes a non-negative number of cached columns\n");
+                    exit(-1);
+                }
+                break;
+            }
+            case 'd':
+            {
+                if(strcmp(optarg,"analytic")==0)
+                    cmdline->Projector = SYSMATRIX2D_PROJECTOR_ANALYTIC;
+                else if(strcmp(optarg,"sampled")==0)
+                    cmdline->Projector = SYSMATRIX2D_PROJECTOR_SAMPLED;
+                else
+                {
+                    fprintf(stderr,"Error : -d option takes analytic or sampled\n");
+                    exit(-1);
+                }
+                break;
+            }
             case 's':
             {
                 sprintf(cmdline->SinoDataFile, "%s", optarg);
@@ -238,6 +390,56 @@ void readCmdLineMBIR(int argc, char *argv[], struct CmdLineMBIR *cmdline)
                 cmdline->ReconType = MBIR_MODULAR_RECONTYPE_PandP;
                 break;
             }
+            case 'b':
+            {
+                sprintf(cmdline->BatchListFile, "%s", optarg);
+                break;
+            }
+            case 'l':
+            {
+                cmdline->MemoryBudget = atof(optarg);
+                if(cmdline->MemoryBudget <= 0)
+                {
+                    fprintf(stderr,"Error : -l option takes a positive memory budget in MB\n");
+                    exit(-1);
+                }
+                break;
+            }
+            case 'n':
+            {
+                cmdline->NProcesses = atoi(optarg);
+                if(cmdline->NProcesses < 1)
+                {
+                    fprintf(stderr,"Error : -n option takes a positive number of processes\n");
+                    exit(-1);
+                }
+                break;
+            }
+            case 'L':
+            {
+                cmdline->MemoryLimit = atof(optarg);
+                if(cmdline->MemoryLimit <= 0)
+                {
+                    fprintf(stderr,"Error : --mem-limit option takes a positive memory limit in MB\n");
+                    exit(-1);
+                }
+                break;
+            }
+            case 'R':
+            {
+                cmdline->RuntimeMargin = atof(optarg);
+                if(cmdline->RuntimeMargin <= 0)
+                {
+                    fprintf(stderr,"Error : --runtime-margin option takes a positive amount of memory in MB\n");
+                    exit(-1);
+                }
+                break;
+            }
+            case 'P':
+            {
+                cmdline->PlanOnly = 1;
+                break;
+            }
             // Reserve this for verbose-mode flag
             case 'v':
             {
@@ -253,6 +455,47 @@ void readCmdLineMBIR(int argc, char *argv[], struct CmdLineMBIR *cmdline)
         }
     }
 
+    if(cmdline->SysMatrixFile[0] == '\0' && cmdline->SysMatrixCacheDir[0] == '\0' && cmdline->NCacheColumns < 0)
+    {
+        fprintf(stderr,"Error : one of the options -m, -c or -f is needed for the System Matrix\n");
+        PrintCmdLineUsage(argv[0]);
+        exit(-1);
+    }
+
+    if(cmdline->MemoryLimit > 0 && cmdline->MemoryBudget > 0)
+    {
+        fprintf(stderr,"Error : option -l can't be used with --mem-limit, which chooses slabs when they are needed\n");
+        exit(-1);
+    }
+
+    if(cmdline->BatchListFile[0] != '\0')
+    {
+        if(cmdline->ReconType == MBIR_MODULAR_RECONTYPE_PandP || cmdline->MemoryBudget > 0)
+        {
+            fprintf(stderr,"Error : option -b can't be used with -p or -l\n");
+            exit(-1);
+        }
+        ReadBatchList(cmdline);
+        /* The first dataset stands in for the others where a single file name is needed */
+        strcpy(cmdline->SinoDataFile, cmdline->Dataset[0].SinoDataFile);
+        strcpy(cmdline->SinoWeightsFile, cmdline->Dataset[0].SinoWeightsFile);
+        strcpy(cmdline->ReconImageDataFile, cmdline->Dataset[0].ReconImageDataFile);
+    }
+    else
+    {
+        if(cmdline->SinoDataFile[0] == '\0' || cmdline->SinoWeightsFile[0] == '\0' || cmdline->ReconImageDataFile[0] == '\0')
+        {
+            fprintf(stderr,"Error : the options -s, -w and -r (or -b) are needed\n");
+            PrintCmdLineUsage(argv[0]);
+            exit(-1);
+        }
+        cmdline->NDatasets = 1;
+        cmdline->Dataset = (struct DatasetMBIR *)get_spc(1, sizeof(struct DatasetMBIR));
+        strcpy(cmdline->Dataset[0].SinoDataFile, cmdline->SinoDataFile);
+        strcpy(cmdline->Dataset[0].SinoWeightsFile, cmdline->SinoWeightsFile);
+        strcpy(cmdline->Dataset[0].ReconImageDataFile, cmdline->ReconImageDataFile);
+        strcpy(cmdline->Dataset[0].InitImageDataFile, cmdline->InitImageDataFile);
+    }
 }
 
 void PrintCmdLineUsage(char *ExecFileName)
@@ -261,12 +504,51 @@ void PrintCmdLineUsage(char *ExecFileName)
     fprintf(stdout, "build time: %s, %s\n", __DATE__,  __TIME__);
     fprintf(stdout, "\nCommand line Format for Executable File %s :\n", ExecFileName);
     fprintf(stdout, "%s -i <InputFileName>[.imgparams] -j <InputFileName>[.sinoparams]\n",ExecFileName);
-    fprintf(stdout, "   -k <InputFileName>[.reconparams] -m <InputFileName>[.2Dsysmatrix]\n");
+    fprintf(stdout, "   -k <InputFileName>[.reconparams]\n");
+    fprintf(stdout, "   -m <InputFileName>[.2Dsysmatrix] | -c <SysMatrixCacheDirectory> | -f <NCacheColumns>\n");
     fprintf(stdout, "   -s <InputProjectionsBaseFileName> -w <InputWeightsBaseFileName>\n");
-    fprintf(stdout, "   -r <OutputImageBaseFileName>\n\n");
+    fprintf(stdout, "   -r <OutputImageBaseFileName> | -b <BatchListFile>\n\n");
     fprintf(stdout, "Additional options:\n");
+    fprintf(stdout, "   -d <analytic|sampled>           # Projector of the System Matrix computed for -c or -f (default %s)\n",
+        (DEFAULT_PROJECTOR == SYSMATRIX2D_PROJECTOR_ANALYTIC) ? "analytic" : "sampled");
     fprintf(stdout, "   -t <InitialImageBaseFileName>   # Read initial image\n");
-    fprintf(stdout, "   -p <ProxMapImageBaseFileName>   # Read/run Proximal Map prior\n\n");
+    fprintf(stdout, "   -p <ProxMapImageBaseFileName>   # Read/run Proximal Map prior\n");
+    fprintf(stdout, "   -l <MemoryBudgetMB>             # Reconstruct in slabs of slices that fit in the memory budget\n");
+    fprintf(stdout, "   -n <NProcesses>                 # Reconstruct with processes working on a slab each\n");
+    fprintf(stdout, "   --mem-limit <MemoryLimitMB>     # Choose lower-memory options to fit in the memory limit\n");
+    fprintf(stdout, "   --runtime-margin <MarginMB>     # Memory of the program, libraries and thread stacks in the plan\n");
+    fprintf(stdout, "   --plan                          # Print the memory plan and stop\n\n");
+    fprintf(stdout, "The geometry of a System Matrix given with -m must match the .imgparams and .sinoparams files.\n");
+    fprintf(stdout, "Option -c replaces -m: the System Matrix for the geometry is looked up in the cache directory,\n");
+    fprintf(stdout, "and computed and added to it if it isn't there yet. With -d analytic, it stores one column per\n");
+    fprintf(stdout, "pixel-grid symmetry orbit (up to 8 times less memory; the other columns are remapped from them,\n");
+    fprintf(stdout, "matching to about 2e-4 of their peak); the default sampled projector stores all columns.\n");
+    fprintf(stdout, "Option -f replaces -m: the System Matrix is not read from a file but its columns are\n");
+    fprintf(stdout, "computed when they are needed, keeping up to NCacheColumns of them (0 for none) in memory.\n");
+    fprintf(stdout, "This is slower but works for images whose System Matrix doesn't fit in memory. The voxels of a\n");
+    fprintf(stdout, "pixel are then updated together across the slices (VoxelLines), so that each column computed\n");
+    fprintf(stdout, "serves all of them; this keeps a slice-interleaved copy of the error sinogram and weights.\n");
+    fprintf(stdout, "Option -b replaces -s, -w, -r and -t: several datasets with the same geometry (e.g. time\n");
+    fprintf(stdout, "frames or energy bins) are reconstructed together, reading each System Matrix column once\n");
+    fprintf(stdout, "for all of them. The threads share the super-voxels of the slice (of side 8 if SVLength is -1).\n");
+    fprintf(stdout, "Each line of the BatchListFile gives the base file names of one dataset:\n");
+    fprintf(stdout, "   <InputProjectionsBaseFileName> <InputWeightsBaseFileName> <OutputImageBaseFileName> [<InitialImageBaseFileName>]\n");
+    fprintf(stdout, "With option -l, the slices are split into slabs that fit in the memory budget with the System Matrix.\n");
+    fprintf(stdout, "The slabs are reconstructed in turn, a few iterations at a time, reading their sinogram and weights\n");
+    fprintf(stdout, "and the slices around them from the files, and writing their slices to the output image, until the\n");
+    fprintf(stdout, "whole volume converges. The output image holds the current estimate while this runs.\n");
+    fprintf(stdout, "With option -n, the slices are split into NProcesses slabs, reconstructed at the same time by\n");
+    fprintf(stdout, "as many processes that send the slices at the edges of their slab to each other after every\n");
+    fprintf(stdout, "iteration. Built with \"make mpi\", mbir_3D_mpi does the same with the ranks it is started\n");
+    fprintf(stdout, "with by mpirun, e.g. on the nodes of a cluster, instead of option -n.\n");
+    fprintf(stdout, "Before anything is allocated, the memory the reconstruction takes is computed from the parameter\n");
+    fprintf(stdout, "files and the header of the System Matrix file, and printed. With --mem-limit, lower-memory options\n");
+    fprintf(stdout, "are chosen until it fits, in this order: the error sinogram replaces the sinogram (as InPlaceError\n");
+    fprintf(stdout, "in the .reconparams file), a single slice of weights is held if all weights are the same value, and\n");
+    fprintf(stdout, "the slices are reconstructed in slabs as with option -l. The peak memory is printed at the end.\n");
+    fprintf(stdout, "The memory of the program, libraries and thread stacks isn't allocated by the reconstruction and\n");
+    fprintf(stdout, "is estimated as 4 MB, plus 0.5 MB per thread and 12 MB for MPI, which is about what Linux with glibc\n");
+    fprintf(stdout, "and Open MPI take; --runtime-margin sets it instead, e.g. from the peak memory of a small run.\n\n");
     fprintf(stdout, "Note : The necessary extensions for certain input files are mentioned above within\n");
     fprintf(stdout, "a \"[]\" symbol above, however the extensions should be OMITTED in the command line\n\n");
     fprintf(stdout, "The following instructions pertain to the -s, -w and -r options:\n");
@@ -279,7 +561,12 @@ void PrintCmdLineUsage(char *ExecFileName)
     fprintf(stdout, "B) Similarly, the format for the Sinogram Weights files is :\n");
     fprintf(stdout, "      <WeightsBaseFileName>_slice<SliceIndex>.2Dweightdata\n");
     fprintf(stdout, "C) Similarly, the Reconstructed (Output) Image is organized slice by slice :\n");
-    fprintf(stdout, "      <ImageBaseFileName>_slice<SliceIndex>.2Dimgdata\n\n");
+    fprintf(stdout, "      <ImageBaseFileName>_slice<SliceIndex>.2Dimgdata\n");
+    fprintf(stdout, "D) Instead of per-slice files, the data may be in single-file volumes\n");
+    fprintf(stdout, "      <ProjectionsBaseFileName>.3Dsinodata, <WeightsBaseFileName>.3Dweightdata,\n");
+    fprintf(stdout, "      <ImageBaseFileName>.3Dimgdata\n");
+    fprintf(stdout, "   that hold a range of slices each (see MBIRModularDefs.h). They are memory mapped, not read.\n");
+    fprintf(stdout, "   If the projections are in a volume, the reconstructed image is written as a volume too.\n\n");
 }
 
 int CmdLineHelp(char *string)
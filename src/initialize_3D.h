@@ -2,6 +2,15 @@
 #define _INITIALIZE_3D_H_
 
 #include "MBIRModularDefs.h"
+#include "A_comp_3D.h"
+
+/* A dataset to reconstruct. Datasets of a batch share the geometry and System Matrix */
+struct DatasetMBIR{
+    char SinoDataFile[200];
+    char SinoWeightsFile[200];
+    char ReconImageDataFile[200]; /* output */
+    char InitImageDataFile[200]; /* optional input, "NA" if not available */
+};
 
 struct CmdLineMBIR{
     char ReconType;		/* 1:QGGMRF, 2:PandP */
@@ -12,13 +21,26 @@ struct CmdLineMBIR{
     char SinoWeightsFile[200];
     char ReconImageDataFile[200]; /* output */
     char SysMatrixFile[200];
+    char SysMatrixCacheDir[200]; /* If not empty, look up (or generate) the System Matrix in this directory */
     char InitImageDataFile[200]; /* optional input */
     char ProxMapImageDataFile[200]; /* optional input */
+    int NCacheColumns; /* If >= 0, compute System Matrix columns on the fly (no SysMatrixFile) with this many cached columns */
+    int Projector; /* Projector of the System Matrix computed for -c or -f, DEFAULT_PROJECTOR unless set with -d */
+    char BatchListFile[200]; /* If not empty, list of the datasets to reconstruct together, one per line */
+    int NDatasets;
+    struct DatasetMBIR *Dataset; /* Those of the batch list, or the one given by -s, -w, -r and -t */
+    double MemoryBudget; /* If > 0, memory (MB) the reconstruction may use; the volume is then reconstructed in slabs */
+    int NProcesses; /* Local processes reconstructing a slab each (1: a single process) */
+    double MemoryLimit; /* If > 0, memory (MB) to fit in by choosing lower-memory options (see PlanMemory3D) */
+    double RuntimeMargin; /* If > 0, memory (MB) of the program, libraries and thread stacks in the memory plan */
+    char PlanOnly; /* Print the memory plan and stop */
+    char ScalarWeights; /* Set when the weights are all ScalarWeight: a single slice of them is held */
+    float ScalarWeight;
 };
 
 void Initialize_Image(
 	struct Image3D *Image,
-	struct CmdLineMBIR *cmdline,
+	char *InitImageDataFile,
 	char *ImageReconMask,
 	float InitValue,
 	float OutsideROIValue);
@@ -28,6 +50,14 @@ void readSystemParams(
 	struct ImageParams3D *imgparams,
 	struct SinoParams3DParallel *sinoparams,
 	struct ReconParams *reconparams);
+void SetupSysMatrix3D(
+	struct CmdLineMBIR *cmdline,
+	struct SinoParams3DParallel *sinoparams,
+	struct ImageParams3D *imgparams,
+	struct SysMatrix2D *A,
+	struct SysMatrixGeom3DParallel *geom,
+	float ***pix_prof);
+void FreeSysMatrix3D(struct CmdLineMBIR *cmdline, struct SysMatrix2D *A, struct SysMatrixGeom3DParallel *geom, float **pix_prof);
 void NormalizePriorWeights3D(struct ReconParams *reconparams);
 void readCmdLineMBIR(int argc, char *argv[], struct CmdLineMBIR *cmdline);
 void PrintCmdLineUsage(char *ExecFileName);
@@ -1,13 +1,19 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <omp.h>
 
 #include "MBIRModularDefs.h"
 #include "MBIRModularUtils.h"
 #include "allocate.h"
 #include "initialize_3D.h"
 #include "recon_3D.h"
+#include "A_comp_3D.h"
+#include "slab_3D.h"
+#include "memory_3D.h"
 
+static struct Sino3DParallel DatasetSino3D(struct Sino3DParallel *sinogram, int NSlices, int k);
+static struct Image3D DatasetImage3D(struct Image3D *Image, int Nz, int k);
 
 int main(int argc, char *argv[])
 {
@@ -16,101 +22,238 @@ int main(int argc, char *argv[])
     struct Sino3DParallel sinogram;
     struct ReconParams reconparams;
     struct SysMatrix2D A;
+    struct SysMatrixGeom3DParallel geom; /* for the matrix-free mode */
+    float **pix_prof;
     struct CmdLineMBIR cmdline;
+    struct SlabComm3D comm;   /* Processes reconstructing a slab of the volume each */
+    struct MemoryPlan3D plan;
     
     char *ImageReconMask; /* Image reconstruction mask (determined by ROI) */
     float InitValue ;     /* Image data initial condition is read in from a file if available ... */
                           /* else intialize it to a uniform image with value InitValue */
     float OutsideROIValue;/* Image pixel value outside ROI Radius */
+    struct Sino3DParallel DatasetSino;
+    struct Image3D DatasetImage;
+    int Nz, k;
+    float **AX;           /* Forward projection of the initial image */
     
     /* read command line */
     readCmdLineMBIR(argc, argv, &cmdline);
+
+    /* Started with mpirun, this is one of the ranks */
+    SlabCommInit3D(&comm, &argc, &argv);
     
     /* read parameters */
     readSystemParams(&cmdline, &Image.imgparams, &sinogram.sinoparams, &reconparams);
 
     /* The image parameters specify the relevant slice range to reconstruct, so re-set the  */
     /* relevant sinogram parameters so it pulls the correct slices/weights and indexes them consistently */
-    sinogram.sinoparams.NSlices = Image.imgparams.Nz;
+    /* The datasets of a batch are stacked along z, Nz slices each, and reconstructed together */
+    Nz = Image.imgparams.Nz;
+    sinogram.sinoparams.NSlices = Nz*cmdline.NDatasets;
     sinogram.sinoparams.FirstSliceNumber = Image.imgparams.FirstSliceNumber;
-    
-    /* Read Sinogram and Weights */
-    if(AllocateSinoData3DParallel(&sinogram))
-    {   fprintf(stderr, "Error in allocating sinogram data (and weights) memory through function AllocateSinoData3DParallel \n");
-        exit(-1);
+    reconparams.NDatasets = cmdline.NDatasets;
+    if(cmdline.NDatasets > 1)
+    {
+        /* Lockstep over the datasets: each column read serves the voxels of all of them. The threads */
+        /* then share the super-voxels of the slice (automatic ones if SVLength is -1) */
+        fprintf(stdout, "Reconstructing a batch of %d datasets with voxel-line updates over super-voxels\n", cmdline.NDatasets);
+        reconparams.VoxelLines = 1;
     }
-    if(ReadSinoData3DParallel(cmdline.SinoDataFile, &sinogram))
-    {   fprintf(stderr, "Error in reading sinogram data from file %s through function ReadSinoData3DParallel \n",cmdline.SinoDataFile);
-        exit(-1);
+    else if(cmdline.NCacheColumns >= 0 && Nz > 1 && !reconparams.VoxelLines)
+    {
+        /* Matrix-free: a column computed (or copied from the cache) for a pixel serves all its slices */
+        fprintf(stdout, "Computing System Matrix columns on the fly: using voxel-line updates across the %d slices\n", Nz);
+        reconparams.VoxelLines = 1;
     }
-    if(ReadWeights3D(cmdline.SinoWeightsFile, &sinogram))
-    {   fprintf(stderr, "Error in reading sinogram weights from file %s through function ReadWeights3D \n", cmdline.SinoWeightsFile);
-        exit(-1);
+    
+    /* The memory of the reconstruction is planned before anything is allocated, choosing */
+    /* lower-memory options if a limit is set */
+    PlanMemory3D(&cmdline, &Image.imgparams, &sinogram.sinoparams, &reconparams,
+        (comm.NRanks > 1) ? comm.NRanks : cmdline.NProcesses, &plan);
+    if(cmdline.PlanOnly)
+    {
+        free((void *)sinogram.sinoparams.ViewAngles);
+        free((void *)cmdline.Dataset);
+        SlabCommFree3D(&comm);
+        return 0;
     }
 
-    /* Read Proximal map if necessary */
-    if(cmdline.ReconType == MBIR_MODULAR_RECONTYPE_PandP)
+    /* With several processes, each reconstructs a slab of the slices. They are started here, */
+    /* before any OpenMP threads are */
+    if(comm.NRanks > 1 || cmdline.NProcesses > 1)
     {
-        ProxMap.imgparams.Nx = Image.imgparams.Nx;
-        ProxMap.imgparams.Ny = Image.imgparams.Ny;
-        ProxMap.imgparams.Nz = Image.imgparams.Nz;
-        ProxMap.imgparams.FirstSliceNumber = Image.imgparams.FirstSliceNumber;
-        ProxMap.imgparams.NumSliceDigits = Image.imgparams.NumSliceDigits;
-        AllocateImageData3D(&ProxMap);
-        ReadImage3D(cmdline.ProxMapImageDataFile,&ProxMap);
-        reconparams.proximalmap = ProxMap.image;  // **ptr to proximal map image
+        if(cmdline.NDatasets > 1 || cmdline.MemoryBudget > 0)
+        {
+            fprintf(stderr, "Error : several processes can't be used with options -b or -l\n");
+            exit(-1);
+        }
+        SlabCommStart3D(&comm, cmdline.NProcesses, Image.imgparams.Nx*Image.imgparams.Ny);
+        MBIRReconstructDistributed3D(&cmdline, &Image.imgparams, &sinogram.sinoparams, reconparams, &comm);
+        PrintPeakMemory3D(&plan);
+        free((void *)sinogram.sinoparams.ViewAngles);
+        free((void *)cmdline.Dataset);
+        SlabCommFree3D(&comm);
+        return 0;
     }
-    
-    /* Read System Matrix */
-    A.Ncolumns = Image.imgparams.Nx * Image.imgparams.Ny;
-    if(ReadSysMatrix2D(cmdline.SysMatrixFile,&A))
-    {   fprintf(stderr, "Error in reading system matrix from file %s through function ReadSysMatrix2D \n",cmdline.SysMatrixFile);
-        exit(-1);
+
+    /* With a memory budget, the sinogram, weights and image are streamed slab by slab instead */
+    if(cmdline.MemoryBudget > 0)
+    {
+        MBIRReconstructSlabs3D(&cmdline, &Image.imgparams, &sinogram.sinoparams, reconparams);
+        PrintPeakMemory3D(&plan);
+        free((void *)sinogram.sinoparams.ViewAngles);
+        free((void *)cmdline.Dataset);
+        SlabCommFree3D(&comm);
+        return 0;
     }
-    
-    /* Allocate memory for image */
-    if(AllocateImageData3D(&Image))
-    {   fprintf(stderr, "Error in allocating memory for image through function AllocateImageData3D \n");
+
+    /* Sinogram and weights are read (by a team of I/O threads) while the System Matrix is read and */
+    /* the initial image is set up and forward projected, so the two sections nest parallel regions */
+    omp_set_max_active_levels(2);
+    if(cmdline.ScalarWeights)
+        AllocateSinoScalarWeights3DParallel(&sinogram, cmdline.ScalarWeight);
+    else if(AllocateSinoData3DParallel(&sinogram))
+    {   fprintf(stderr, "Error in allocating sinogram data (and weights) memory through function AllocateSinoData3DParallel \n");
         exit(-1);
     }
 
-    /* Allocate and generate recon mask based on ROIRadius--do this before image initialization */
-    ImageReconMask = GenImageReconMask(&(Image.imgparams));
+    #pragma omp parallel sections num_threads(2) private(k, DatasetSino, DatasetImage)
+    {
+        #pragma omp section
+        {
+            /* Read Sinogram and Weights */
+            for(k=0; k<cmdline.NDatasets; k++)
+            {
+                DatasetSino = DatasetSino3D(&sinogram, Nz, k);
+                if(ReadSinoData3DParallel(cmdline.Dataset[k].SinoDataFile, &DatasetSino))
+                {   fprintf(stderr, "Error in reading sinogram data from file %s through function ReadSinoData3DParallel \n",cmdline.Dataset[k].SinoDataFile);
+                    exit(-1);
+                }
+                if(!cmdline.ScalarWeights && ReadWeights3D(cmdline.Dataset[k].SinoWeightsFile, &DatasetSino))
+                {   fprintf(stderr, "Error in reading sinogram weights from file %s through function ReadWeights3D \n", cmdline.Dataset[k].SinoWeightsFile);
+                    exit(-1);
+                }
+            }
+
+            /* Read Proximal map if necessary */
+            if(cmdline.ReconType == MBIR_MODULAR_RECONTYPE_PandP)
+            {
+                ProxMap.imgparams.Nx = Image.imgparams.Nx;
+                ProxMap.imgparams.Ny = Image.imgparams.Ny;
+                ProxMap.imgparams.Nz = Nz; /* Image.imgparams.Nz is set by the other section */
+                ProxMap.imgparams.FirstSliceNumber = Image.imgparams.FirstSliceNumber;
+                ProxMap.imgparams.NumSliceDigits = Image.imgparams.NumSliceDigits;
+                AllocateImageData3D(&ProxMap);
+                ReadImage3D(cmdline.ProxMapImageDataFile,&ProxMap);
+                reconparams.proximalmap = ProxMap.image;  // **ptr to proximal map image
+            }
+        }
+
+        #pragma omp section
+        {
+            /* Read System Matrix, or set up computing its columns on the fly */
+            SetupSysMatrix3D(&cmdline, &sinogram.sinoparams, &Image.imgparams, &A, &geom, &pix_prof);
+    
+            /* Allocate memory for image */
+            Image.imgparams.Nz = Nz*cmdline.NDatasets;
+            if(AllocateImageData3D(&Image))
+            {   fprintf(stderr, "Error in allocating memory for image through function AllocateImageData3D \n");
+                exit(-1);
+            }
+
+            /* Allocate and generate recon mask based on ROIRadius--do this before image initialization */
+            ImageReconMask = GenImageReconMask(&(Image.imgparams));
+
+            /* Initialize image and reconstruction mask */
+            InitValue = reconparams.InitImageValue;
+            OutsideROIValue = 0;
+            for(k=0; k<cmdline.NDatasets; k++)
+            {
+                DatasetImage = DatasetImage3D(&Image, Nz, k);
+                Initialize_Image(&DatasetImage, cmdline.Dataset[k].InitImageDataFile, ImageReconMask, InitValue, OutsideROIValue);
+            }
 
-    /* Initialize image and reconstruction mask */
-    InitValue = reconparams.InitImageValue;
-    OutsideROIValue = 0;
-    Initialize_Image(&Image, &cmdline, ImageReconMask, InitValue, OutsideROIValue);
+            /* The forward projection doesn't need the sinogram, unless the error replaces it */
+            AX = reconparams.InPlaceError ? NULL : ForwardProjection3D(&Image, &A);
+        }
+    }
     
     /* MBIR - Reconstruction */
-    MBIRReconstruct3D(&Image,&sinogram,reconparams,&A,ImageReconMask);
+    MBIRReconstruct3D(&Image,&sinogram,reconparams,&A,ImageReconMask,AX,NULL);
     
-    /* Write out reconstructed image */
-    if(WriteImage3D(cmdline.ReconImageDataFile, &Image))
+    /* The image is written out (by a team of I/O threads) while the rest is freed */
+    #pragma omp parallel sections num_threads(2) private(k, DatasetImage)
     {
-        fprintf(stderr, "Error in writing out reconstructed image file through function WriteImage3D \n");
-        exit(-1);
+        #pragma omp section
+        {
+            /* Write out reconstructed image */
+            for(k=0; k<cmdline.NDatasets; k++)
+            {
+                DatasetImage = DatasetImage3D(&Image, Nz, k);
+                if(IsVolume3D(cmdline.Dataset[k].SinoDataFile,"3Dsinodata"))
+                {
+                    if(WriteImageVolume3D(cmdline.Dataset[k].ReconImageDataFile, &DatasetImage))
+                    {
+                        fprintf(stderr, "Error in writing out reconstructed image file through function WriteImageVolume3D \n");
+                        exit(-1);
+                    }
+                }
+                else if(WriteImage3D(cmdline.Dataset[k].ReconImageDataFile, &DatasetImage))
+                {
+                    fprintf(stderr, "Error in writing out reconstructed image file through function WriteImage3D \n");
+                    exit(-1);
+                }
+            }
+        }
+
+        #pragma omp section
+        {
+            /* free sinogram and system matrix memory allocation */
+            if(FreeSinoData3DParallel(&sinogram))
+            {  fprintf(stderr, "Error sinogram memory could not be freed through function FreeSinoData3DParallel \n");
+                exit(-1);
+            }
+            FreeSysMatrix3D(&cmdline, &A, &geom, pix_prof);
+            if(cmdline.ReconType == MBIR_MODULAR_RECONTYPE_PandP)
+               FreeImageData3D(&ProxMap);
+        }
     }
-        
-    /* free image, sinogram and system matrix memory allocation */
+
+    /* free image memory allocation */
     if(FreeImageData3D(&Image))
     {  fprintf(stderr, "Error image memory could not be freed through function FreeImageData3D \n");
         exit(-1);
     }
-    if(FreeSinoData3DParallel(&sinogram))
-    {  fprintf(stderr, "Error sinogram memory could not be freed through function FreeSinoData3DParallel \n");
-        exit(-1);
-    }
-    if(FreeSysMatrix2D(&A))
-    {  fprintf(stderr, "Error System Matrix memory could not be freed through function FreeSysMatrix3D \n");
-        exit(-1);
-    }
-    if(cmdline.ReconType == MBIR_MODULAR_RECONTYPE_PandP)
-       FreeImageData3D(&ProxMap);
     
     free((void *)ImageReconMask);
+    free((void *)cmdline.Dataset);
+    PrintPeakMemory3D(&plan);
+    SlabCommFree3D(&comm);
     
     return 0;
 }
 
 
+/* Sinogram of dataset k of a batch stacked along z, sharing the data of the whole */
+static struct Sino3DParallel DatasetSino3D(struct Sino3DParallel *sinogram, int NSlices, int k)
+{
+    struct Sino3DParallel DatasetSino = *sinogram;
+
+    DatasetSino.sinoparams.NSlices = NSlices;
+    DatasetSino.sino = &sinogram->sino[k*NSlices];
+    DatasetSino.weight = &sinogram->weight[k*NSlices];
+    return DatasetSino;
+}
+
+/* Image of dataset k of a batch stacked along z, sharing the data of the whole */
+static struct Image3D DatasetImage3D(struct Image3D *Image, int Nz, int k)
+{
+    struct Image3D DatasetImage = *Image;
+
+    DatasetImage.imgparams.Nz = Nz;
+    DatasetImage.image = &Image->image[k*Nz];
+    return DatasetImage;
+}
+
+
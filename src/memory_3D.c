@@ -0,0 +1,321 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <omp.h>
+#include <sys/resource.h>
+
+#include "MBIRModularDefs.h"
+#include "MBIRModularUtils.h"
+#include "initialize_3D.h"
+#include "A_comp_3D.h"
+#include "recon_3D.h"
+#include "comm_3D.h"
+#include "memory_3D.h"
+
+#define BYTES_PER_MB (1024.0*1024.0)
+
+/* Default estimate of the memory that isn't allocated by the reconstruction itself: program, */
+/* libraries and stdio buffers for the process (and MPI, from SlabCommRuntimeBytes3D), and the stack */
+/* and allocator arena each thread touches. These are the peak memory (PrintPeakMemory3D) of small */
+/* reconstructions on Linux with glibc less what they planned, rounded up; --runtime-margin replaces */
+/* the estimate where the runtime differs (see RuntimeMemory3D) */
+#define RUNTIME_BYTES (4L*1024*1024)
+#define THREAD_RUNTIME_BYTES (512L*1024)
+
+/* Up to this many voxels are sampled for the NH-ICD threshold (NHICD_MAX_SAMPLES of recon_3D.c) */
+#define NHICD_SAMPLE_BYTES (100001L*sizeof(float))
+
+static long SysMatrixFootprint3D(struct CmdLineMBIR *cmdline, struct SinoParams3DParallel *sinoparams, struct ImageParams3D *imgparams, char *Bound);
+static int UniformDatasetWeights3D(struct CmdLineMBIR *cmdline, struct ImageParams3D *imgparams, struct SinoParams3DParallel *sinoparams, float *weight);
+static void SlabMemoryPlan3D(struct MemoryPlan3D *plan, double MemoryLimit, long SysMatrixBytes, long RuntimeBytes, char ScalarWeights,
+    struct ImageParams3D *imgparams, struct SinoParams3DParallel *sinoparams, struct ReconParams *reconparams);
+
+
+void ComputeMemoryPlan3D(
+    struct MemoryPlan3D *plan,
+    int NSlices,
+    int NHalo,
+    long SysMatrixBytes,
+    long RuntimeBytes,
+    char ScalarWeights,
+    struct ImageParams3D *imgparams,
+    struct SinoParams3DParallel *sinoparams,
+    struct ReconParams *reconparams)
+{
+    long SinoSliceBytes, Nxy, VoxelBytes, NSV, NLine, ColumnChannels, BandChannels;
+
+    SinoSliceBytes = (long)sinoparams->NViews * sinoparams->NChannels * sizeof(float);
+    Nxy = (long)imgparams->Nx * imgparams->Ny;
+
+    plan->NSlices = NSlices;
+    plan->NHalo = NHalo;
+    plan->NThreads = omp_get_max_threads();
+    plan->SVLength = SuperVoxelLength3D(reconparams, NSlices);
+    plan->InPlaceError = reconparams->InPlaceError;
+    plan->ScalarWeights = ScalarWeights;
+
+    plan->Sino = NSlices*SinoSliceBytes;
+    plan->Weight = (ScalarWeights ? 1 : NSlices)*SinoSliceBytes;
+    plan->Error = (reconparams->InPlaceError ? 0 : NSlices*SinoSliceBytes);
+    plan->VoxelLines = (reconparams->VoxelLines ? 2*NSlices*SinoSliceBytes : 0);
+    plan->Image = (NSlices + NHalo)*Nxy*sizeof(float) + Nxy*sizeof(char);
+    plan->ProxMap = (reconparams->ReconType == MBIR_MODULAR_RECONTYPE_PandP ? NSlices*Nxy*sizeof(float) : 0);
+
+    /* Order of the updates, and theta2, update magnitudes and zero-skipping flags if used */
+    VoxelBytes = sizeof(int);
+    if (reconparams->CacheTheta2)
+        VoxelBytes += sizeof(float);
+    if (reconparams->NHICD)
+        VoxelBytes += sizeof(float);
+    if (reconparams->ZeroSkip && reconparams->ReconType == MBIR_MODULAR_RECONTYPE_QGGMRF_3D)
+        VoxelBytes += sizeof(char);
+    plan->Voxel = NSlices*Nxy*VoxelBytes;
+
+    /* The pixels of a column, and those of a super-voxel, fall within a band of channels per view */
+    /* no wider than their diagonal, plus a partial channel at each end */
+    ColumnChannels = (long)ceil(sqrt(2.0)*imgparams->Deltaxy/sinoparams->DeltaChannel) + 2;
+    NSV = 1;
+    BandChannels = 0;
+    if (plan->SVLength > 0)
+    {
+        NSV = (long)((imgparams->Nx + plan->SVLength - 1)/plan->SVLength) * ((imgparams->Ny + plan->SVLength - 1)/plan->SVLength);
+        BandChannels = (long)ceil(sqrt(2.0)*plan->SVLength*imgparams->Deltaxy/sinoparams->DeltaChannel) + 2;
+        if (BandChannels > sinoparams->NChannels)
+            BandChannels = sinoparams->NChannels;
+    }
+    if (ColumnChannels > sinoparams->NChannels)
+        ColumnChannels = sinoparams->NChannels;
+
+    /* Super-voxel pixels and bands, the queue with its order and flags, the offsets of the views, */
+    /* and the voxels sampled for NH-ICD */
+    NLine = reconparams->VoxelLines ? NSlices : 1;
+    plan->Queue = (NSV + 1 + Nxy)*sizeof(int) + (plan->SVLength > 0 ? 2*NSV*sinoparams->NViews*sizeof(int) : 0)
+                + NSlices*NSV*sizeof(int) + (reconparams->VoxelLines ? 1 : NSlices)*NSV*(sizeof(int) + 2*sizeof(char))
+                + sinoparams->NViews*sizeof(long) + (reconparams->NHICD ? NHICD_SAMPLE_BYTES : 0);
+
+    /* For each thread: a copy of the error sinogram, weights and initial error of the band of its */
+    /* super-voxel with its offsets, theta1, theta2 and the updates of voxel lines, and a scratch column */
+    plan->Thread = plan->NThreads*(3*BandChannels*sinoparams->NViews*NLine*sizeof(float)
+                + (plan->SVLength > 0 ? sinoparams->NViews*sizeof(long) : 0)
+                + (reconparams->VoxelLines ? 3*NLine*sizeof(float) : 0)
+                + ColumnChannels*sinoparams->NViews*(sizeof(struct SparseRun) + sizeof(float)));
+
+    plan->SysMatrix = SysMatrixBytes;
+    plan->Runtime = RuntimeBytes;
+    plan->Total = plan->Sino + plan->Weight + plan->Error + plan->VoxelLines + plan->Image + plan->ProxMap
+                + plan->Voxel + plan->Queue + plan->Thread + plan->SysMatrix + plan->Runtime;
+}
+
+/* The memory of a slab grows about linearly with its slices, halo slices included. Super-voxels */
+/* may only be chosen for small slabs, so the estimate is checked and lowered until it fits */
+int MemoryPlanSlabSlices3D(
+    double MemoryLimit,
+    long SysMatrixBytes,
+    long RuntimeBytes,
+    char ScalarWeights,
+    struct ImageParams3D *imgparams,
+    struct SinoParams3DParallel *sinoparams,
+    struct ReconParams *reconparams)
+{
+    struct MemoryPlan3D one, two, plan;
+    long SliceBytes, FixedBytes, NSlices, Limit;
+
+    Limit = (long)(MemoryLimit*BYTES_PER_MB);
+    ComputeMemoryPlan3D(&one, 1, 2, SysMatrixBytes, RuntimeBytes, ScalarWeights, imgparams, sinoparams, reconparams);
+    ComputeMemoryPlan3D(&two, 2, 2, SysMatrixBytes, RuntimeBytes, ScalarWeights, imgparams, sinoparams, reconparams);
+    SliceBytes = two.Total - one.Total;
+    if (SliceBytes < 1)
+        SliceBytes = 1;
+    FixedBytes = one.Total - SliceBytes;
+
+    NSlices = (Limit - FixedBytes)/SliceBytes;
+    if (NSlices > imgparams->Nz)
+        NSlices = imgparams->Nz;
+    for (; NSlices > 0; NSlices--)
+    {
+        ComputeMemoryPlan3D(&plan, (int)NSlices, 2, SysMatrixBytes, RuntimeBytes, ScalarWeights, imgparams, sinoparams, reconparams);
+        if (plan.Total <= Limit)
+            break;
+    }
+    return (int)((NSlices > 0) ? NSlices : 0);
+}
+
+/* Plan of the largest slab of MBIRReconstructSlabs3D, which balances the slabs; at least a slice */
+static void SlabMemoryPlan3D(
+    struct MemoryPlan3D *plan,
+    double MemoryLimit,
+    long SysMatrixBytes,
+    long RuntimeBytes,
+    char ScalarWeights,
+    struct ImageParams3D *imgparams,
+    struct SinoParams3DParallel *sinoparams,
+    struct ReconParams *reconparams)
+{
+    int Nz, NSlabSlices, NSlabs;
+
+    Nz = imgparams->Nz;
+    NSlabSlices = MemoryPlanSlabSlices3D(MemoryLimit, SysMatrixBytes, RuntimeBytes, ScalarWeights, imgparams, sinoparams, reconparams);
+    if (NSlabSlices < 1)
+        NSlabSlices = 1;
+    NSlabs = (Nz + NSlabSlices - 1)/NSlabSlices;
+    NSlabSlices = (Nz + NSlabs - 1)/NSlabs;
+    ComputeMemoryPlan3D(plan, NSlabSlices, (NSlabs > 1) ? 2 : 0, SysMatrixBytes, RuntimeBytes, ScalarWeights, imgparams, sinoparams, reconparams);
+}
+
+long RuntimeMemory3D(struct CmdLineMBIR *cmdline)
+{
+    if (cmdline->RuntimeMargin > 0)
+        return (long)(cmdline->RuntimeMargin*BYTES_PER_MB);
+    return RUNTIME_BYTES + SlabCommRuntimeBytes3D() + omp_get_max_threads()*THREAD_RUNTIME_BYTES;
+}
+
+/* Memory of the System Matrix that SetupSysMatrix3D will set up. *Bound is set if it is an upper bound */
+static long SysMatrixFootprint3D(
+    struct CmdLineMBIR *cmdline,
+    struct SinoParams3DParallel *sinoparams,
+    struct ImageParams3D *imgparams,
+    char *Bound)
+{
+    char fname[1000], path[1024];
+    FILE *fp;
+
+    *Bound = 0;
+    if (cmdline->NCacheColumns >= 0)
+        return SysMatrixBytes3DParallel(sinoparams, imgparams, cmdline->NCacheColumns);
+    if (cmdline->SysMatrixCacheDir[0] == '\0')
+        return SysMatrix2DFootprint(cmdline->SysMatrixFile, imgparams->Nx*imgparams->Ny, sinoparams->NViews);
+
+    CachedSysMatrixName3DParallel(fname, cmdline->SysMatrixCacheDir, sinoparams, imgparams, cmdline->Projector);
+    sprintf(path, "%s.2Dsysmatrix", fname);
+    if ((fp = fopen(path, "r")) != NULL)
+    {
+        fclose(fp);
+        return SysMatrix2DFootprint(fname, imgparams->Nx*imgparams->Ny, sinoparams->NViews);
+    }
+    *Bound = 1;
+    return SysMatrixBytes3DParallel(sinoparams, imgparams, -1);
+}
+
+/* Whether the weights of all datasets are the same value */
+static int UniformDatasetWeights3D(
+    struct CmdLineMBIR *cmdline,
+    struct ImageParams3D *imgparams,
+    struct SinoParams3DParallel *sinoparams,
+    float *weight)
+{
+    struct SinoParams3DParallel params;
+    float DatasetWeight;
+    int k;
+
+    params = *sinoparams;
+    params.NSlices = imgparams->Nz;
+    for (k = 0; k < cmdline->NDatasets; k++)
+    {
+        if (!UniformWeights3D(cmdline->Dataset[k].SinoWeightsFile, &params, &DatasetWeight))
+            return 0;
+        if (k > 0 && DatasetWeight != *weight)
+            return 0;
+        *weight = DatasetWeight;
+    }
+    return 1;
+}
+
+/* Memory planning */
+/* All that is held in proportion to the slices reconstructed at once, the System Matrix, the tables */
+/* and thread buffers of the reconstruction, and an allowance for the runtime are counted. The */
+/* options are tried from the one that costs nothing to the one that slows down the reconstruction: */
+/* the error sinogram replaces the sinogram, which is not needed after the first forward projection; */
+/* the weights are held as a single slice if they are all the same, which takes a pass over the */
+/* weights files to find out; the slices are reconstructed in slabs, which only a single dataset in */
+/* a single process can be */
+void PlanMemory3D(
+    struct CmdLineMBIR *cmdline,
+    struct ImageParams3D *imgparams,
+    struct SinoParams3DParallel *sinoparams,
+    struct ReconParams *reconparams,
+    int NProcesses,
+    struct MemoryPlan3D *plan)
+{
+    long SysMatrixBytes, RuntimeBytes, Limit;
+    int NSlices, NHalo;
+    char Bound;
+
+    SysMatrixBytes = SysMatrixFootprint3D(cmdline, sinoparams, imgparams, &Bound);
+    RuntimeBytes = RuntimeMemory3D(cmdline);
+
+    /* Slices held at once by this process */
+    NSlices = imgparams->Nz*cmdline->NDatasets;
+    NHalo = 0;
+    if (NProcesses > 1)
+    {
+        NSlices = (imgparams->Nz + NProcesses - 1)/NProcesses;
+        NHalo = 2;
+    }
+    if (NProcesses <= 1 && cmdline->MemoryBudget > 0)
+        SlabMemoryPlan3D(plan, cmdline->MemoryBudget, SysMatrixBytes, RuntimeBytes, cmdline->ScalarWeights, imgparams, sinoparams, reconparams);
+    else
+        ComputeMemoryPlan3D(plan, NSlices, NHalo, SysMatrixBytes, RuntimeBytes, cmdline->ScalarWeights, imgparams, sinoparams, reconparams);
+
+    Limit = (long)(cmdline->MemoryLimit*BYTES_PER_MB);
+    if (cmdline->MemoryLimit > 0 && plan->Total > Limit && !reconparams->InPlaceError)
+    {
+        reconparams->InPlaceError = 1;
+        ComputeMemoryPlan3D(plan, NSlices, NHalo, SysMatrixBytes, RuntimeBytes, cmdline->ScalarWeights, imgparams, sinoparams, reconparams);
+        fprintf(stdout, "To fit in %.1f MB: the error sinogram replaces the sinogram\n", cmdline->MemoryLimit);
+    }
+    if (cmdline->MemoryLimit > 0 && plan->Total > Limit && !cmdline->ScalarWeights
+        && UniformDatasetWeights3D(cmdline, imgparams, sinoparams, &cmdline->ScalarWeight))
+    {
+        cmdline->ScalarWeights = 1;
+        ComputeMemoryPlan3D(plan, NSlices, NHalo, SysMatrixBytes, RuntimeBytes, cmdline->ScalarWeights, imgparams, sinoparams, reconparams);
+        fprintf(stdout, "To fit in %.1f MB: all weights are %g, a single slice of them is held\n", cmdline->MemoryLimit, cmdline->ScalarWeight);
+    }
+    if (cmdline->MemoryLimit > 0 && plan->Total > Limit && NProcesses <= 1 && cmdline->NDatasets == 1)
+    {
+        cmdline->MemoryBudget = cmdline->MemoryLimit;
+        SlabMemoryPlan3D(plan, cmdline->MemoryBudget, SysMatrixBytes, RuntimeBytes, cmdline->ScalarWeights, imgparams, sinoparams, reconparams);
+        fprintf(stdout, "To fit in %.1f MB: the slices are reconstructed in slabs of up to %d\n", cmdline->MemoryLimit, plan->NSlices);
+    }
+    plan->SysMatrixBound = Bound;
+
+    PrintMemoryPlan3D(plan);
+    if (cmdline->MemoryLimit > 0 && plan->Total > Limit)
+    {
+        fprintf(stderr, "Error : the reconstruction takes %.1f MB, more than the memory limit of %.1f MB\n",
+            plan->Total/BYTES_PER_MB, cmdline->MemoryLimit);
+        exit(-1);
+    }
+}
+
+void PrintMemoryPlan3D(struct MemoryPlan3D *plan)
+{
+    fprintf(stdout, "\nMEMORY PLAN (%d slices at once", plan->NSlices);
+    if (plan->NHalo)
+        fprintf(stdout, ", and %d halo slices", plan->NHalo);
+    fprintf(stdout, "):\n");
+    fprintf(stdout, " - Sinogram                                              = %10.1f MB\n", plan->Sino/BYTES_PER_MB);
+    fprintf(stdout, " - Weights                                               = %10.1f MB%s\n", plan->Weight/BYTES_PER_MB,
+        plan->ScalarWeights ? " (a single slice)" : "");
+    fprintf(stdout, " - Error sinogram                                        = %10.1f MB%s\n", plan->Error/BYTES_PER_MB,
+        plan->InPlaceError ? " (in place of the sinogram)" : "");
+    fprintf(stdout, " - Error sinogram and weights for voxel lines            = %10.1f MB\n", plan->VoxelLines/BYTES_PER_MB);
+    fprintf(stdout, " - Image and reconstruction mask                         = %10.1f MB\n", plan->Image/BYTES_PER_MB);
+    fprintf(stdout, " - Proximal map                                          = %10.1f MB\n", plan->ProxMap/BYTES_PER_MB);
+    fprintf(stdout, " - Update order, theta2 and other per-voxel arrays       = %10.1f MB\n", plan->Voxel/BYTES_PER_MB);
+    fprintf(stdout, " - Super-voxel tables and update queue                   = %10.1f MB\n", plan->Queue/BYTES_PER_MB);
+    fprintf(stdout, " - Buffers of %3d threads (bands, voxel lines, columns)  = %10.1f MB\n", plan->NThreads, plan->Thread/BYTES_PER_MB);
+    fprintf(stdout, " - System Matrix                                         = %10.1f MB%s\n", plan->SysMatrix/BYTES_PER_MB,
+        plan->SysMatrixBound ? " (at most; not in the cache yet)" : "");
+    fprintf(stdout, " - Program, libraries and thread stacks (runtime margin) = %10.1f MB\n", plan->Runtime/BYTES_PER_MB);
+    fprintf(stdout, " - Total                                                 = %10.1f MB\n\n", plan->Total/BYTES_PER_MB);
+}
+
+void PrintPeakMemory3D(struct MemoryPlan3D *plan)
+{
+    struct rusage usage;
+
+    if (getrusage(RUSAGE_SELF, &usage) != 0)
+        return;
+    /* ru_maxrss is in kilobytes */
+    fprintf(stdout, "Peak memory: %.1f MB (planned %.1f MB)\n", usage.ru_maxrss/1024.0, plan->Total/BYTES_PER_MB);
+}
@@ -0,0 +1,77 @@
+#ifndef _MEMORY_3D_H_
+#define _MEMORY_3D_H_
+
+#include "MBIRModularDefs.h"
+#include "initialize_3D.h"
+
+/* Memory (bytes) taken by a reconstruction of NSlices slices at once, by what it is held in */
+struct MemoryPlan3D
+{
+    int NSlices;            /* Slices reconstructed at once: all of them, or those of a slab or of a process */
+    int NHalo;              /* Halo slices held around them */
+    int NThreads;           /* Threads of the reconstruction */
+    int SVLength;           /* Side of the super-voxels (0: voxel-wise ICD) */
+    char InPlaceError;      /* The error sinogram replaces the sinogram */
+    char ScalarWeights;     /* A single slice of weights is held */
+    char SysMatrixBound;    /* SysMatrix is an upper bound: the matrix isn't in the cache yet */
+    long Sino;              /* Sinogram */
+    long Weight;            /* Weights */
+    long Error;             /* Error sinogram, 0 if it replaces the sinogram */
+    long VoxelLines;        /* Copies of the error sinogram and weights for voxel lines */
+    long Image;             /* Image with the halo slices, and the reconstruction mask */
+    long ProxMap;           /* Proximal map for Plug & Play */
+    long Voxel;             /* Other arrays of MBIRReconstruct3D with an entry per voxel */
+    long Queue;             /* Super-voxel tables, update queue and other tables of MBIRReconstruct3D */
+    long Thread;            /* Buffers of the threads: super-voxel bands, voxel lines and scratch columns */
+    long SysMatrix;         /* System Matrix */
+    long Runtime;           /* Program, libraries, thread stacks and allocator overhead (RuntimeMemory3D) */
+    long Total;
+};
+
+/* Fill plan for reconstructing NSlices slices with NHalo halo slices, with the options of reconparams, */
+/* a System Matrix of SysMatrixBytes and RuntimeBytes for the runtime */
+void ComputeMemoryPlan3D(
+	struct MemoryPlan3D *plan,
+	int NSlices,
+	int NHalo,
+	long SysMatrixBytes,
+	long RuntimeBytes,
+	char ScalarWeights,
+	struct ImageParams3D *imgparams,
+	struct SinoParams3DParallel *sinoparams,
+	struct ReconParams *reconparams);
+
+/* Number of slices of a slab that fits in MemoryLimit (MB) together with the System Matrix, */
+/* at most imgparams->Nz; 0 if not even a single slice fits */
+int MemoryPlanSlabSlices3D(
+	double MemoryLimit,
+	long SysMatrixBytes,
+	long RuntimeBytes,
+	char ScalarWeights,
+	struct ImageParams3D *imgparams,
+	struct SinoParams3DParallel *sinoparams,
+	struct ReconParams *reconparams);
+
+/* Plan the memory of the reconstruction set up by cmdline (by each of NProcesses processes) before */
+/* anything is allocated, from the parameters and the header of the System Matrix file, and print it */
+/* With cmdline->MemoryLimit, lower-memory options are chosen until it fits, or else it exits: */
+/* reconparams->InPlaceError, then cmdline->ScalarWeights if the weights are all the same, then slabs */
+/* with cmdline->MemoryBudget */
+void PlanMemory3D(
+	struct CmdLineMBIR *cmdline,
+	struct ImageParams3D *imgparams,
+	struct SinoParams3DParallel *sinoparams,
+	struct ReconParams *reconparams,
+	int NProcesses,
+	struct MemoryPlan3D *plan);
+
+/* Memory (bytes) of the program, libraries and thread stacks, which the reconstruction doesn't */
+/* allocate itself: cmdline->RuntimeMargin if set, else an estimate for the threads (and MPI) */
+long RuntimeMemory3D(struct CmdLineMBIR *cmdline);
+
+void PrintMemoryPlan3D(struct MemoryPlan3D *plan);
+
+/* Print the peak memory of this process, next to the plan */
+void PrintPeakMemory3D(struct MemoryPlan3D *plan);
+
+#endif
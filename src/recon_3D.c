@@ -2,7 +2,10 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <math.h>
+#include <string.h>
 #include <time.h>
+#include <sched.h>
+#include <omp.h>
 
 #include "MBIRModularDefs.h"
 #include "MBIRModularUtils.h"
@@ -12,36 +15,104 @@
 
 #define EPSILON 0.0000001
 
+/* Non-homogeneous ICD: each full sweep is followed by NHICD_PARTIAL_SWEEPS sweeps over the */
+/* NHICD_FRACTION of voxels with the largest last update, estimated from up to NHICD_MAX_SAMPLES voxels */
+#define NHICD_PARTIAL_SWEEPS 4
+#define NHICD_FRACTION 0.2
+#define NHICD_MAX_SAMPLES 100000
+
+/* Zero-skipping: every ZERO_SKIP_REVALIDATE sweeps, the skipped voxels are updated again */
+#define ZERO_SKIP_REVALIDATE 4
+
+/* Super-voxel side chosen when SVLength is MBIR_MODULAR_SVLENGTH_AUTO */
+#define AUTO_SV_LENGTH 8
+
+/* Columns fetched together by the threads of the forward projection */
+#define FORWARD_BLOCK_COLUMNS 64
+
+/* Queue of the (slice, super-voxel) updates of an iteration, shared by the threads */
+struct SVQueue
+{
+    int *Item;      /* [n] jz*NSV + s, in the order of updates */
+    char *Taken;    /* [n] item n has been handed out */
+    char *Active;   /* [jz*NSV + s] super-voxel s of slice jz is being updated */
+    int Nitems;
+    int Head;       /* All items before Head have been handed out */
+    int Releases;   /* Number of items done so far, which the threads with none to take wait on */
+};
+
+static int NextSVItem3D(struct SVQueue *queue, struct SuperVoxels3D *SV, int Nz);
+static void GatherSVBand3D(struct SuperVoxels3D *SV, int s, int NViews, int NChannels, int Nline, float *e, float *w, struct SVBuffer *band);
+static double ScatterSVBand3D(struct SuperVoxels3D *SV, int s, int NViews, int NChannels, int Nline, struct SVBuffer *band, float *e);
+static char SetupVoxelUpdate3D(struct ICDInfo *icd_info, struct Image3D *Image, struct ReconParams *reconparams, int SliceIndex, int XYPixelIndex);
+/* Which voxels a sweep updates */
+struct SweepSelection
+{
+    char FullSweep;         /* If not, a partial NH-ICD sweep over the voxels with UpdateMagnitude >= NHThreshold */
+    float *UpdateMagnitude; /* |diff| of the last update of each voxel, for NH-ICD (NULL if not used) */
+    float NHThreshold;
+    char *ZeroSkip;         /* [j] voxel j and its neighbors were all zero on its last update (NULL if not used) */
+    char Revalidate;        /* Update the voxels marked in ZeroSkip too, to catch those that are zero no more */
+};
+
+static float SlabCost3D(float **e, struct Image3D *Image, struct Sino3DParallel *sinogram, struct ReconParams *reconparams, struct SlabComm3D *comm);
+static float NHICDThreshold3D(float *UpdateMagnitude, char *ImageReconMask, int Nxy, int Nz);
+static int SelectVoxel3D(struct SweepSelection *sweep, int j);
+static void RecordVoxelUpdate3D(struct SweepSelection *sweep, struct ICDInfo *icd_info, float UpdatedValue, float diff);
+static char SVSelected3D(struct SuperVoxels3D *SV, int s, int FirstSlice, int NSlices, int Nxy, char *ImageReconMask, struct SweepSelection *sweep);
+
 /* The MBIR algorithm  */
 /* Note : */
 /* 1) Image must be intialized before this function is called */
 /* 2) Image reconstruction Mask must be generated before this call */
+/* 3) AX is the forward projection of the initial image from ForwardProjection3D, e.g. computed */
+/*    while the sinogram is read. It is turned into the error sinogram and freed. If NULL, it is */
+/*    computed here */
+/*    With reconparams.InPlaceError, AX must be NULL: the error sinogram is computed in place of */
+/*    sinogram->sino, which holds the final error on return, so no other copy of it is allocated */
+/* 4) With reconparams.Halo, Image->image[-1] and Image->image[Nz] must hold the slices below and above */
+/*    the slab that is reconstructed. They are neighbors of the prior but are not updated */
+/* 5) If comm is not NULL, the slab is one of those of the processes of comm, which call this together. */
+/*    The halo slices are then received from the other slabs after every sweep, and the cost and the */
+/*    statistics of the iterations are those of the whole volume */
+/* Returns 1 if the stopping condition was reached */
 
-void MBIRReconstruct3D(
+int MBIRReconstruct3D(
                        struct Image3D *Image,
                        struct Sino3DParallel *sinogram,
                        struct ReconParams reconparams,
                        struct SysMatrix2D *A,
-                       char *ImageReconMask )
+                       char *ImageReconMask,
+                       float **AX,
+                       struct SlabComm3D *comm )
 {
-    int it, MaxIterations, j, jz, k, l, Nx, Ny, Nz, Nxy, N, i, XYPixelIndex, SliceIndex, M;
+    int it, MaxIterations, j, jz, Nx, Ny, Nz, Nxy, N, i, M, NViews, NChannels, NSV, SVLength;
+    int m, NItemsDone, NQueueSlices, Nline, NzPrior, NzTotal;
+    struct SVQueue queue;
     time_t start;
+    unsigned int seed, state;
     float **x;  /* image data (SliceIndex, XYPixelIndex) */
     float **y;  /* sinogram projections data  */
     float **e;  /* e=y-Ax, error */
     float **w;  /* projections weights data */
+    float *eT, *wT; /* e and w with the slices of each entry together, for voxel lines */
+    float *Theta2;          /* theta2 of the likelihood term of each voxel, if cached */
+    struct QGGMRFPrior prior;
   
-    float voxel, diff;
     float cost, TotalValueChange, avg_update, TotalVoxelValue, AvgVoxelValue, StopThreshold, ratio;
-    char zero_skip_FLAG;
     char stop_FLAG;
-    int *order;
-    int NumUpdatedVoxels;
+    struct SweepSelection sweep;
+    long NumZeroSkipped;    /* long: summed over the slabs of comm, it can exceed an int */
+    int *order, *svorder;
+    long *ViewOffset;
+    struct SuperVoxels3D SV;
+    long NumUpdatedVoxels;
+    double CostChange;      /* Change of the cost from the updates of an iteration */
+    double stats[5];        /* Sums over the slabs of comm */
+    char ExactCost;
     float equits=0;
     int Nmask=0;
     
-    struct ICDInfo icd_info; /* Local Cost Function Information */
-    
     x = Image->image;   /* x is the image vector */
     y = sinogram->sino;   /* y is the sinogram projections vector  */
     w = sinogram->weight; /* w is the vector of sinogram weights */
@@ -50,7 +121,9 @@ void MBIRReconstruct3D(
     Nz = Image->imgparams.Nz;
     N  = Nx*Ny*Nz;
     Nxy= Nx*Ny;
-    M = sinogram->sinoparams.NViews * sinogram->sinoparams.NChannels ;
+    NViews = sinogram->sinoparams.NViews;
+    NChannels = sinogram->sinoparams.NChannels;
+    M = NViews * NChannels ;
 
     /* Number of voxels in-slice within ROI radius */
     for(j=0;j<Nxy;j++)
@@ -60,35 +133,142 @@ void MBIRReconstruct3D(
     /********************************************/
     /* Forward Projection and Error Calculation */
     /********************************************/
-    e = (float **)multialloc(sizeof(float),2,Nz,M);	 /* error term memory allocation */
-    /* Initialize error to zero, since it is first computed as forward-projection Ax */
-    for (jz = 0; jz < Nz; jz++)
-    for (i = 0; i < M; i++)
-        e[jz][i]=0;
-
-    /* compute Ax (store it in e as of now) */
-    forwardProject3D(e, Image, A);
+    if (reconparams.InPlaceError)
+    {
+        /* e=-(-y+Ax), accumulating Ax into the negated sinogram */
+        e = y;
+        for (jz = 0; jz < Nz; jz++)
+        for (i = 0; i < M; i++)
+            e[jz][i] = -e[jz][i];
+        forwardProject3D(e, Image, A);
+        for (jz = 0; jz < Nz; jz++)
+        for (i = 0; i < M; i++)
+            e[jz][i] = -e[jz][i];
+    }
+    else
+    {
+        /* compute Ax (store it in e as of now) */
+        e = (AX != NULL) ? AX : ForwardProjection3D(Image, A);
 
-    /* Compute the initial error e=y-Ax */
-    for (jz = 0; jz < Nz; jz++)
-    for (i = 0; i < M; i++)
-        e[jz][i] = y[jz][i]-e[jz][i];
+        /* Compute the initial error e=y-Ax */
+        for (jz = 0; jz < Nz; jz++)
+        for (i = 0; i < M; i++)
+            e[jz][i] = y[jz][i]-e[jz][i];
+    }
   
     /****************************************/
     /* Iteration and convergence Parameters */
     /****************************************/
-    icd_info.Rparams = reconparams;
-    icd_info.Nxy = Nxy;
-    
     MaxIterations = reconparams.MaxIterations;
     StopThreshold = reconparams.StopThreshold;
     
-    /* Order of pixel updates need NOT be raster order, just initialize */
+    /* With super-voxels, the pixels of a super-voxel are updated together against a copy of its */
+    /* sinogram band, so the band stays in cache. Without, the slice is a single group of pixels */
+    SVLength = SuperVoxelLength3D(&reconparams, Nz);
+    if (reconparams.SVLength == MBIR_MODULAR_SVLENGTH_AUTO && SVLength > 0)
+        fprintf(stdout, "Using super-voxels of side %d (SVLength -1, %d slices, %d threads)\n", SVLength, Nz, omp_get_max_threads());
+    ComputeSuperVoxels3D(&SV, SVLength, Nx, Ny, ImageReconMask, A);
+    NSV = SV.NSV;
+    ViewOffset = (long *)get_spc(NViews, sizeof(long));
+    for (i = 0; i < NViews; i++)
+        ViewOffset[i] = (long)i*NChannels;
+
+    QGGMRF_InitPrior(&prior, &reconparams);
+
+    /* theta2 of the likelihood term only depends on A and w, so it is computed once for all iterations */
+    Theta2 = NULL;
+    if (reconparams.CacheTheta2)
+    {
+        Theta2 = (float *)get_spc(N, sizeof(float));
+        ComputeTheta2_3D(w, A, ViewOffset, Nxy, Nz, ImageReconMask, Theta2);
+    }
+
+    /* With voxel lines, the Nz voxels of a pixel are updated one after the other, so that each column */
+    /* is read once for all of them. e and w are then kept with the slices of each entry together, */
+    /* and the items of the queue below are super-voxels of all slices at once */
+    eT = wT = NULL;
+    NQueueSlices = Nz;
+    Nline = 1;
+    if (reconparams.VoxelLines)
+    {
+        eT = (float *)get_spc((size_t)M*Nz, sizeof(float));
+        wT = (float *)get_spc((size_t)M*Nz, sizeof(float));
+        for (i = 0; i < M; i++)
+        for (jz = 0; jz < Nz; jz++)
+        {
+            eT[(long)i*Nz + jz] = e[jz][i];
+            wT[(long)i*Nz + jz] = w[jz][i];
+        }
+        NQueueSlices = 1;
+        Nline = Nz;
+    }
+
+    /* Order of pixel updates within each slice need NOT be raster order, just initialize */
+    /* Pixels are kept grouped by super-voxel, and super-voxels are visited in their own order */
     order = (int *)get_spc(N, sizeof(int));
     for (j = 0; j < N; j++)
-        order[j] = j;
+        order[j] = SV.Pixel[j%Nxy];
+    svorder = (int *)get_spc((size_t)Nz*NSV, sizeof(int));
+    for (j = 0; j < Nz*NSV; j++)
+        svorder[j] = j%NSV;
     
+    /* The (slice, super-voxel) updates of an iteration are put in a queue in random order, and each */
+    /* thread takes the next one that has no prior neighbors being updated by another thread, i.e. */
+    /* none of the super-voxels around it in its slice and in the adjacent slices is active. So */
+    /* several super-voxels of one slice are updated concurrently when Nz is small. Their sinogram */
+    /* bands do overlap, so each merges the change of its band back into e atomically. Without */
+    /* super-voxels the items are whole slices, and adjacent slices are not updated concurrently */
+    queue.Nitems = NQueueSlices*NSV;
+    queue.Item = (int *)get_spc(queue.Nitems, sizeof(int));
+    queue.Taken = (char *)get_spc(queue.Nitems, sizeof(char));
+    queue.Active = (char *)get_spc(queue.Nitems, sizeof(char));
+    for (j = 0; j < queue.Nitems; j++)
+        queue.Active[j] = 0;
+
+    /* With NH-ICD, partial sweeps between the full sweeps only update the voxels that changed the */
+    /* most on their last update, which are the ones far from convergence */
+    sweep.UpdateMagnitude = NULL;
+    if (reconparams.NHICD)
+    {
+        sweep.UpdateMagnitude = (float *)get_spc(N, sizeof(float));
+        for (j = 0; j < N; j++)
+            sweep.UpdateMagnitude[j] = 0;
+    }
+    sweep.FullSweep = 1;
+    sweep.NHThreshold = 0;
+
+    /* Voxels that were zero before and after their last update, with all their neighbors, are */
+    /* skipped without reading their column or neighbors, as are large regions of air. Only the */
+    /* QGGMRF prior is known to keep them at zero */
+    sweep.ZeroSkip = NULL;
+    if (reconparams.ZeroSkip && reconparams.ReconType == MBIR_MODULAR_RECONTYPE_QGGMRF_3D)
+    {
+        sweep.ZeroSkip = (char *)get_spc(N, sizeof(char));
+        for (j = 0; j < N; j++)
+            sweep.ZeroSkip[j] = 0;
+    }
+    sweep.Revalidate = 1;
+
+    /* Slices connected by the prior along z, for the cost change of an update */
+    NzPrior = (reconparams.Halo ? Nz+2 : Nz/reconparams.NDatasets);
+
+    /* Slices of the volume, and the starting halo slices of the slabs */
+    NzTotal = Nz;
+    if (comm != NULL)
+    {
+        stats[0] = Nz;
+        SlabCommSum3D(comm, stats, 1);
+        NzTotal = (int)stats[0];
+        SlabCommExchange3D(comm, x, Nz);
+    }
+
+    /* Starting point of the cost tracked between exact evaluations */
+    cost = 0;
+    if (reconparams.CostInterval > 1)
+        cost = SlabCost3D(e, Image, sinogram, &reconparams, comm);
+
     stop_FLAG = 0;
+    seed = (unsigned int)time(NULL);
     start = time(NULL);  /* XW: starting time */
     
     /****************************************/
@@ -98,97 +278,272 @@ void MBIRReconstruct3D(
     printf("\nStarting Iterative Reconstruction ... \n\n");
     for (it = 0; ((equits < MaxIterations) && (it < 10*MaxIterations) && (stop_FLAG == 0)); it++)
     {
-        
-        shuffle(order, N);        /* shuffle the coordinate and update pixels randomly for faster convergence */
-        
         TotalValueChange = 0.0; /* sum of absolute change in value of all pixels */
         NumUpdatedVoxels=0; /* number of updated pixels */
         TotalVoxelValue=0;
+        CostChange = 0;
+        NItemsDone = 0;
+        if (reconparams.NHICD)
+        {
+            sweep.FullSweep = (it%(NHICD_PARTIAL_SWEEPS+1) == 0);
+            if (!sweep.FullSweep)
+                sweep.NHThreshold = NHICDThreshold3D(sweep.UpdateMagnitude, ImageReconMask, Nxy, Nz);
+        }
+        NumZeroSkipped = 0;
+        if (sweep.ZeroSkip != NULL)
+        {
+            sweep.Revalidate = (it%ZERO_SKIP_REVALIDATE == 0);
+            if (!sweep.Revalidate)
+                for (j = 0; j < N; j++)
+                    NumZeroSkipped += (ImageReconMask[j%Nxy] && sweep.ZeroSkip[j]);
+        }
+
+        /* shuffle the coordinate and update pixels randomly for faster convergence */
+        /* Each slice has its own random sequence, so threads don't share the state of rand() */
+        for (jz = 0; jz < Nz; jz++)
+        {
+            state = (seed ^ (unsigned int)(it*Nz + jz)*2654435761u) | 1;
+            shuffle_r(&svorder[jz*NSV], NSV, &state);
+        }
+        /* Slices are interleaved, so that concurrent updates tend to be in different slices */
+        for (m = 0; m < NSV; m++)
+        for (jz = 0; jz < NQueueSlices; jz++)
+        {
+            queue.Item[m*NQueueSlices + jz] = jz*NSV + svorder[jz*NSV + m];
+            queue.Taken[m*NQueueSlices + jz] = 0;
+        }
+        queue.Head = 0;
+        queue.Releases = 0;
         
-        for (l = 0; l < N; l++)
+        #pragma omp parallel reduction(+:TotalValueChange, NumUpdatedVoxels, TotalVoxelValue, CostChange)
         {
-            if(l%(N/20)==0)  //Update progress approximately every 5%
+            struct ICDInfo icd_info; /* Local Cost Function Information */
+            struct SparseColumn A_scratch; /* Holds computed or remapped columns */
+            struct SVBuffer band; /* Sinogram band of the super-voxel being updated */
+            unsigned int state;
+            int n, jz, l, j, s, XYPixelIndex, SliceIndex, done, Selected;
+            float voxel, diff, *theta1, *theta2, *diffs, *e_line, *w_line;
+            long *ViewOffset_line;
+            char zero_skip_FLAG;
+
+            icd_info.Rparams = reconparams;
+            icd_info.Nxy = Nxy;
+            icd_info.ViewOffset = ViewOffset;
+            icd_info.SV = NULL;
+            icd_info.Theta2 = Theta2;
+            icd_info.Prior = &prior;
+            AllocateSysMatrix2DColumn(A, &A_scratch);
+            if (SV.FirstChannel != NULL)
             {
-                printf("\rIteration %d -- Progress = %2.f%%",it+1,(float)l/N*100.0); fflush(stdout);
+                band.e = (float *)get_spc(SV.MaxBandSize*Nline, sizeof(float));
+                band.w = (float *)get_spc(SV.MaxBandSize*Nline, sizeof(float));
+                band.e0 = (float *)get_spc(SV.MaxBandSize*Nline, sizeof(float));
+                band.ViewOffset = (long *)get_spc(NViews, sizeof(long));
+                icd_info.SV = &band;
             }
-            j = order[l];          /* Voxel index from randomized list */
-            XYPixelIndex = j%Nxy ; /* Pixel Index within a given slice */
-            SliceIndex = j/Nxy ;   /* Slice Index*/
-
-            if (ImageReconMask[XYPixelIndex]) /* Pixel is within ROI */
+            theta1 = theta2 = diffs = NULL;
+            if (reconparams.VoxelLines)
             {
-                /*****ICD - Local Cost Function Parameters *******/
-                icd_info.v = x[SliceIndex][XYPixelIndex];  /* store the voxel value before update */
-                icd_info.VoxelIndex = j;                    /* Index of voxel to be updated */
+                theta1 = (float *)get_spc(Nz, sizeof(float));
+                theta2 = (float *)get_spc(Nz, sizeof(float));
+                diffs = (float *)get_spc(Nz, sizeof(float));
+            }
 
-                /* Skip update only if Pixel=0, PixelNeighborhood=0 and System-matrix column for that pixel is a 0 vector */
-                zero_skip_FLAG = 0;
+            while ((n = NextSVItem3D(&queue, &SV, NQueueSlices)) >= 0)
+            {
+                jz = queue.Item[n]/NSV;
+                s = queue.Item[n]%NSV;
+                SliceIndex = jz;
+                state = (seed ^ (unsigned int)(it*Nz*NSV + queue.Item[n])*2654435761u) | 1;
 
-                if(reconparams.ReconType == MBIR_MODULAR_RECONTYPE_QGGMRF_3D)
+                if (!SVSelected3D(&SV, s, jz, (reconparams.VoxelLines ? Nz : 1), Nxy, ImageReconMask, &sweep))
+                    ; /* Nothing to update in this super-voxel in this sweep */
+                else if (reconparams.VoxelLines)
                 {
-                    ExtractNeighbors3D(&icd_info, Image);  /* extract voxel neighorborhood */
+                    e_line = eT;
+                    w_line = wT;
+                    ViewOffset_line = ViewOffset;
+                    if (icd_info.SV != NULL)
+                    {
+                        GatherSVBand3D(&SV, s, NViews, NChannels, Nz, eT, wT, &band);
+                        e_line = band.e;
+                        w_line = band.w;
+                        ViewOffset_line = band.ViewOffset;
+                    }
+                    shuffle_r(&order[SV.Start[s]], SV.Start[s+1] - SV.Start[s], &state);
 
-                    /* use if(fabs(a)<EPSILON) instead of if(a==0.0) when a is float, where EPSILON is a very small float close to 0 */
-                    if (fabs(icd_info.v) <= EPSILON && A->column[XYPixelIndex].Nnonzero==0)
+                    for (l = SV.Start[s]; l < SV.Start[s+1]; l++)
                     {
-                        zero_skip_FLAG = 1;	/* If all 11 pixels in the neighborhood system is zero. Then skip this pixel update */
-                        for (k = 0; k < 10; k++)
+                        XYPixelIndex = order[l];
+                        Selected = 0;
+                        for (SliceIndex = 0; SliceIndex < Nz && !Selected; SliceIndex++)
+                            Selected = (SelectVoxel3D(&sweep, SliceIndex*Nxy + XYPixelIndex) > 0);
+                        if (ImageReconMask[XYPixelIndex] && Selected)
                         {
-                            if (icd_info.neighbors[k] > EPSILON) /* is neighbor non-zero */
+                            icd_info.A_column = GetSysMatrixColumn(A, XYPixelIndex, &A_scratch);
+                            ICDThetaLine3D(e_line, w_line, ViewOffset_line, Nz, icd_info.A_column, A->ValueType, theta1, (Theta2 != NULL) ? NULL : theta2);
+                            /* Slices are updated in turn, as each only changes its own slice of e */
+                            for (SliceIndex = 0; SliceIndex < Nz; SliceIndex++)
                             {
-                                zero_skip_FLAG = 0;
-                                break;
+                                icd_info.v = x[SliceIndex][XYPixelIndex];
+                                icd_info.VoxelIndex = SliceIndex*Nxy + XYPixelIndex;
+                                diffs[SliceIndex] = 0;
+                                if (SelectVoxel3D(&sweep, icd_info.VoxelIndex) <= 0)
+                                    continue;
+                                if (SetupVoxelUpdate3D(&icd_info, Image, &reconparams, SliceIndex, XYPixelIndex) == 0)
+                                {
+                                    icd_info.theta1 = theta1[SliceIndex];
+                                    icd_info.theta2 = (Theta2 != NULL) ? Theta2[icd_info.VoxelIndex] : theta2[SliceIndex];
+                                    voxel = ICDPriorStep3D(&icd_info);
+                                    x[SliceIndex][XYPixelIndex] = ((voxel < 0.0) ? 0.0 : voxel);  /* clip to non-negative */
+                                    diffs[SliceIndex] = x[SliceIndex][XYPixelIndex] - icd_info.v;
+                                    TotalValueChange += fabs(diffs[SliceIndex]);
+                                    TotalVoxelValue += icd_info.v ; /* using previous pixel value here */
+                                    NumUpdatedVoxels++ ;
+                                }
+                                RecordVoxelUpdate3D(&sweep, &icd_info, x[SliceIndex][XYPixelIndex], diffs[SliceIndex]);
+                                if (reconparams.CostInterval > 1)
+                                    CostChange += ICDCostChange3D(&icd_info, x[SliceIndex][XYPixelIndex], NzPrior);
                             }
+                            UpdateErrorLine3D(e_line, ViewOffset_line, Nz, icd_info.A_column, A->ValueType, diffs);
                         }
                     }
+
+                    if (icd_info.SV != NULL)
+                        CostChange += ScatterSVBand3D(&SV, s, NViews, NChannels, Nz, &band, eT);
                 }
-                else if(reconparams.ReconType == MBIR_MODULAR_RECONTYPE_PandP)
+                else
                 {
-                    icd_info.proxv = reconparams.proximalmap[SliceIndex][XYPixelIndex];
+                    if (icd_info.SV != NULL)
+                        GatherSVBand3D(&SV, s, NViews, NChannels, 1, e[jz], w[jz], &band);
+                    shuffle_r(&order[jz*Nxy + SV.Start[s]], SV.Start[s+1] - SV.Start[s], &state);
+
+                    for (l = SV.Start[s]; l < SV.Start[s+1]; l++)
+                    {
+                        XYPixelIndex = order[jz*Nxy + l]; /* Pixel Index within the slice, from randomized list */
+                        j = SliceIndex*Nxy + XYPixelIndex; /* Voxel index */
+
+                        if (ImageReconMask[XYPixelIndex] && SelectVoxel3D(&sweep, j) > 0) /* Pixel is within ROI (and selected) */
+                        {
+                            /*****ICD - Local Cost Function Parameters *******/
+                            icd_info.v = x[SliceIndex][XYPixelIndex];  /* store the voxel value before update */
+                            icd_info.VoxelIndex = j;                    /* Index of voxel to be updated */
+                            icd_info.A_column = GetSysMatrixColumn(A, XYPixelIndex, &A_scratch);
+
+                            zero_skip_FLAG = SetupVoxelUpdate3D(&icd_info, Image, &reconparams, SliceIndex, XYPixelIndex);
+                            diff = 0;
+                        
+                            if (zero_skip_FLAG == 0)
+                            {
+                                    voxel = ICDStep3D(e, w, A, &icd_info);  /* pixel is the updated pixel value */
+                                    x[SliceIndex][XYPixelIndex] = ((voxel < 0.0) ? 0.0 : voxel);  /* clip to non-negative */
+                                    diff = x[SliceIndex][XYPixelIndex] - icd_info.v;
+                                    TotalValueChange += fabs(diff);
+                                    UpdateError3D(e, A, diff, &icd_info);   /* update the error term e= e - A * delta(x) */
+                            
+                                    TotalVoxelValue += icd_info.v ; /* using previous pixel value here */
+                                    NumUpdatedVoxels++ ;
+                            }
+                            RecordVoxelUpdate3D(&sweep, &icd_info, x[SliceIndex][XYPixelIndex], diff);
+                            if (reconparams.CostInterval > 1)
+                                CostChange += ICDCostChange3D(&icd_info, x[SliceIndex][XYPixelIndex], NzPrior);
+                        }
+                    }
+
+                    if (icd_info.SV != NULL)
+                        CostChange += ScatterSVBand3D(&SV, s, NViews, NChannels, 1, &band, e[jz]);
                 }
-                else
+                #pragma omp critical (SVQueue)
                 {
-                    fprintf(stderr,"Error** Unrecognized ReconType in ICD update\n");
-                    exit(-1);
+                    queue.Active[queue.Item[n]] = 0;
+                    #pragma omp atomic update
+                    queue.Releases++;
                 }
-                
-                if (zero_skip_FLAG == 0)
+
+                #pragma omp atomic capture
+                done = ++NItemsDone;
+                if((20*done)/queue.Nitems != (20*(done-1))/queue.Nitems)  //Update progress approximately every 5%
                 {
-                        voxel = ICDStep3D(e, w, A, &icd_info);  /* pixel is the updated pixel value */
-                        x[SliceIndex][XYPixelIndex] = ((voxel < 0.0) ? 0.0 : voxel);  /* clip to non-negative */
-                        diff = x[SliceIndex][XYPixelIndex] - icd_info.v;
-                        TotalValueChange += fabs(diff);
-                        UpdateError3D(e, A, diff, &icd_info);   /* update the error term e= e - A * delta(x) */
-                    
-                        TotalVoxelValue += icd_info.v ; /* using previous pixel value here */
-                        NumUpdatedVoxels++ ;
+                    printf("\rIteration %d -- Progress = %2.f%%",it+1,(float)done/queue.Nitems*100.0); fflush(stdout);
                 }
             }
+            FreeSysMatrix2DColumn(&A_scratch);
+            if (icd_info.SV != NULL)
+            {
+                free((void *)band.e);
+                free((void *)band.w);
+                free((void *)band.e0);
+                free((void *)band.ViewOffset);
+            }
+            if (reconparams.VoxelLines)
+            {
+                free((void *)theta1);
+                free((void *)theta2);
+                free((void *)diffs);
+            }
         }
-        
-        cost = MAPCostFunction3D(e, Image, sinogram, &reconparams);
+
+        if (comm != NULL)
+        {
+            /* The other slabs see the updated edge slices in their next sweep */
+            SlabCommExchange3D(comm, x, Nz);
+            stats[0] = TotalValueChange;
+            stats[1] = NumUpdatedVoxels;
+            stats[2] = TotalVoxelValue;
+            stats[3] = CostChange;
+            stats[4] = NumZeroSkipped;
+            SlabCommSum3D(comm, stats, 5);
+            TotalValueChange = stats[0];
+            NumUpdatedVoxels = (long)stats[1];
+            TotalVoxelValue = stats[2];
+            CostChange = stats[3];
+            NumZeroSkipped = (long)stats[4];
+        }
+
         if(NumUpdatedVoxels>0)
         {
             avg_update = TotalValueChange/NumUpdatedVoxels;
             AvgVoxelValue = TotalVoxelValue/NumUpdatedVoxels;
-            if(AvgVoxelValue>0)
+            if(AvgVoxelValue>0 && sweep.FullSweep)
                 ratio = (avg_update/AvgVoxelValue)*100;
         }
         else
             avg_update=0;
         
-        equits += (float)NumUpdatedVoxels /(Nmask*Nz);
-        fprintf(stdout,"\rIteration %-2d, cost=%-15f, AvgUpdate=%f mm^-1\n",it+1,cost,avg_update);
-        
-        if (ratio < StopThreshold || NumUpdatedVoxels==0)
+        equits += (double)NumUpdatedVoxels /((double)Nmask*NzTotal);
+
+        /* Partial sweeps update the voxels with the largest changes, so only full sweeps are checked */
+        if (sweep.FullSweep && (ratio < StopThreshold || NumUpdatedVoxels==0))
             stop_FLAG = 1;
+
+        /* The cost is tracked from the changes of the updates, and recomputed exactly every */
+        /* CostInterval iterations and at the last one, which also keeps rounding from building up */
+        ExactCost = (reconparams.CostInterval <= 1 || (it+1)%reconparams.CostInterval == 0 || stop_FLAG || equits >= MaxIterations || it+1 >= 10*MaxIterations);
+        if (ExactCost)
+        {
+            if (reconparams.VoxelLines)
+            {
+                for (i = 0; i < M; i++)
+                for (jz = 0; jz < Nz; jz++)
+                    e[jz][i] = eT[(long)i*Nz + jz];
+            }
+            cost = SlabCost3D(e, Image, sinogram, &reconparams, comm);
+        }
+        else
+            cost += CostChange;
+
+        /* A tracked cost is printed as cost~ */
+        if (sweep.ZeroSkip != NULL)
+            fprintf(stdout,"\rIteration %-2d, cost%c%-15f, AvgUpdate=%f mm^-1, ZeroSkipped=%ld (%.1f%%)\n",it+1,ExactCost ? '=' : '~',cost,avg_update,NumZeroSkipped,100.0*NumZeroSkipped/((double)Nmask*NzTotal));
+        else
+            fprintf(stdout,"\rIteration %-2d, cost%c%-15f, AvgUpdate=%f mm^-1\n",it+1,ExactCost ? '=' : '~',cost,avg_update);
     }
     
     fprintf(stdout,"\n");
 
     if (stop_FLAG == 1)
         fprintf(stdout,"Reached stopping condition.\n");
-    else if (StopThreshold> 0)
+    else if (StopThreshold> 0 && !reconparams.Halo) /* a slab is visited for a few iterations at a time */
         fprintf(stdout,"WARNING: Didn't reach stopping condition.\n");
 
     fprintf(stdout,"Reconstruction time: %.3f seconds\n",difftime(time(NULL),start));
@@ -198,6 +553,429 @@ void MBIRReconstruct3D(
     fprintf(stdout, "Average Update to Average Voxel-Value Ratio = %f %% \n", ratio);
     
     free((void *)order);
+    free((void *)svorder);
+    free((void *)queue.Item);
+    free((void *)queue.Taken);
+    free((void *)queue.Active);
+    free((void *)ViewOffset);
+    if (!reconparams.InPlaceError)
+        multifree(e,2);
+    if (Theta2 != NULL)
+        free((void *)Theta2);
+    if (sweep.UpdateMagnitude != NULL)
+        free((void *)sweep.UpdateMagnitude);
+    if (sweep.ZeroSkip != NULL)
+        free((void *)sweep.ZeroSkip);
+    if (reconparams.VoxelLines)
+    {
+        free((void *)eT);
+        free((void *)wT);
+    }
+    FreeSuperVoxels3D(&SV);
+
+    return stop_FLAG;
+}
+
+
+/* Without super-voxels, the items of the queue are whole slices and adjacent slices are not */
+/* updated concurrently, so with fewer than 2 slices per thread some threads would stay idle. */
+/* With voxel lines, the items hold all slices at once, so there would be a single item. A single */
+/* thread gains nothing from them, so it keeps voxel-wise ICD, which converges in fewer iterations */
+int SuperVoxelLength3D(struct ReconParams *reconparams, int Nz)
+{
+    int NThreads = omp_get_max_threads();
+
+    if (reconparams->SVLength != MBIR_MODULAR_SVLENGTH_AUTO)
+        return reconparams->SVLength;
+    if (NThreads > 1 && (reconparams->VoxelLines || Nz < 2*NThreads))
+        return AUTO_SV_LENGTH;
+    return 0;
+}
+
+/* Partition the slice into super-voxels of SVLength x SVLength pixels (smaller at the right and */
+/* bottom edges), and find the sinogram band of each from the columns of its pixels within the ROI */
+void ComputeSuperVoxels3D(
+    struct SuperVoxels3D *SV,
+    int SVLength,
+    int Nx,
+    int Ny,
+    char *ImageReconMask,
+    struct SysMatrix2D *A)
+{
+    int NSVx, NSVy, NViews, NChannels, s, n, jx, jy;
+
+    NViews = A->params.NViews;
+    NChannels = A->params.NChannels;
+    if (SVLength <= 0)
+    {
+        NSVx = NSVy = 1;
+        SVLength = (Nx > Ny) ? Nx : Ny;
+    }
+    else
+    {
+        NSVx = (Nx + SVLength - 1)/SVLength;
+        NSVy = (Ny + SVLength - 1)/SVLength;
+    }
+    SV->NSV = NSVx*NSVy;
+    SV->NSVx = NSVx;
+    SV->NSVy = NSVy;
+    SV->Start = (int *)get_spc(SV->NSV + 1, sizeof(int));
+
+    SV->Pixel = (int *)get_spc(Nx*Ny, sizeof(int));
+    SV->FirstChannel = NULL;
+    SV->NChannels = NULL;
+    SV->MaxBandSize = 0;
+
+    n = 0;
+    for (s = 0; s < SV->NSV; s++)
+    {
+        SV->Start[s] = n;
+        for (jy = (s/NSVx)*SVLength; jy < Ny && jy < (s/NSVx + 1)*SVLength; jy++)
+        for (jx = (s%NSVx)*SVLength; jx < Nx && jx < (s%NSVx + 1)*SVLength; jx++)
+            SV->Pixel[n++] = jy*Nx + jx;
+    }
+    SV->Start[SV->NSV] = n;
+
+    if (SV->NSV == 1)
+        return;
+
+    SV->FirstChannel = (int *)get_spc((size_t)SV->NSV*NViews, sizeof(int));
+    SV->NChannels = (int *)get_spc((size_t)SV->NSV*NViews, sizeof(int));
+
+    printf("\nComputing sinogram bands of %d super-voxels ... \n", SV->NSV);
+
+    #pragma omp parallel
+    {
+        struct SparseColumn A_scratch, *A_column;
+        int s, l, r, v, first, last, *LastChannel;
+        long BandSize;
+
+        AllocateSysMatrix2DColumn(A, &A_scratch);
+        LastChannel = (int *)get_spc(NViews, sizeof(int));
+
+        #pragma omp for schedule(dynamic)
+        for (s = 0; s < SV->NSV; s++)
+        {
+            for (v = 0; v < NViews; v++)
+            {
+                SV->FirstChannel[s*NViews + v] = NChannels;
+                LastChannel[v] = -1;
+            }
+            for (l = SV->Start[s]; l < SV->Start[s+1]; l++)
+            if (ImageReconMask[SV->Pixel[l]])
+            {
+                A_column = GetSysMatrixColumn(A, SV->Pixel[l], &A_scratch);
+                for (r = 0; r < A_column->Nrun; r++)
+                {
+                    v = A_column->Run[r].View;
+                    first = A_column->Run[r].FirstChannel;
+                    last = first + A_column->Run[r].Length - 1;
+                    if (first < SV->FirstChannel[s*NViews + v])
+                        SV->FirstChannel[s*NViews + v] = first;
+                    if (last > LastChannel[v])
+                        LastChannel[v] = last;
+                }
+            }
+            BandSize = 0;
+            for (v = 0; v < NViews; v++)
+            {
+                if (LastChannel[v] < 0)
+                {
+                    SV->FirstChannel[s*NViews + v] = 0;
+                    SV->NChannels[s*NViews + v] = 0;
+                }
+                else
+                    SV->NChannels[s*NViews + v] = LastChannel[v] - SV->FirstChannel[s*NViews + v] + 1;
+                BandSize += SV->NChannels[s*NViews + v];
+            }
+            #pragma omp critical (SuperVoxelBandSize)
+            {
+                if (BandSize > SV->MaxBandSize)
+                    SV->MaxBandSize = BandSize;
+            }
+        }
+        free((void *)LastChannel);
+        FreeSysMatrix2DColumn(&A_scratch);
+    }
+}
+
+
+void FreeSuperVoxels3D(struct SuperVoxels3D *SV)
+{
+    free((void *)SV->Start);
+    free((void *)SV->Pixel);
+    if (SV->FirstChannel != NULL)
+    {
+        free((void *)SV->FirstChannel);
+        free((void *)SV->NChannels);
+    }
+}
+
+
+/* Set up the local cost function of voxel (SliceIndex, XYPixelIndex), apart from theta1 and theta2 */
+/* icd_info->v and icd_info->A_column must be set. Returns 1 if the update can be skipped */
+static char SetupVoxelUpdate3D(
+    struct ICDInfo *icd_info,
+    struct Image3D *Image,
+    struct ReconParams *reconparams,
+    int SliceIndex,
+    int XYPixelIndex)
+{
+    int k;
+    char zero_skip_FLAG;
+
+    /* Skip update only if Pixel=0, PixelNeighborhood=0 and System-matrix column for that pixel is a 0 vector */
+    zero_skip_FLAG = 0;
+
+    if(reconparams->ReconType == MBIR_MODULAR_RECONTYPE_QGGMRF_3D)
+    {
+        ExtractNeighbors3D(icd_info, Image);  /* extract voxel neighorborhood */
+
+        /* use if(fabs(a)<EPSILON) instead of if(a==0.0) when a is float, where EPSILON is a very small float close to 0 */
+        if (fabs(icd_info->v) <= EPSILON && icd_info->A_column->Nnonzero==0)
+        {
+            zero_skip_FLAG = 1;	/* If all 11 pixels in the neighborhood system is zero. Then skip this pixel update */
+            for (k = 0; k < 10; k++)
+            {
+                if (icd_info->neighbors[k] > EPSILON) /* is neighbor non-zero */
+                {
+                    zero_skip_FLAG = 0;
+                    break;
+                }
+            }
+        }
+    }
+    else if(reconparams->ReconType == MBIR_MODULAR_RECONTYPE_PandP)
+    {
+        icd_info->proxv = reconparams->proximalmap[SliceIndex][XYPixelIndex];
+    }
+    else
+    {
+        fprintf(stderr,"Error** Unrecognized ReconType in ICD update\n");
+        exit(-1);
+    }
+
+    return zero_skip_FLAG;
+}
+
+
+/* 1 if voxel j is updated in this sweep, 0 if a partial sweep doesn't select it, */
+/* -1 if it is skipped as zero */
+static int SelectVoxel3D(struct SweepSelection *sweep, int j)
+{
+    if (!sweep->FullSweep && sweep->UpdateMagnitude[j] < sweep->NHThreshold)
+        return 0;
+    if (sweep->ZeroSkip != NULL && !sweep->Revalidate && sweep->ZeroSkip[j])
+        return -1;
+    return 1;
+}
+
+/* Record the outcome of the update of a voxel (with its neighbors in icd_info) for later sweeps */
+static void RecordVoxelUpdate3D(
+    struct SweepSelection *sweep,
+    struct ICDInfo *icd_info,
+    float UpdatedValue,
+    float diff)
+{
+    int k;
+    char zero;
+
+    if (sweep->UpdateMagnitude != NULL)
+        sweep->UpdateMagnitude[icd_info->VoxelIndex] = fabs(diff);
+    if (sweep->ZeroSkip != NULL)
+    {
+        zero = (fabs(icd_info->v) <= EPSILON && fabs(UpdatedValue) <= EPSILON);
+        for (k = 0; k < 10 && zero; k++)
+            zero = (icd_info->neighbors[k] <= EPSILON);
+        sweep->ZeroSkip[icd_info->VoxelIndex] = zero;
+    }
+}
+
+/* Whether super-voxel s has a voxel within the ROI to update in this sweep, in slices */
+/* FirstSlice to FirstSlice+NSlices-1 */
+static char SVSelected3D(
+    struct SuperVoxels3D *SV,
+    int s,
+    int FirstSlice,
+    int NSlices,
+    int Nxy,
+    char *ImageReconMask,
+    struct SweepSelection *sweep)
+{
+    int l, jz;
+
+    for (l = SV->Start[s]; l < SV->Start[s+1]; l++)
+    if (ImageReconMask[SV->Pixel[l]])
+        for (jz = FirstSlice; jz < FirstSlice+NSlices; jz++)
+            if (SelectVoxel3D(sweep, jz*Nxy + SV->Pixel[l]) > 0)
+                return 1;
+    return 0;
+}
+
+
+static int CompareFloatDescending(const void *a, const void *b)
+{
+    float fa = *(const float *)a, fb = *(const float *)b;
+
+    return (fa < fb) - (fa > fb);
+}
+
+
+/* Threshold on the last update magnitude that selects NHICD_FRACTION of the voxels within the ROI */
+/* The threshold is found from a regular sample of the voxels if there are many */
+static float NHICDThreshold3D(
+    float *UpdateMagnitude,
+    char *ImageReconMask,
+    int Nxy,
+    int Nz)
+{
+    long j, N, stride;
+    int n;
+    float *sample, threshold;
+
+    N = (long)Nxy*Nz;
+    stride = N/NHICD_MAX_SAMPLES + 1;
+    sample = (float *)get_spc(N/stride + 1, sizeof(float));
+    n = 0;
+    for (j = 0; j < N; j += stride)
+        if (ImageReconMask[j%Nxy])
+            sample[n++] = UpdateMagnitude[j];
+
+    if (n == 0)
+    {
+        free((void *)sample);
+        return 0;
+    }
+    qsort(sample, n, sizeof(float), CompareFloatDescending);
+    threshold = sample[(int)(NHICD_FRACTION*(n-1))];
+    free((void *)sample);
+
+    return threshold;
+}
+
+
+/* Hand out the first item of the queue that has no prior neighbors being updated, and mark it */
+/* active. Waits while all remaining items have active neighbors; returns -1 when none are left. */
+/* The wait is outside the critical section, until another item is done, so that the threads */
+/* releasing their items don't compete for it with those waiting */
+static int NextSVItem3D(
+    struct SVQueue *queue,
+    struct SuperVoxels3D *SV,
+    int Nz)
+{
+    int n, found, dx, dy, dz, jz, sx, sy, NSV, releases, current;
+
+    NSV = SV->NSV;
+    do
+    {
+        found = -1;
+        #pragma omp critical (SVQueue)
+        {
+            while (queue->Head < queue->Nitems && queue->Taken[queue->Head])
+                queue->Head++;
+            for (n = queue->Head; n < queue->Nitems && found < 0; n++)
+            if (!queue->Taken[n])
+            {
+                jz = queue->Item[n]/NSV;
+                sx = (queue->Item[n]%NSV)%SV->NSVx;
+                sy = (queue->Item[n]%NSV)/SV->NSVx;
+                found = n;
+                /* The prior wraps around at the image edges, and so do the neighbors here */
+                for (dz = -1; dz <= 1 && found >= 0; dz++)
+                for (dy = -1; dy <= 1 && found >= 0; dy++)
+                for (dx = -1; dx <= 1 && found >= 0; dx++)
+                    if (queue->Active[((jz+dz+Nz)%Nz)*NSV + ((sy+dy+SV->NSVy)%SV->NSVy)*SV->NSVx + (sx+dx+SV->NSVx)%SV->NSVx])
+                        found = -1;
+            }
+            if (found >= 0)
+            {
+                queue->Taken[found] = 1;
+                queue->Active[queue->Item[found]] = 1;
+            }
+            else if (queue->Head == queue->Nitems)
+                found = -2;
+            #pragma omp atomic read
+            releases = queue->Releases;
+        }
+        if (found == -1)
+        {
+            do
+            {
+                sched_yield();
+                #pragma omp atomic read
+                current = queue->Releases;
+            } while (current == releases);
+        }
+    } while (found == -1);
+
+    return (found >= 0) ? found : -1;
+}
+
+
+/* Copy the sinogram band of super-voxel s from e and w into the buffers of band. Each entry of */
+/* e and w is Nline consecutive values: 1 for a slice, or Nz for voxel lines */
+static void GatherSVBand3D(
+    struct SuperVoxels3D *SV,
+    int s,
+    int NViews,
+    int NChannels,
+    int Nline,
+    float *e,
+    float *w,
+    struct SVBuffer *band)
+{
+    int v, first, count;
+    long offset = 0;
+
+    for (v = 0; v < NViews; v++)
+    {
+        first = SV->FirstChannel[s*NViews + v];
+        count = SV->NChannels[s*NViews + v];
+        band->ViewOffset[v] = offset - first;
+        memcpy(&band->e[offset*Nline], &e[((long)v*NChannels + first)*Nline], count*Nline*sizeof(float));
+        memcpy(&band->e0[offset*Nline], &band->e[offset*Nline], count*Nline*sizeof(float));
+        memcpy(&band->w[offset*Nline], &w[((long)v*NChannels + first)*Nline], count*Nline*sizeof(float));
+        offset += count;
+    }
+}
+
+
+/* Merge the change of the error in the band of super-voxel s back into its slice of e (the weights */
+/* are unchanged). Super-voxels updated concurrently may change the same entries, so the change is */
+/* added atomically. Returns the change of the likelihood term e^T W e/2 from the merge, which is exact */
+/* even for concurrent super-voxels, as it is taken against the value of e each change is added to */
+static double ScatterSVBand3D(
+    struct SuperVoxels3D *SV,
+    int s,
+    int NViews,
+    int NChannels,
+    int Nline,
+    struct SVBuffer *band,
+    float *e)
+{
+    int v, n, first, count;
+    long offset = 0;
+    float *e_view, delta, e_old;
+    double change = 0;
+
+    for (v = 0; v < NViews; v++)
+    {
+        first = SV->FirstChannel[s*NViews + v];
+        count = SV->NChannels[s*NViews + v]*Nline;
+        e_view = &e[((long)v*NChannels + first)*Nline];
+        for (n = 0; n < count; n++)
+        {
+            delta = band->e[offset + n] - band->e0[offset + n];
+            if (delta != 0)
+            {
+                #pragma omp atomic capture
+                { e_old = e_view[n]; e_view[n] += delta; }
+                change += band->w[offset + n]*(e_old + 0.5*delta)*delta;
+            }
+        }
+        offset += count;
+    }
+    return change;
 }
 
 
@@ -208,11 +986,13 @@ float MAPCostFunction3D(
     struct Sino3DParallel *sinogram,
     struct ReconParams *reconparams)
 {
-    int i, M, jx, jy, jz, jxy, Nx, Ny, Nz, Nxy, plusx, minusx, plusy, plusz ;
+    int jz, Nx, Ny, Nz, M, NzDataset ;
     float **x ;
     float **w ;
-    float nloglike, nlogprior_nearest, nlogprior_diag, nlogprior_interslice ;
+    double *SliceCost, cost ;
+    struct QGGMRFPrior prior;
     
+    QGGMRF_InitPrior(&prior, reconparams);
     x = Image->image;
     w = sinogram->weight;
     
@@ -220,56 +1000,123 @@ float MAPCostFunction3D(
     Nx = Image->imgparams.Nx;
     Ny = Image->imgparams.Ny;
     Nz = Image->imgparams.Nz; 
-    Nxy = Nx*Ny;
-    
-    nloglike = 0.0;
+    NzDataset = Nz/reconparams->NDatasets; /* Slices of one dataset of a batch */
 
-    for (jz = 0; jz < Nz; jz++)
-    for (i = 0; i < M; i++)
-        nloglike += e[jz][i]*w[jz][i]*e[jz][i];
+    /* Slices are summed in parallel, each into its own entry of SliceCost, and the entries are then */
+    /* added up in order, so that the cost doesn't depend on the number of threads */
+    SliceCost = (double *)get_spc(Nz, sizeof(double));
 
-    nloglike /= 2.0;
-    nlogprior_nearest = 0.0;
-    nlogprior_diag = 0.0;
-    nlogprior_interslice = 0.0;
-    
+    #pragma omp parallel for schedule(dynamic)
     for (jz = 0; jz < Nz; jz++)
-    for (jy = 0; jy < Ny; jy++)
-    for (jx = 0; jx < Nx; jx++)
     {
-        plusx = jx + 1;
-        plusx = ((plusx < Nx) ? plusx : 0);
-        minusx = jx - 1;
-        minusx = ((minusx < 0) ? Nx-1 : minusx);
-        plusy = jy + 1;
-        plusy = ((plusy < Ny) ? plusy : 0);
+        int i, jx, jy, jxy, plusx, minusx, plusy, plusz;
+        double nloglike, nlogprior_nearest, nlogprior_diag, nlogprior_interslice ;
+
+        nloglike = 0.0;
+        #pragma omp simd reduction(+:nloglike)
+        for (i = 0; i < M; i++)
+            nloglike += e[jz][i]*w[jz][i]*e[jz][i];
+
+        nlogprior_nearest = 0.0;
+        nlogprior_diag = 0.0;
+        nlogprior_interslice = 0.0;
+
         plusz = jz + 1;
-        plusz = ((plusz < Nz) ? plusz : 0);
+        if (!reconparams->Halo)
+            plusz = ((plusz%NzDataset != 0) ? plusz : plusz-NzDataset); /* wraps around within the dataset */
+
+        for (jy = 0; jy < Ny; jy++)
+        for (jx = 0; jx < Nx; jx++)
+        {
+            plusx = jx + 1;
+            plusx = ((plusx < Nx) ? plusx : 0);
+            minusx = jx - 1;
+            minusx = ((minusx < 0) ? Nx-1 : minusx);
+            plusy = jy + 1;
+            plusy = ((plusy < Ny) ? plusy : 0);
 
-        jxy = jy*Nx + jx; /* XY pixel Index */
+            jxy = jy*Nx + jx; /* XY pixel Index */
 
-        /* Trick to avoid computing the contribution of pair-wise cliques twice */
-        nlogprior_nearest += QGGMRF_Potential((x[jz][jxy] - x[jz][jy*Nx+plusx]), reconparams);
-        nlogprior_nearest += QGGMRF_Potential((x[jz][jxy] - x[jz][plusy*Nx+jx]),reconparams);
+            /* Trick to avoid computing the contribution of pair-wise cliques twice */
+            nlogprior_nearest += QGGMRF_PriorPotential((x[jz][jxy] - x[jz][jy*Nx+plusx]),&prior);
+            nlogprior_nearest += QGGMRF_PriorPotential((x[jz][jxy] - x[jz][plusy*Nx+jx]),&prior);
 
-        nlogprior_diag += QGGMRF_Potential((x[jz][jxy] - x[jz][plusy*Nx+minusx]),reconparams);
-        nlogprior_diag += QGGMRF_Potential((x[jz][jxy] - x[jz][plusy*Nx+plusx]),reconparams);
+            nlogprior_diag += QGGMRF_PriorPotential((x[jz][jxy] - x[jz][plusy*Nx+minusx]),&prior);
+            nlogprior_diag += QGGMRF_PriorPotential((x[jz][jxy] - x[jz][plusy*Nx+plusx]),&prior);
 
-        nlogprior_interslice += QGGMRF_Potential((x[jz][jxy] - x[plusz][jxy]),reconparams);
+            nlogprior_interslice += QGGMRF_PriorPotential((x[jz][jxy] - x[plusz][jxy]),&prior);
+            if (reconparams->Halo && jz == 0) /* and the cliques with the halo slice below the slab */
+                nlogprior_interslice += QGGMRF_PriorPotential((x[jz][jxy] - x[-1][jxy]),&prior);
+        }
+
+        SliceCost[jz] = nloglike/2.0 + reconparams->b_nearest * nlogprior_nearest + reconparams->b_diag * nlogprior_diag + reconparams->b_interslice * nlogprior_interslice ;
     }
 
-    return (nloglike + reconparams->b_nearest * nlogprior_nearest + reconparams->b_diag * nlogprior_diag + reconparams->b_interslice * nlogprior_interslice) ;
+    cost = 0.0;
+    for (jz = 0; jz < Nz; jz++)
+        cost += SliceCost[jz];
+    free((void *)SliceCost);
+
+    return cost ;
+}
+
+
+/* The cost of the whole volume, if the slab is one of those of comm: the cost of each slab leaves out */
+/* its cliques with the halo slice below it, which are those of the slab below with its halo above */
+static float SlabCost3D(
+    float **e,
+    struct Image3D *Image,
+    struct Sino3DParallel *sinogram,
+    struct ReconParams *reconparams,
+    struct SlabComm3D *comm)
+{
+    struct QGGMRFPrior prior;
+    double cost, HaloCost;
+    float **x;
+    int j, Nxy;
+
+    cost = MAPCostFunction3D(e, Image, sinogram, reconparams);
+    if (comm == NULL)
+        return cost;
+
+    QGGMRF_InitPrior(&prior, reconparams);
+    x = Image->image;
+    Nxy = Image->imgparams.Nx * Image->imgparams.Ny;
+    HaloCost = 0.0;
+    for (j = 0; j < Nxy; j++)
+        HaloCost += QGGMRF_PriorPotential((x[0][j] - x[-1][j]),&prior);
+    cost -= reconparams->b_interslice * HaloCost;
+    SlabCommSum3D(comm, &cost, 1);
+    return cost;
+}
+
+
+/* Allocate and compute A times X */
+float **ForwardProjection3D(struct Image3D *X, struct SysMatrix2D *A)
+{
+    float **AX;
+    int jz, i, M = A->params.NViews * A->params.NChannels;
+
+    AX = (float **)multialloc(sizeof(float),2,X->imgparams.Nz,M);
+    for (jz = 0; jz < X->imgparams.Nz; jz++)
+    for (i = 0; i < M; i++)
+        AX[jz][i] = 0;
+    forwardProject3D(AX, X, A);
+    return AX;
 }
 
 
 /* compute A times X, A-matrix is pre-computed */
+/* The columns are fetched once, a block at a time, each by one of the threads. Each thread then */
+/* adds up the entries of its own range of views for all columns of the block, in column order, */
+/* so the result doesn't depend on the number of threads */
 void forwardProject3D(
-                      float **AX,           /* Note : Vector AX must be initiliazed to zero */
+                      float **AX,           /* Note : A times X is added to AX, so it must be initiliazed to zero */
                       struct Image3D *X,
                       struct SysMatrix2D *A)
 {
-    int j,k,n, jz, Nxy, NSlices ;
-    struct SparseColumn A_column;
+    int j,k,n,r,m,b, jz, Nxy, NSlices, FirstColumn, NBlock ;
+    struct SparseColumn *Column, *Scratch;
     float AValue;
     
     printf("\nComputing Forward Projection ... \n");
@@ -282,26 +1129,92 @@ void forwardProject3D(
         fprintf(stderr,"Error in forwardProject3D : dimensions of System Matrix and Image are not compatible \n");
         exit(-1);
     }
-    
 
-    for (j = 0; j < A->Ncolumns; j++) /* j is the PixelIndex within a single XY-slice, independent of slice index */
+    Column = (struct SparseColumn *)get_spc(FORWARD_BLOCK_COLUMNS, sizeof(struct SparseColumn));
+    Scratch = (struct SparseColumn *)get_spc(FORWARD_BLOCK_COLUMNS, sizeof(struct SparseColumn));
+    for (b = 0; b < FORWARD_BLOCK_COLUMNS; b++)
+        AllocateSysMatrix2DColumn(A, &Scratch[b]);
+    
+    #pragma omp parallel private(j,k,n,r,m,b,jz,FirstColumn,NBlock,AValue)
     {
-        A_column = A->column[j]; /* As system matrix does not vary with slice for 3-D parallel beam geometry */
-        if (A_column.Nnonzero > 0)
+        int NThreads, FirstView, EndView;
+
+        NThreads = omp_get_num_threads();
+        FirstView = (long)omp_get_thread_num()*A->params.NViews/NThreads;
+        EndView = (long)(omp_get_thread_num()+1)*A->params.NViews/NThreads;
+
+        for (FirstColumn = 0; FirstColumn < A->Ncolumns; FirstColumn += FORWARD_BLOCK_COLUMNS)
         {
-            for (n = 0; n < A_column.Nnonzero; n++)
+            NBlock = (A->Ncolumns - FirstColumn < FORWARD_BLOCK_COLUMNS) ? A->Ncolumns - FirstColumn : FORWARD_BLOCK_COLUMNS;
+
+            #pragma omp for schedule(dynamic)
+            for (b = 0; b < NBlock; b++)
+                Column[b] = *GetSysMatrixColumn(A, FirstColumn + b, &Scratch[b]); /* As system matrix does not vary with slice for 3-D parallel beam geometry */
+
+            for (b = 0; b < NBlock; b++)
             {
-                k = A_column.RowIndex[n]  ; /* (View,Detector-Channel) pair  */
-                AValue = A_column.Value[n];
+                j = FirstColumn + b; /* j is the PixelIndex within a single XY-slice, independent of slice index */
+                n = 0;
+                for (r = 0; r < Column[b].Nrun; r++)
+                {
+                    if (Column[b].Run[r].View < FirstView || Column[b].Run[r].View >= EndView)
+                    {
+                        n += Column[b].Run[r].Length;
+                        continue;
+                    }
+                    k = Column[b].Run[r].View*A->params.NChannels + Column[b].Run[r].FirstChannel; /* (View,Detector-Channel) pair of first entry */
+                    for (m = 0; m < Column[b].Run[r].Length; m++, n++)
+                    {
+                        if (A->ValueType == SYSMATRIX2D_VALUE_UINT8)
+                            AValue = Column[b].Scale*Column[b].Value8[n];
+                        else if (A->ValueType == SYSMATRIX2D_VALUE_UINT16)
+                            AValue = Column[b].Scale*Column[b].Value16[n];
+                        else
+                            AValue = Column[b].Value[n];
 
-                for(jz=0;jz<NSlices;jz++)   /* vary slice index */
-                    AX[jz][k] += AValue*X->image[jz][j] ; /* Voxel index = j+jz*Nxy */
+                        for(jz=0;jz<NSlices;jz++)   /* vary slice index */
+                            AX[jz][k+m] += AValue*X->image[jz][j] ; /* Voxel index = j+jz*Nxy */
+                    }
+                }
             }
+            #pragma omp barrier /* before the columns of the next block replace these */
         }
     }
+
+    for (b = 0; b < FORWARD_BLOCK_COLUMNS; b++)
+        FreeSysMatrix2DColumn(&Scratch[b]);
+    free((void *)Scratch);
+    free((void *)Column);
 }
 
 
+/* Random number generator (xorshift) with its state held by the caller, so threads can each use their own */
+static unsigned int RandomUInt(unsigned int *state)
+{
+    unsigned int r = *state;
+
+    r ^= r << 13;
+    r ^= r >> 17;
+    r ^= r << 5;
+    *state = r;
+    return r;
+}
+
+/* shuffle the coordinate to enable random update, with a random sequence of the caller */
+/* state must not be 0 */
+void shuffle_r(int *order, int len, unsigned int *state)
+{
+    int i, j, tmp;
+    
+    for (i = 0; i < len-1; i++)
+    {
+        j = i + (RandomUInt(state) % (len-i));
+        tmp = order[j];
+        order[j] = order[i];
+        order[i] = tmp;
+    }
+}
+
 /* shuffle the coordinate to enable random update */
 void shuffle(int *order, int len)
 {
@@ -2,13 +2,39 @@
 #define _RECON_3D_H_
 
 #include "MBIRModularDefs.h"
+#include "comm_3D.h"
 
-void MBIRReconstruct3D(struct Image3D *Image, struct Sino3DParallel *sinogram, struct ReconParams reconparams, struct SysMatrix2D *A, char *ImageReconMask);
+/* Partition of a slice into square super-voxels, with the sinogram band of each super-voxel */
+/* (per view, the range of channels touched by the columns of its pixels within the ROI) */
+struct SuperVoxels3D
+{
+    int NSV;            /* Number of super-voxels in a slice */
+    int NSVx, NSVy;     /* Super-voxel s is at column s%NSVx and row s/NSVx of an NSVx x NSVy grid */
+    int *Start;         /* Pixels of super-voxel s are Pixel[Start[s]] to Pixel[Start[s+1]-1] */
+    int *Pixel;         /* XY pixel indices, grouped by super-voxel */
+    int *FirstChannel;  /* [s*NViews+View] first channel in the band of super-voxel s; NULL if voxel-wise */
+    int *NChannels;     /* [s*NViews+View] number of channels in the band (0 if the view is not touched) */
+    long MaxBandSize;   /* Largest number of sinogram entries in the band of a super-voxel */
+};
+
+
+int MBIRReconstruct3D(struct Image3D *Image, struct Sino3DParallel *sinogram, struct ReconParams reconparams, struct SysMatrix2D *A, char *ImageReconMask, float **AX, struct SlabComm3D *comm);
 
 float MAPCostFunction3D(float **e, struct Image3D *Image, struct Sino3DParallel *sinogram, struct ReconParams *reconparams);
 
 void forwardProject3D(float **AX, struct Image3D *X, struct SysMatrix2D *A); /* Compute A-matrix times X */
+float **ForwardProjection3D(struct Image3D *X, struct SysMatrix2D *A); /* Allocate and compute A-matrix times X */
+
+/* Side of the super-voxels of a reconstruction of Nz slices: reconparams->SVLength, or if it is */
+/* MBIR_MODULAR_SVLENGTH_AUTO, AUTO_SV_LENGTH when several threads have too few slices to update */
+/* whole slices concurrently, or use voxel lines, whose updates each take all slices; else 0 */
+int SuperVoxelLength3D(struct ReconParams *reconparams, int Nz);
+
+/* Super-voxels of side SVLength; SVLength<=0 gives a single group of all pixels, updated voxel-wise */
+void ComputeSuperVoxels3D(struct SuperVoxels3D *SV, int SVLength, int Nx, int Ny, char *ImageReconMask, struct SysMatrix2D *A);
+void FreeSuperVoxels3D(struct SuperVoxels3D *SV);
 
 void shuffle(int *order, int len);
+void shuffle_r(int *order, int len, unsigned int *state); /* Reentrant, with the state of the random sequence held by the caller */
 
 #endif
@@ -0,0 +1,300 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+#include "MBIRModularDefs.h"
+#include "MBIRModularUtils.h"
+#include "allocate.h"
+#include "initialize_3D.h"
+#include "recon_3D.h"
+#include "slab_3D.h"
+#include "memory_3D.h"
+
+/* Each visit of a slab runs SLAB_VISIT_ITERATIONS (equivalent) iterations, which makes up for */
+/* the forward projection that sets up the error sinogram of the slab at every visit */
+#define SLAB_VISIT_ITERATIONS 2
+
+static long SysMatrixBytes3D(struct SysMatrix2D *A);
+static void InitializeSlab3D(struct CmdLineMBIR *cmdline, struct ImageParams3D *imgparams, struct ReconParams *reconparams, char *ImageReconMask, int FirstSlice, int NSlices);
+static int ReconstructSlab3D(struct CmdLineMBIR *cmdline, struct ImageParams3D *imgparams, struct SinoParams3DParallel *sinoparams, struct ReconParams reconparams,
+    struct SysMatrix2D *A, char *ImageReconMask, int FirstSlice, int NSlices, char Initialize, struct SlabComm3D *comm);
+static void WriteSlab3D(struct CmdLineMBIR *cmdline, struct Image3D *Image);
+
+
+/* Memory (bytes) held by the System Matrix */
+static long SysMatrixBytes3D(struct SysMatrix2D *A)
+{
+    long ValueSize;
+
+    if (A->MapAddr != NULL)
+        return (long)A->MapLength + A->Nstored*(long)sizeof(struct SparseColumn);
+    if (A->ComputeColumn != NULL)
+        return (long)A->NCacheColumns*(A->MaxColumnNnonzero*(long)(sizeof(float) + sizeof(struct SparseRun))
+             + (long)(sizeof(int) + sizeof(struct SparseColumn)));
+
+    ValueSize = (A->ValueType == SYSMATRIX2D_VALUE_UINT8) ? 1 : ((A->ValueType == SYSMATRIX2D_VALUE_UINT16) ? 2 : sizeof(float));
+    return A->Nnonzero*ValueSize + A->Nrun*(long)sizeof(struct SparseRun)
+         + 2*(A->Nstored+1)*(long)sizeof(long) + A->Nstored*(long)sizeof(struct SparseColumn);
+}
+
+
+/* Slab reconstruction */
+/* The slices are split into slabs of about equal size. Slab by slab, the initial image is written to */
+/* the output image files, which then hold the current estimate of the volume. The slabs are then */
+/* visited in turn, SLAB_VISIT_ITERATIONS iterations at a time: the sinogram, weights and image of the */
+/* slab are read with the halo slices just below and above it, which are the z neighbors of the prior */
+/* for the slices at its edges (wrapping around at the ends of the volume, as without slabs), and the */
+/* updated slices are written back. This goes on until every slab reaches the stopping condition in */
+/* the same pass, or after MaxIterations iterations of each slab */
+void MBIRReconstructSlabs3D(
+    struct CmdLineMBIR *cmdline,
+    struct ImageParams3D *imgparams,
+    struct SinoParams3DParallel *sinoparams,
+    struct ReconParams reconparams)
+{
+    struct SysMatrix2D A;
+    struct SysMatrixGeom3DParallel geom; /* for the matrix-free mode */
+    float **pix_prof;
+    char *ImageReconMask;
+    struct ReconParams visit;
+    int Nz, NSlabSlices, NSlabs, NPasses, pass, k, FirstSlice, NSlices, converged;
+
+    Nz = imgparams->Nz;
+
+#ifdef __GLIBC__
+    /* The arrays of each slab visit are freed at its end. glibc raises its mmap threshold past */
+    /* arrays freed that way, so that the next ones would pile up in the heap instead */
+    mallopt(M_MMAP_THRESHOLD, 128*1024);
+#endif
+
+    SetupSysMatrix3D(cmdline, sinoparams, imgparams, &A, &geom, &pix_prof);
+    ImageReconMask = GenImageReconMask(imgparams);
+
+    NSlabSlices = MemoryPlanSlabSlices3D(cmdline->MemoryBudget, SysMatrixBytes3D(&A), RuntimeMemory3D(cmdline), cmdline->ScalarWeights, imgparams, sinoparams, &reconparams);
+    if (NSlabSlices == 0)
+    {
+        fprintf(stderr, "Error : the System Matrix and a single slice don't fit in the memory budget of %.1f MB\n", cmdline->MemoryBudget);
+        exit(-1);
+    }
+    NSlabs = (Nz + NSlabSlices - 1)/NSlabSlices;
+    NSlabSlices = (Nz + NSlabs - 1)/NSlabs;
+
+    if (IsVolume3D(cmdline->SinoDataFile,"3Dsinodata"))
+        CreateImageVolume3D(cmdline->ReconImageDataFile, imgparams);
+
+    if (NSlabs == 1)
+    {
+        /* Everything fits: a single slab of the whole volume, wrapping around in z */
+        fprintf(stdout, "Reconstructing all %d slices within the memory budget of %.1f MB\n", Nz, cmdline->MemoryBudget);
+        ReconstructSlab3D(cmdline, imgparams, sinoparams, reconparams, &A, ImageReconMask, 0, Nz, 1, NULL);
+    }
+    else
+    {
+        fprintf(stdout, "Reconstructing %d slices in %d slabs of up to %d slices within the memory budget of %.1f MB\n",
+            Nz, NSlabs, NSlabSlices, cmdline->MemoryBudget);
+
+        for (FirstSlice = 0; FirstSlice < Nz; FirstSlice += NSlabSlices)
+        {
+            NSlices = ((FirstSlice + NSlabSlices <= Nz) ? NSlabSlices : Nz - FirstSlice);
+            InitializeSlab3D(cmdline, imgparams, &reconparams, ImageReconMask, FirstSlice, NSlices);
+        }
+
+        visit = reconparams;
+        visit.MaxIterations = SLAB_VISIT_ITERATIONS;
+        visit.Halo = 1;
+        NPasses = (reconparams.MaxIterations + SLAB_VISIT_ITERATIONS - 1)/SLAB_VISIT_ITERATIONS;
+        converged = 0;
+        for (pass = 0; pass < NPasses && !converged; pass++)
+        {
+            converged = 1;
+            for (k = 0, FirstSlice = 0; FirstSlice < Nz; k++, FirstSlice += NSlabSlices)
+            {
+                NSlices = ((FirstSlice + NSlabSlices <= Nz) ? NSlabSlices : Nz - FirstSlice);
+                fprintf(stdout, "\nPass %d, slab %d of %d (slices %d to %d)\n", pass+1, k+1, NSlabs,
+                    imgparams->FirstSliceNumber + FirstSlice, imgparams->FirstSliceNumber + FirstSlice + NSlices - 1);
+                if (!ReconstructSlab3D(cmdline, imgparams, sinoparams, visit, &A, ImageReconMask, FirstSlice, NSlices, 0, NULL))
+                    converged = 0;
+            }
+        }
+
+        fprintf(stdout, "\n");
+        if (converged)
+            fprintf(stdout, "All slabs reached stopping condition in pass %d.\n", pass);
+        else if (reconparams.StopThreshold > 0)
+            fprintf(stdout, "WARNING: Didn't reach stopping condition in %d passes over the slabs.\n", pass);
+    }
+
+    FreeSysMatrix3D(cmdline, &A, &geom, pix_prof);
+    free((void *)ImageReconMask);
+}
+
+
+/* Distributed reconstruction */
+/* Each process of comm reconstructs a slab of about the same number of slices, all of them at the */
+/* same time, holding only the sinogram, weights and image of its slab. After every sweep, the edge */
+/* slices of each slab are sent to the processes of the slabs below and above, where they are the */
+/* halo slices, and the statistics of the sweep are added up over all slabs, so that all processes */
+/* stop together. Each process writes the slices of its slab to the output image */
+void MBIRReconstructDistributed3D(
+    struct CmdLineMBIR *cmdline,
+    struct ImageParams3D *imgparams,
+    struct SinoParams3DParallel *sinoparams,
+    struct ReconParams reconparams,
+    struct SlabComm3D *comm)
+{
+    struct SysMatrix2D A;
+    struct SysMatrixGeom3DParallel geom; /* for the matrix-free mode */
+    float **pix_prof;
+    char *ImageReconMask;
+    int Nz, FirstSlice, NSlices;
+
+    Nz = imgparams->Nz;
+    if (comm->NRanks > Nz)
+    {
+        fprintf(stderr, "Error : %d processes for %d slices; each process needs a slice at least\n", comm->NRanks, Nz);
+        exit(-1);
+    }
+    FirstSlice = (int)((long)Nz*comm->Rank/comm->NRanks);
+    NSlices = (int)((long)Nz*(comm->Rank+1)/comm->NRanks) - FirstSlice;
+
+    SetupSysMatrix3D(cmdline, sinoparams, imgparams, &A, &geom, &pix_prof);
+    ImageReconMask = GenImageReconMask(imgparams);
+
+    fprintf(stdout, "Reconstructing %d slices in %d slabs, one per process\n", Nz, comm->NRanks);
+
+    /* The output volume is created before any process writes its slab */
+    if (comm->Rank == 0 && IsVolume3D(cmdline->SinoDataFile,"3Dsinodata"))
+        CreateImageVolume3D(cmdline->ReconImageDataFile, imgparams);
+    SlabCommBarrier3D(comm);
+
+    reconparams.Halo = 1;
+    ReconstructSlab3D(cmdline, imgparams, sinoparams, reconparams, &A, ImageReconMask, FirstSlice, NSlices, 1, comm);
+
+    FreeSysMatrix3D(cmdline, &A, &geom, pix_prof);
+    free((void *)ImageReconMask);
+}
+
+
+/* Write the initial image of slices FirstSlice to FirstSlice+NSlices-1 to the output image */
+static void InitializeSlab3D(
+    struct CmdLineMBIR *cmdline,
+    struct ImageParams3D *imgparams,
+    struct ReconParams *reconparams,
+    char *ImageReconMask,
+    int FirstSlice,
+    int NSlices)
+{
+    struct Image3D Image;
+
+    Image.imgparams = *imgparams;
+    Image.imgparams.FirstSliceNumber = imgparams->FirstSliceNumber + FirstSlice;
+    Image.imgparams.Nz = NSlices;
+    AllocateImageData3D(&Image);
+    Initialize_Image(&Image, cmdline->InitImageDataFile, ImageReconMask, reconparams->InitImageValue, 0);
+    WriteSlab3D(cmdline, &Image);
+    FreeImageData3D(&Image);
+}
+
+/* Reconstruct slices FirstSlice to FirstSlice+NSlices-1, initialized as without slabs if Initialize, */
+/* or else read from the output image, and write them to the output image */
+/* With reconparams.Halo, the halo slices are read from the output image too, or received from the */
+/* other slabs if comm is not NULL */
+/* Returns 1 if the stopping condition was reached */
+static int ReconstructSlab3D(
+    struct CmdLineMBIR *cmdline,
+    struct ImageParams3D *imgparams,
+    struct SinoParams3DParallel *sinoparams,
+    struct ReconParams reconparams,
+    struct SysMatrix2D *A,
+    char *ImageReconMask,
+    int FirstSlice,
+    int NSlices,
+    char Initialize,
+    struct SlabComm3D *comm)
+{
+    struct Sino3DParallel sinogram;
+    struct Image3D Slab;    /* The slices of the slab with the halo slices, if any, around them */
+    struct Image3D Image;   /* The slices of the slab */
+    struct Image3D Halo;
+    struct Image3D ProxMap;
+    int Nz, k, stop;
+
+    Nz = imgparams->Nz;
+
+    /* Sinogram and weights of the slab */
+    sinogram.sinoparams = *sinoparams;
+    sinogram.sinoparams.FirstSliceNumber = sinoparams->FirstSliceNumber + FirstSlice;
+    sinogram.sinoparams.NSlices = NSlices;
+    sinogram.sinoparams.ViewAngles = (float *)get_spc(sinoparams->NViews, sizeof(float));
+    memcpy(sinogram.sinoparams.ViewAngles, sinoparams->ViewAngles, sinoparams->NViews*sizeof(float));
+    if (cmdline->ScalarWeights)
+        AllocateSinoScalarWeights3DParallel(&sinogram, cmdline->ScalarWeight);
+    else
+        AllocateSinoData3DParallel(&sinogram);
+    if(ReadSinoData3DParallel(cmdline->SinoDataFile, &sinogram))
+    {   fprintf(stderr, "Error in reading sinogram data from file %s through function ReadSinoData3DParallel \n",cmdline->SinoDataFile);
+        exit(-1);
+    }
+    if(!cmdline->ScalarWeights && ReadWeights3D(cmdline->SinoWeightsFile, &sinogram))
+    {   fprintf(stderr, "Error in reading sinogram weights from file %s through function ReadWeights3D \n", cmdline->SinoWeightsFile);
+        exit(-1);
+    }
+
+    /* Image of the slab, between the halo slices */
+    Slab.imgparams = *imgparams;
+    Slab.imgparams.Nz = NSlices + 2*reconparams.Halo;
+    AllocateImageData3D(&Slab);
+    Image = Slab;
+    Image.image = &Slab.image[reconparams.Halo];
+    Image.imgparams.FirstSliceNumber = imgparams->FirstSliceNumber + FirstSlice;
+    Image.imgparams.Nz = NSlices;
+    if (Initialize)
+        Initialize_Image(&Image, cmdline->InitImageDataFile, ImageReconMask, reconparams.InitImageValue, 0);
+    else
+        ReadImage3D(cmdline->ReconImageDataFile, &Image);
+    for (k = 0; k < 2 && reconparams.Halo && comm == NULL; k++)
+    {
+        Halo = Slab;
+        Halo.image = &Slab.image[(k == 0) ? 0 : NSlices+1];
+        Halo.imgparams.FirstSliceNumber = imgparams->FirstSliceNumber + ((k == 0) ? (FirstSlice + Nz - 1)%Nz : (FirstSlice + NSlices)%Nz);
+        Halo.imgparams.Nz = 1;
+        ReadImage3D(cmdline->ReconImageDataFile, &Halo);
+    }
+
+    if (reconparams.ReconType == MBIR_MODULAR_RECONTYPE_PandP)
+    {
+        ProxMap.imgparams = Image.imgparams;
+        AllocateImageData3D(&ProxMap);
+        ReadImage3D(cmdline->ProxMapImageDataFile, &ProxMap);
+        reconparams.proximalmap = ProxMap.image;
+    }
+
+    stop = MBIRReconstruct3D(&Image, &sinogram, reconparams, A, ImageReconMask, NULL, comm);
+
+    WriteSlab3D(cmdline, &Image);
+
+    if (reconparams.ReconType == MBIR_MODULAR_RECONTYPE_PandP)
+        FreeImageData3D(&ProxMap);
+    FreeImageData3D(&Slab);
+    if(FreeSinoData3DParallel(&sinogram))
+    {  fprintf(stderr, "Error sinogram memory could not be freed through function FreeSinoData3DParallel \n");
+        exit(-1);
+    }
+
+    return stop;
+}
+
+/* Write the slices of a slab to the output image, which is a volume if the projections are */
+static void WriteSlab3D(struct CmdLineMBIR *cmdline, struct Image3D *Image)
+{
+    if(IsVolume3D(cmdline->SinoDataFile,"3Dsinodata"))
+        WriteImageVolumeSlices3D(cmdline->ReconImageDataFile, Image);
+    else if(WriteImage3D(cmdline->ReconImageDataFile, Image))
+    {
+        fprintf(stderr, "Error in writing out reconstructed image file through function WriteImage3D \n");
+        exit(-1);
+    }
+}
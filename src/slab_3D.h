@@ -0,0 +1,24 @@
+#ifndef _SLAB_3D_H_
+#define _SLAB_3D_H_
+
+#include "MBIRModularDefs.h"
+#include "initialize_3D.h"
+#include "comm_3D.h"
+
+/* Reconstruct the slices of imgparams in slabs that fit in cmdline->MemoryBudget (see MemoryPlanSlabSlices3D), */
+/* streaming the sinogram, weights and image of each slab from and to the files of cmdline */
+void MBIRReconstructSlabs3D(
+	struct CmdLineMBIR *cmdline,
+	struct ImageParams3D *imgparams,
+	struct SinoParams3DParallel *sinoparams,
+	struct ReconParams reconparams);
+
+/* Reconstruct the slices of imgparams together with the other processes of comm, each process a slab */
+void MBIRReconstructDistributed3D(
+	struct CmdLineMBIR *cmdline,
+	struct ImageParams3D *imgparams,
+	struct SinoParams3DParallel *sinoparams,
+	struct ReconParams reconparams,
+	struct SlabComm3D *comm);
+
+#endif